@@ -1,6 +1,11 @@
 #include <Arduino.h>
 #include <EEPROM.h>
 #include <ArduinoJson.h>
+#if defined(__AVR__)
+#include <avr/power.h>
+#include <avr/sleep.h>
+#include <avr/wdt.h>
+#endif
 
 // Define all the pins first
 // LED 
@@ -8,12 +13,36 @@
 
 
 
-// Add timing constants
+// Add timing constants (defaults, the live values are in config[] and can be changed with `cfg`)
 const unsigned long POWER_CHECK_DELAY = 1000;    // Time to wait for power source to stabilize
 const unsigned long LOAD_CHECK_DELAY = 2000;     // Time to wait for load to stabilize
 const unsigned long ALARM_DURATION = 5000;       // How long alarm should sound
 const unsigned long LED_UPDATE_INTERVAL = 250;   // How often to update LED status
 const unsigned long SERIAL_UPDATE_INTERVAL = 500; // How often to send serial data
+const unsigned long WARM_UP_TIME = 30;           // Seconds the generator runs unloaded before the transfer
+const unsigned long COOL_DOWN_TIME = 60;         // Seconds it runs unloaded after the load went back to grid
+const unsigned long RETRANSFER_TIME = 30;        // Seconds the grid must stay good before the load goes back to it
+const unsigned long GRID_V_SCALE = 0;            // Grid volts per 100 ADC counts RMS on grid_sense, 0 = no band checks
+const unsigned long GRID_V_MIN = 190;            // Grid voltage band, volts
+const unsigned long GRID_V_MAX = 255;
+const unsigned long GRID_V_HYST = 10;
+const unsigned long GRID_F_MIN = 475;            // Grid frequency band, 0.1 Hz
+const unsigned long GRID_F_MAX = 525;
+const unsigned long GRID_F_HYST = 5;
+const unsigned long GEN_LOAD_FULL = 1023;        // gen_load_sense reading at the generator's rated output
+const unsigned long SHED_LEVEL = 90;             // Generator load that sheds a circuit, percent
+const unsigned long RESTORE_LEVEL = 70;          // Generator load below which circuits reconnect, percent
+const unsigned long PRESTART_LEVEL = 70;         // Outage risk that pre-starts the generator, percent, 0 = never
+const unsigned long DEAD_TIME = 20;              // ms between one source's contacts opening and the other's closing
+const unsigned long CONFIRM_TIME = 60;           // Semi-auto proposal timeout, seconds, 0 = wait for an answer
+const unsigned long CONFIRM_APPLY = 1;           // On timeout: 1 = apply the proposal, 0 = drop it
+const unsigned long ASSIST_LEVEL = 80;           // Load per running unit that starts another one, percent, 0 = never
+const unsigned long IDLE_SLEEP = 1;              // 1 = sleep between loop passes, 0 = spin
+const unsigned long ZC_SYNC = 1;                 // 1 = close source relays on a voltage zero crossing, 0 = at once
+const unsigned long SOFT_LEVEL = 5;              // Voltage dip a load step must recover to within, percent, 0 = no soft start
+const unsigned long CRANK_TIME = 5;              // Seconds of one crank attempt, for units with a crank output
+const unsigned long CRANK_REST = 10;             // Seconds the starter rests between attempts
+const unsigned long CRANK_TRIES = 3;             // Attempts before a unit counts as failed to start
 
 // Add timing variables
 unsigned long lastPowerCheckTime = 0;
@@ -36,21 +65,125 @@ const int select_button = 11;
 // Define power sources availability
 const int grid_check = A1;
 const int generator_check = A2;
+#if defined(__AVR_ATmega2560__)
+const int load_check = A11;  // the Mega's A3 has no pin change interrupt, its A8-A15 do
+#define LOAD_CHECK_PCINT_vect PCINT2_vect
+#else
 const int load_check = A3;
+#define LOAD_CHECK_PCINT_vect PCINT1_vect
+#endif
 
-// Define relays
-const int grid_relay = A6;
+// AC voltage sense (stepped down and biased to mid-rail), sampled by the ADC for the waveform stream.
+// Both sit on the Nano's analog-only pins A6 and A7.
+const int generator_sense = A6;
+const int grid_sense = A7;
+
+// Define relays (on pins that can drive an output: the Nano's A6 and A7 are analog inputs only)
+const int grid_relay = A0;
 const int generator_relay = A5;
-const int load_relay = 12;
+const int load_relay = 12;   // main load circuit, load channel 0
 
 // Bluetooth module is on Serial (TX/RX)
+// HC-05 KEY/EN pin, held high to put the module in AT command mode
+const int bt_key_pin = 13;
 
 // Alarm pin
 const int alarm_pin = A4;
 
+// Generator start/run output, kept on through warm-up, cool-down and pre-start. The Nano has no
+// pin left, so there the generator runs while generator_relay is closed and cool-down and
+// pre-start are skipped.
+const int NO_PIN = -1;
+#if defined(__AVR_ATmega2560__)
+const int gen_run_pin = 25;
+#else
+const int gen_run_pin = NO_PIN;
+#endif
+
+// Load circuits. Channel 0 is the main circuit on load_relay: the mode logic switches it and it is
+// never shed. The others follow it, one at a time, each `reconnect` ms after the last switching,
+// and while the generator carries them they are shed by priority when its measured load gets too
+// high; the highest priority number goes first.
+struct LoadChannel {
+  int pin;
+  uint8_t priority;
+  uint16_t reconnect;   // ms
+};
+#if defined(__AVR_ATmega2560__)
+const LoadChannel loadChannels[] = {
+  { load_relay, 0, 0 },
+  { 22, 1, 5000 },
+  { 23, 2, 5000 },
+  { 24, 3, 10000 },
+};
+// DC output of a current transducer on the generator feed, rated output at gen_load_full
+const int gen_load_sense = A8;
+#else
+const LoadChannel loadChannels[] = {
+  { load_relay, 0, 0 },
+};
+const int gen_load_sense = NO_PIN;  // no analog input left on the Nano
+#endif
+const uint8_t LOAD_COUNT = sizeof(loadChannels) / sizeof(loadChannels[0]);
+static_assert(LOAD_COUNT <= 8, "one bit per load channel in loadsOn");
+
+// Generator units. The generator side of the transfer switch is a bus fed by one or more units,
+// each with its own run output, a ready input and a breaker onto the bus, while generator_check
+// senses the bus itself. Units are tried lowest priority number first, and among equal numbers
+// the one with the fewest run hours leads, so they take turns. While the measured load is more
+// than the running units can carry, another one is started and closed onto the bus. Paralleled
+// units need their own paralleling controllers: `ready` may only go high once a unit is in sync
+// with the bus. A unit with a crank output is cranked by the controller, in attempts of crank_s
+// with crank_rest_s between them, until it fires: its `ready` input goes high, or its AC sense
+// input, if it has one, shows it turning faster than any starter would.
+struct GenUnit {
+  int run;
+  int ready;
+  int breaker;          // NO_PIN: always connected (a single unit)
+  int crank;            // starter output, NO_PIN: the unit starts itself when `run` goes high
+  int sense;            // AC sense of the unit's output ahead of its breaker, NO_PIN: none
+  uint8_t priority;
+};
+#if defined(__AVR_ATmega2560__)
+const GenUnit genUnits[] = {
+  { gen_run_pin, 26, 27, 31, A9, 0 },
+  { 28, 29, 30, 32, A10, 0 },
+};
+#else
+const GenUnit genUnits[] = {
+  { gen_run_pin, generator_check, NO_PIN, NO_PIN, NO_PIN, 0 },
+};
+#endif
+const uint8_t GEN_COUNT = sizeof(genUnits) / sizeof(genUnits[0]);
+static_assert(GEN_COUNT <= 8, "one bit per unit in unitsFailed");
+static_assert(GEN_COUNT == 1 || gen_run_pin != NO_PIN, "paralleled units need their own run outputs");
+
 // EEPROM address to store the mode
 const int modeAddress = 0;
 const int controlModeAddress = 1;
+// Last verified relay configuration and its complement, restored first thing at boot
+const int safeRelaysAddress = 2;
+// Negotiated Bluetooth UART rate (index into linkRates) and its complement
+const int linkRateAddress = 4;
+// Watchdog and brown-out reset counts, crc16
+const int resetCountAddress = 6;
+// Timing configuration block: version, count, values, crc16
+const int configAddress = 16;
+// Runtime counter checkpoints: 4 rotating slots of 24 bytes
+const int countersAddress = 64;
+// Outage histogram: 24 hourly buckets, crc16
+const int riskAddress = 160;
+// Measured relay timing: pickup and dropout of the grid and generator relays in ms, crc16
+const int relayTimingAddress = 192;
+// Second configuration block, for the values that don't fit the first one; same layout
+const int configExtAddress = 200;
+// Event journal ring: 40 records of 6 bytes, at the top of the first 512 bytes
+const int journalAddress = 256;
+// Run seconds of each generator unit, crc16. Only kept with more than one unit, i.e. on the Mega,
+// above the 512 bytes the rest of the layout fits in.
+const int unitHoursAddress = 512;
+static_assert(GEN_COUNT == 1 || unitHoursAddress + GEN_COUNT * sizeof(uint32_t) + 2 <= E2END + 1,
+              "unit run seconds don't fit the EEPROM");
 
 // Mode states
 enum Mode { MANUAL, SEMI_AUTO, FULLY_AUTO };
@@ -60,15 +193,742 @@ Mode currentMode;
 ControlMode currentControlMode;
 
 
-// string buffer
-String receivedMessage = "";  // Buffer for incoming messages
-bool messageComplete = false; //
+// Command line buffer. A line is either a bare legacy command ("man") or a
+// framed request "@<seq> <command>" that is answered with a typed
+// acknowledgement {"ack":<seq>,"st":"ok"|"rej"|"err"}. Several lines may be
+// in flight; up to RX_LINES_PER_PASS are handled on each loop pass.
+const uint8_t RX_LINE_SIZE = 48;
+const uint8_t RX_LINES_PER_PASS = 4;
+
+enum CommandResult { RESULT_OK, RESULT_REJECTED, RESULT_ERROR };
+
+char receivedMessage[RX_LINE_SIZE];  // Buffer for incoming messages
+uint8_t receivedLength = 0;
+bool messageOverflow = false;         // line was longer than the buffer
 
 // other  variables
 boolean load_on = false;
 boolean gen_on = false;
 boolean grid_on = false;
  boolean load_fail = false;
+boolean gen_fail = false;
+
+// Fast-resume boot: the last verified relay configuration is restored with
+// direct port writes before anything else in setup(), then checked against the
+// sense inputs in the background before the mode logic takes over again.
+const unsigned long SAFE_STATE_HOLD = 10000;  // how long a relay state must hold verified before it is saved
+const uint8_t RELAY_MASK = 0x07;              // grid, generator and load bits of outputLatch
+
+uint8_t savedSafeRelays = 0;          // configuration currently stored in EEPROM
+uint8_t safeCandidate = 0;            // configuration being timed for SAFE_STATE_HOLD
+unsigned long safeCandidateSince = 0;
+boolean bootRevalidating = false;     // mode logic is held off while this is set
+boolean bootRevalidated = false;      // the restored configuration checked out
+unsigned long bootRestoreMicros = 0;  // time from reset to relays restored
+
+// Watchdog. It is enabled right after the relays are restored and fed once per
+// loop pass, at the end, and only when every part of the pass in PASS_ALL has
+// checked in and free RAM is above WATCHDOG_MIN_FREE: a hung loop, a pass that
+// no longer runs the mode logic, or a heap that has grown into the stack resets
+// the controller within 4 s, and the boot puts the last verified relays back.
+// The reset cause is taken from MCUSR before the C runtime starts.
+const uint8_t RESET_POWER_ON = 0x01;  // reset cause flags, as in MCUSR
+const uint8_t RESET_EXTERNAL = 0x02;
+const uint8_t RESET_BROWN_OUT = 0x04;
+const uint8_t RESET_WATCHDOG = 0x08;
+const int WATCHDOG_MIN_FREE = 128;    // bytes between heap and stack
+struct ResetCounts {
+  uint16_t watchdog;
+  uint16_t brownOut;
+};
+ResetCounts resetCounts;
+uint8_t resetCause = 0;
+boolean memoryLow = false;            // free RAM fell below WATCHDOG_MIN_FREE and it was reported
+const uint8_t PASS_INPUTS = 0x01;     // inputs sampled and buttons handled
+const uint8_t PASS_MODE = 0x02;       // boot revalidation or a valid mode's logic ran
+const uint8_t PASS_OUTPUTS = 0x04;    // relay, generator and load services ran
+const uint8_t PASS_STATE = 0x08;      // safe state, journal and counters are up to date
+const uint8_t PASS_ALL = 0x0F;
+uint8_t passDone = 0;                 // PASS_ bits checked in during the current pass
+unsigned long watchdogFedAt = 0;      // millis() of the last feed
+
+// Idle sleep. After each loop pass with nothing left to do (see idleBusy) the CPU
+// sleeps in idle mode until the next interrupt: the Timer0 tick behind millis()
+// (every 1.024 ms), UART receive or transmit, the load_check pin change, the
+// relay timer or the ADC. Anything the loop polls is therefore seen at most one
+// tick later than while spinning. The time asleep and the longest sleep are
+// measured over IDLE_WINDOW.
+const unsigned long IDLE_WINDOW = 10000;   // ms
+unsigned long idleMicros = 0;         // asleep in the current window
+unsigned long idleMaxMicros = 0;
+unsigned long idleWindowStart = 0;
+uint8_t idlePercent = 0;              // last window's results
+uint16_t idleLongest = 0;             // us
+unsigned long bootRestoreTime = 0;
+
+// Automatic transfer state machine. Every phase of a transfer is a state with
+// its own timer, so warm-up and cool-down never block the loop. Generator
+// cool-down runs alongside the states, since it continues after the load is
+// back on the grid.
+const unsigned long GEN_RETRY_DELAY = 30000;  // wait after a failed generator before trying again
+
+enum TransferState {
+  TS_ENTRY,         // work out the state from the relays on the next pass
+  TS_GRID_CONNECT,  // grid relay closed, checking the grid before the load goes on
+  TS_GRID,          // load on grid
+  TS_GEN_START,     // generator asked to start, waiting for its output
+  TS_WARM_UP,       // generator running unloaded
+  TS_GEN,           // load on generator
+  TS_GEN_FAILED,    // generator didn't start or dropped out, waiting to retry
+  TS_LOAD_FAILED    // load check failed, everything stays off until the mode changes
+};
+
+TransferState transferState = TS_ENTRY;
+unsigned long transferSince = 0;      // entry time of the current state
+boolean transferGridUp = false;       // grid_check level, and since when
+unsigned long transferGridSince = 0;
+boolean genCooling = false;           // generator running unloaded after a retransfer
+boolean genWarm = false;              // started again during its cool-down, skips the warm-up
+unsigned long genCoolSince = 0;
+boolean genPrestart = false;          // running unloaded because an outage looks likely
+unsigned long genPrestartSince = 0;
+unsigned long genWarmCredit = 0;      // pre-start run time that counts towards the warm-up
+
+// Generator units, see genUnits
+enum UnitState { UNIT_STOPPED, UNIT_STARTING, UNIT_ONLINE, UNIT_COOLING, UNIT_CRANKING, UNIT_RESTING };
+const uint16_t CRANK_FIRED_CHZ = 2500;    // centi-Hz on a unit's sense input that only a running engine reaches
+const uint8_t CRANK_FIRED_CYCLES = 3;     // cycles in a row at that speed
+const unsigned long ASSIST_HOLD = 60000;   // load low enough for one unit less, before it is released
+const uint8_t ASSIST_HYSTERESIS = 20;     // percent below the level that started the last unit
+boolean genDemand = false;            // the transfer logic wants the generator side running
+uint8_t unitState[GEN_COUNT];
+unsigned long unitSince[GEN_COUNT];   // entry time of the unit's state
+uint8_t unitsFailed = 0;              // bit per unit that didn't come up or dropped out
+uint8_t unitsOnline = 0;              // bit per unit on the bus
+uint8_t genWanted = 0;                // units the load needs
+unsigned long genCalmSince = 0;       // load has needed no more than genWanted - 1 units since
+unsigned long genLastPass = 0;
+uint32_t unitRunSeconds[GEN_COUNT];
+uint16_t unitRunMillis[GEN_COUNT];
+uint8_t unitCranks[GEN_COUNT];        // crank attempts of the current start
+int8_t crankWatch = -1;               // cranking unit whose sense the sampler is on
+uint8_t crankFast = 0;                // its cycles in a row at CRANK_FIRED_CHZ or faster
+
+// Semi-automatic confirmation. In SEMI_AUTO the transfer state machine runs as
+// in FULLY_AUTO, except that a move of the load to the other source is first
+// proposed: the app is told, the semi-auto LED blinks, and the transfer waits
+// for `confirm` or `deny` (or a short or long press of the select button).
+// Left unanswered it is applied or dropped after confirm_s, as confirm_apply
+// says. A proposal whose reason goes away is withdrawn, and a denied one is not
+// raised again until its reason has gone away.
+enum Proposal { PROPOSE_NONE, PROPOSE_GEN, PROPOSE_GRID };
+enum ProposalResult { PR_CONFIRMED, PR_DENIED, PR_APPLIED, PR_ABORTED, PR_WITHDRAWN };
+const unsigned long CONFIRM_HOLD = 2000;  // ms the select button is held to deny
+Proposal proposal = PROPOSE_NONE;     // waiting for an answer
+unsigned long proposalSince = 0;
+boolean proposalApproved = false;     // confirmed, applied on the next pass
+Proposal proposalDenied = PROPOSE_NONE;   // held off while its reason lasts
+Proposal proposalAsked = PROPOSE_NONE;    // asked for on the current pass
+boolean proposalPress = false;        // a select press that began on a proposal, followed until release
+unsigned long proposalPressAt = 0;
+
+// Names in Proposal and ProposalResult order, kept in flash
+const char proposalNames[] PROGMEM = "none,gen,grid";
+const char proposalResults[] PROGMEM = "confirmed,denied,applied,aborted,withdrawn";
+
+// Grid quality bands. With grid_v_scale set, grid_sense is sampled whenever no
+// stream needs the ADC for the generator, and every mains cycle is checked
+// against the voltage and frequency limits. A bad grid becomes good only once a
+// cycle falls inside the limits narrowed by the hysteresis, and a good grid
+// becomes bad once a cycle falls outside the limits themselves.
+boolean gridInBand = false;
+uint16_t gridVolts = 0;               // last measured cycle
+uint16_t gridDeciHz = 0;
+
+// Load shedding. Every LOAD_TICK the generator load is measured once and at
+// most one circuit is shed or reconnected, so a tick takes the same short time
+// whatever the number of circuits.
+const unsigned long LOAD_TICK = 250;
+const unsigned long LOAD_SHED_SETTLE = 2000;  // after a shed, before the next one
+uint8_t loadsOn = 0;                  // connected extra circuits, bit per channel (channel 0 is in outputLatch)
+boolean loadBusOn = false;            // channel 0 at the last tick
+unsigned long loadCalmSince = 0;      // last switching, or last tick the load was at restore_pct or above
+unsigned long lastShedTime = 0;
+unsigned long lastLoadTick = 0;
+uint16_t genLoad = 0;                 // percent of one unit's rated output, filtered
+
+// Source relay driver. A source relay is only ever closed through `relayClose`,
+// which opens the other one first and times the close so that its contacts
+// meet dead_time_ms after the other's have parted: the close command goes out
+// after the other relay's dropout plus the dead time, less this relay's own
+// pickup. A close that has to wait is fired by Timer1, which counts 4 us ticks;
+// one further off than RELAY_TIMER_SPAN waits in the loop until Timer1 can time
+// it. Pickup and dropout are measured on load_check whenever the load stays
+// connected across a transfer.
+enum SourceRelay { RELAY_GRID, RELAY_GEN, RELAY_NONE = -1 };
+const unsigned long RELAY_MAX_WAIT = 1000000UL;       // us, longest close delay
+const unsigned long RELAY_TIMER_SPAN = 200000UL;      // us, close delays Timer1 times, within its 262 ms wrap
+const unsigned long RELAY_MEASURE_TIME = 1000000UL;   // us after a close to wait for load_check
+const uint8_t RELAY_DEFAULT_PICKUP = 20;              // ms until measured, on the safe side: a short
+const uint8_t RELAY_DEFAULT_DROPOUT = 50;             // pickup and a long dropout widen the gap
+const uint8_t RELAY_DROPOUT_STEP = 5;                 // ms added after a transfer that showed no gap
+
+uint8_t relayPickup[2];               // ms, by SourceRelay
+uint8_t relayDropout[2];
+unsigned long relayOpenedAt[2];       // micros() of each relay's last open command
+int8_t relayPending = RELAY_NONE;     // relay whose close is waiting
+unsigned long relayPendingAt = 0;     // micros() the close was scheduled, and its delay
+unsigned long relayPendingWait = 0;
+boolean relayTimed = false;           // the pending relay's pin has a port Timer1 can drive
+boolean relayArmed = false;           // Timer1 is timing the pending close
+volatile boolean relayFired = false;  // Timer1 has closed the pending relay
+volatile unsigned long relayClosedAt = 0;
+volatile uint8_t *relayPort = 0;      // port and bit of the pending relay, for the interrupt
+uint8_t relayBit = 0;
+
+// one measurement at a time: the load_check edges after an open command with the load connected
+boolean relayMeasuring = false;       // load_check edges can be timed, so transfers are measured
+int8_t measureFrom = RELAY_NONE;      // relay opened with the load live on it
+int8_t measureTo = RELAY_NONE;        // relay closed onto the connected load
+volatile uint8_t measureEdges = 0;    // 0x01 load_check fell, 0x02 it rose again
+volatile unsigned long measureFellAt = 0;
+volatile unsigned long measureRoseAt = 0;
+uint16_t relayLastGap = 0;            // ms the load was dark in the last measured transfer
+
+// Bluetooth UART speed negotiation. The module is switched to a faster rate
+// through its AT command mode, the new rate is verified with an AT probe and
+// the controller falls back to the rate the module still answers at if
+// anything fails. The module type is found while probing: an HC-05 answers
+// "AT\r\n" with its KEY pin held high, an HC-06 a bare "AT", but only while no
+// phone is connected. The UART is only switched once it has sent everything
+// queued at the old rate, which is waited out in loop() rather than with
+// Serial.flush().
+const unsigned long linkRates[] PROGMEM = { 9600, 19200, 38400, 57600, 115200 };
+const uint8_t LINK_RATE_COUNT = sizeof(linkRates) / sizeof(linkRates[0]);
+const uint8_t LINK_DEFAULT_RATE = 0;
+const uint8_t LINK_HC06_FLAG = 0x80;             // module type bit of the stored rate
+const unsigned long LINK_REPLY_TIMEOUT = 300;    // wait for "OK" from the module
+const unsigned long LINK_RESTART_TIME = 1000;    // HC-05 reboot after AT+RESET
+
+enum LinkState { LINK_IDLE, LINK_DRAIN, LINK_PROBE, LINK_SET_RATE, LINK_RESTART, LINK_VERIFY };
+enum LinkModule { LINK_HC05, LINK_HC06 };
+
+LinkState linkState = LINK_IDLE;
+LinkState linkNext = LINK_IDLE;          // entered once the UART has drained
+LinkModule linkModule = LINK_HC05;       // module type that answered last
+uint8_t linkRate = LINK_DEFAULT_RATE;    // rate Serial runs at when idle
+uint8_t linkTarget = LINK_DEFAULT_RATE;  // rate being negotiated
+uint8_t linkUartRate = LINK_DEFAULT_RATE;  // rate Serial runs at right now
+uint8_t linkProbeRate = 0;               // rate currently being probed
+uint8_t linkProbeCount = 0;
+uint8_t linkPending = 0xFF;              // requested by `link`, started once the ack is out
+boolean linkFallingBack = false;
+boolean linkResult = false;              // reported once the UART is back on linkRate
+unsigned long linkDeadline = 0;
+char linkReply[8];
+uint8_t linkReplyLength = 0;
+
+// Runtime-tunable configuration. Loaded once at boot from two versioned,
+// CRC-protected EEPROM blocks, read from RAM everywhere else and written back
+// only when a value is changed with `cfg <name> <value>`.
+enum ConfigKey {
+  CFG_POWER_CHECK_DELAY,
+  CFG_LOAD_CHECK_DELAY,
+  CFG_ALARM_DURATION,
+  CFG_LED_UPDATE_INTERVAL,
+  CFG_SERIAL_UPDATE_INTERVAL,
+  CFG_WARM_UP_TIME,
+  CFG_COOL_DOWN_TIME,
+  CFG_RETRANSFER_TIME,
+  CFG_GRID_V_SCALE,
+  CFG_GRID_V_MIN,
+  CFG_GRID_V_MAX,
+  CFG_GRID_V_HYST,
+  CFG_GRID_F_MIN,
+  CFG_GRID_F_MAX,
+  CFG_GRID_F_HYST,
+  CFG_GEN_LOAD_FULL,
+  CFG_SHED_LEVEL,
+  CFG_RESTORE_LEVEL,
+  CFG_PRESTART_LEVEL,
+  CFG_DEAD_TIME,
+  CFG_CONFIRM_TIME,
+  CFG_CONFIRM_APPLY,
+  CFG_ASSIST_LEVEL,
+  CFG_IDLE_SLEEP,
+  CFG_ZC_SYNC,
+  CFG_SOFT_LEVEL,
+  CFG_CRANK_TIME,
+  CFG_CRANK_REST,
+  CFG_CRANK_TRIES,
+  CFG_COUNT
+};
+const uint8_t CONFIG_VERSION = 1;
+const uint8_t CONFIG_MAX_COUNT = 22;   // values that fit between configAddress and countersAddress
+const uint8_t CONFIG_EXT_MAX_COUNT = 26;  // and between configExtAddress and journalAddress
+static_assert(CFG_COUNT <= CONFIG_MAX_COUNT + CONFIG_EXT_MAX_COUNT, "config doesn't fit its EEPROM blocks");
+// values in the first block
+const uint8_t CONFIG_BASE_COUNT = (uint8_t)CFG_COUNT < CONFIG_MAX_COUNT ? (uint8_t)CFG_COUNT : CONFIG_MAX_COUNT;
+
+// Names in ConfigKey order, kept in flash
+const char configNames[] PROGMEM =
+  "power_check_delay,load_check_delay,alarm_duration,led_update_interval,serial_update_interval,"
+  "warm_up_s,cool_down_s,retransfer_s,grid_v_scale,grid_v_min,grid_v_max,grid_v_hyst,grid_f_min,"
+  "grid_f_max,grid_f_hyst,gen_load_full,shed_pct,restore_pct,prestart_pct,dead_time_ms,"
+  "confirm_s,confirm_apply,assist_pct,idle_sleep,zc_sync,soft_pct,crank_s,crank_rest_s,crank_tries";
+
+const uint16_t configDefaults[CFG_COUNT] PROGMEM = {
+  POWER_CHECK_DELAY,
+  LOAD_CHECK_DELAY,
+  ALARM_DURATION,
+  LED_UPDATE_INTERVAL,
+  SERIAL_UPDATE_INTERVAL,
+  WARM_UP_TIME,
+  COOL_DOWN_TIME,
+  RETRANSFER_TIME,
+  GRID_V_SCALE,
+  GRID_V_MIN,
+  GRID_V_MAX,
+  GRID_V_HYST,
+  GRID_F_MIN,
+  GRID_F_MAX,
+  GRID_F_HYST,
+  GEN_LOAD_FULL,
+  SHED_LEVEL,
+  RESTORE_LEVEL,
+  PRESTART_LEVEL,
+  DEAD_TIME,
+  CONFIRM_TIME,
+  CONFIRM_APPLY,
+  ASSIST_LEVEL,
+  IDLE_SLEEP,
+  ZC_SYNC,
+  SOFT_LEVEL,
+  CRANK_TIME,
+  CRANK_REST,
+  CRANK_TRIES
+};
+
+// Accepted range of each value in ConfigKey order, { min, max }. Delays that would spin the loop,
+// flood the link or chatter the relays start above 0.
+const uint16_t configLimits[CFG_COUNT][2] = {
+  { 100, 60000 },     // power_check_delay
+  { 100, 60000 },     // load_check_delay
+  { 500, 60000 },     // alarm_duration
+  { 50, 5000 },       // led_update_interval
+  { 100, 60000 },     // serial_update_interval
+  { 0, 1800 },        // warm_up_s
+  { 0, 3600 },        // cool_down_s
+  { 5, 3600 },        // retransfer_s
+  { 0, 10000 },       // grid_v_scale
+  { 50, 400 },        // grid_v_min
+  { 50, 400 },        // grid_v_max
+  { 0, 100 },         // grid_v_hyst
+  { 400, 700 },       // grid_f_min
+  { 400, 700 },       // grid_f_max
+  { 0, 50 },          // grid_f_hyst
+  { 0, 1023 },        // gen_load_full
+  { 10, 200 },        // shed_pct
+  { 0, 190 },         // restore_pct
+  { 0, 100 },         // prestart_pct
+  { 5, 500 },         // dead_time_ms
+  { 0, 3600 },        // confirm_s
+  { 0, 1 },           // confirm_apply
+  { 0, 100 },         // assist_pct
+  { 0, 1 },           // idle_sleep
+  { 0, 1 },           // zc_sync
+  { 0, 50 },          // soft_pct
+  { 1, 60 },          // crank_s
+  { 5, 600 },         // crank_rest_s
+  { 1, 10 }           // crank_tries
+};
+
+uint16_t config[CFG_COUNT];
+
+// Field trace: timestamped input edges, output writes and commands kept in a
+// small RAM ring and dumped in binary on request (see tools/replay)
+const uint8_t TRACE_RING_SIZE = LOAD_COUNT > 1 ? 32 : 16;   // 4 bytes per record, half on the Nano
+const uint8_t TRACE_VERSION = 1;
+const uint8_t TRACE_BASE_SIZE = 7;    // base snapshot: modes, inputs, outputs, uptime (u32)
+const uint8_t FRAME_SYNC1 = 0xA5;     // binary frames start with A5 5A so they
+const uint8_t FRAME_SYNC2 = 0x5A;     // can't be mistaken for the JSON stream
+
+// Trace record kinds
+enum TraceKind { TRACE_INPUTS = 1, TRACE_OUTPUTS = 2, TRACE_COMMAND = 3, TRACE_MODE = 4, TRACE_GAP = 5,
+                 TRACE_BATCH = 6 };
+
+// Commands that change state, recorded by id so they can be replayed
+enum CommandId { CMD_MAN, CMD_SEMI, CMD_AUTO, CMD_GEN, CMD_GRID, CMD_STOP, CMD_CONFIRM, CMD_DENY };
+
+struct TraceRecord {
+  uint16_t dt;    // ms since the previous record
+  uint8_t kind;   // TraceKind
+  uint8_t value;  // input mask, output mask, command id or packed modes
+};
+
+TraceRecord traceRing[TRACE_RING_SIZE];
+uint8_t traceHead = 0;      // next slot to write
+uint8_t traceCount = 0;
+boolean traceActive = false;
+unsigned long traceLastTime = 0;
+uint8_t traceInputs = 0;    // last recorded input mask
+uint8_t traceOutputs = 0;   // last recorded output mask
+uint8_t traceModes = 0;     // last recorded mode/control mode pair
+uint8_t traceBase[3];       // modes, inputs and outputs just before the oldest record in the ring
+unsigned long traceBaseTime = 0;  // uptime in ms the oldest record's delta counts from
+uint8_t outputLatch = 0;    // current state of the traced outputs
+
+// Event journal: append-only ring of fixed-size records in EEPROM. Appends are
+// buffered in RAM and written a batch at a time; the ring position is found
+// again at boot from the record sequence numbers.
+const uint8_t JOURNAL_RECORDS = 40;
+const uint8_t JOURNAL_RECORD_SIZE = 6;
+const uint8_t JOURNAL_BATCH = 4;                       // records per EEPROM flush
+const unsigned long JOURNAL_FLUSH_INTERVAL = 60000;    // max time a record waits in RAM
+const uint8_t JOURNAL_VERSION = 2;                     // 2: JE_CLOCK anchors
+const uint8_t JOURNAL_SEQ_MODULO = 255;                // 0xFF is left for erased cells
+
+// Journal event codes
+enum JournalEvent {
+  JE_BOOT = 1,          // payload: mode << 4 | control mode
+  JE_MODE = 2,          // payload: mode << 4 | control mode
+  JE_GRID_LOST = 3,
+  JE_GRID_BACK = 4,     // payload: outage duration in seconds (saturating)
+  JE_GEN_FAIL = 5,      // generator did not come up after being switched in (once per failure)
+  JE_LOAD_FAIL = 6,
+  JE_CLOCK = 7,         // wall clock anchor: dt holds the high and payload the low 16 bits of the
+                        // unix time of this record, later records count on from it
+  JE_PROPOSAL = 8,      // semi-auto proposal answered or timed out, payload: Proposal << 4 | ProposalResult
+  JE_RESET = 9,         // boot after a watchdog or brown-out reset, payload: reset cause flags
+  JE_LOW_MEMORY = 10,   // the watchdog is no longer fed, payload: free RAM in bytes
+  JE_SENSOR = 11        // a sense input failed a plausibility rule, payload: PlausRule
+};
+
+struct JournalRecord {
+  uint8_t seq;          // wraps at JOURNAL_SEQ_MODULO
+  uint8_t code;         // JournalEvent
+  uint16_t dt;          // seconds since the previous record (since boot for the first one)
+  uint16_t payload;
+};
+
+JournalRecord journalPending[JOURNAL_BATCH];
+uint8_t journalPendingCount = 0;
+uint8_t journalHead = 0;          // next ring slot to write
+uint8_t journalCount = 0;         // records stored in EEPROM
+uint8_t journalSeq = 0;           // sequence number of the next record
+uint32_t journalLastTime = 0;     // uptime seconds of the previous record
+unsigned long journalPendingSince = 0;
+boolean journalGridUp = true;
+unsigned long gridLostTime = 0;
+
+// Runtime counters for maintenance scheduling. They live in RAM, are updated
+// by the transfer logic and are checkpointed to EEPROM on a coarse schedule,
+// so at most one checkpoint interval is lost on reset.
+const unsigned long COUNTER_CHECKPOINT_INTERVAL = 900000UL;  // 15 minutes
+const uint8_t COUNTER_SLOTS = 4;
+const uint8_t COUNTER_SLOT_SIZE = 24;
+// older checkpoints, newest first: slot size and counter bytes before crankAttempts, and before
+// retransferAborts was added
+const uint8_t COUNTER_LEGACY_LAYOUTS = 2;
+const uint8_t counterLegacy[COUNTER_LEGACY_LAYOUTS][2] = { { 24, 18 }, { 20, 16 } };
+
+struct RuntimeCounters {
+  uint32_t genRunSeconds;       // generator connected and producing power
+  uint32_t gridOutageSeconds;   // grid_check reading LOW
+  uint16_t genStarts;           // start attempts
+  uint16_t genStartFailures;
+  uint16_t transfersToGen;
+  uint16_t transfersToGrid;
+  uint16_t retransferAborts;    // grid came back and dropped again before the retransfer window ran out
+  uint16_t crankAttempts;       // times a starter was engaged
+};
+static_assert(sizeof(RuntimeCounters) + 3 <= COUNTER_SLOT_SIZE, "counters don't fit a checkpoint slot");
+
+RuntimeCounters counters;
+uint8_t counterSlot = 0;            // slot holding the newest checkpoint
+uint8_t counterSeq = 0;             // sequence number of the newest checkpoint
+boolean countersDirty = false;
+unsigned long lastCheckpointTime = 0;
+unsigned long counterLastTime = 0;
+unsigned int genRunMillis = 0;      // sub-second remainders
+unsigned int outageMillis = 0;
+uint8_t counterSource = 0;          // source relay closed at the end of the last pass
+
+// Bulk transfer of the journal, trace or counters over the Bluetooth link in
+// CRC-checked chunks. Several chunks are kept in flight, the client acks
+// cumulatively, and a dropped connection is resumed from an offset.
+const uint8_t XFER_CHUNK_SIZE = 48;                // frame fits the 64 byte UART TX buffer
+const uint8_t XFER_FRAME_OVERHEAD = 11;            // sync, header and crc
+const uint8_t XFER_WINDOW = 4;                     // chunks sent ahead of the last ack
+const unsigned long XFER_ACK_TIMEOUT = 1500;       // resend from the last ack after this
+const unsigned long XFER_ABANDON_TIMEOUT = 15000;  // give up, the client resumes with an offset
+const uint8_t XFER_TELEMETRY_FACTOR = 4;           // LED telemetry slows down during a transfer
+
+// Transfer sources, named after their dump frame types
+enum XferSource { XFER_NONE = 0, XFER_JOURNAL = 'J', XFER_TRACE = 'T', XFER_COUNTERS = 'C' };
+
+uint8_t xferSource = XFER_NONE;
+uint16_t xferTotal = 0;
+uint16_t xferAcked = 0;            // everything below this offset is confirmed
+uint16_t xferNext = 0;             // next offset to send
+unsigned long xferLastAckTime = 0;
+unsigned long xferLastProgressTime = 0;
+RuntimeCounters xferCounters;      // counters are copied so the payload can't change mid-transfer
+
+// Wall clock. millis() is extended into an uptime that doesn't wrap (seconds
+// plus a millisecond remainder, so no 64-bit division is needed), and
+// `time <unix seconds>` from the app sets its offset to the epoch. There is no
+// RTC: after a reset the clock stays unset until the app sends the time again.
+const uint8_t CLOCK_TOLERANCE = 2;    // resyncs within this many seconds aren't journaled
+
+uint32_t uptimeSecs = 0;
+uint16_t uptimeMillis = 0;
+unsigned long uptimeLast = 0;         // millis() at the last update
+uint32_t clockOffset = 0;             // unix time at uptime 0
+boolean clockSet = false;
+
+// Telemetry subscriptions. Until the client sends `sub`, the legacy LED frame
+// goes out every serial_update_interval. After that each field is sent at its
+// own period, counted in SUB_TICK steps from a shared tick counter, so fields
+// that fall due together share one flat JSON frame.
+enum TelemetryField {
+  TF_LOAD_FAIL,    // the LED fields of the legacy frame come first, in frame order
+  TF_MANUAL,
+  TF_SEMI_AUTO,
+  TF_FULLY_AUTO,
+  TF_LOAD_ON,
+  TF_GEN_ON,
+  TF_GEN_FAIL,
+  TF_GRID_ON,
+  TF_MODE,
+  TF_CONTROL,
+  TF_RELAYS,
+  TF_UPTIME,
+  TF_GEN_RUN,
+  TF_OUTAGE,
+  TF_GEN_STARTS,
+  TF_TIME,
+  TF_TRANSFER,
+  TF_GRID_V,
+  TF_GRID_F,
+  TF_LOADS,
+  TF_GEN_LOAD,
+  TF_RISK,
+  TF_PROPOSAL,
+  TF_UNITS,
+  TF_RESETS,
+  TF_RESET_CAUSE,
+  TF_COUNT
+};
+const uint8_t TF_LED_COUNT = TF_GRID_ON + 1;
+const unsigned long SUB_TICK = 100;   // ms, resolution of the field periods
+const uint8_t SUB_MAX_WORDS = 8;
+
+// Names in TelemetryField order, kept in flash
+const char fieldNames[] PROGMEM =
+  "load_fail,manual,semi_auto,fully_auto,load_on,gen_on,gen_fail,grid_on,"
+  "mode,control,relays,uptime_s,gen_run_s,outage_s,gen_starts,time,transfer,grid_v,grid_f,loads,gen_load,risk,"
+  "proposal,units,resets,reset_cause";
+
+uint8_t subPeriod[TF_COUNT];          // in ticks, 0 = not subscribed
+boolean subActive = false;
+unsigned long subTick = 0;
+unsigned long lastSubTickTime = 0;
+
+// Waveform stream. The ADC free-runs on one sense input (F_CPU / 128 / 13,
+// about 9615 samples/s) and its interrupt reduces every mains cycle to a sum
+// of squares and an interpolated period. The loop turns each cycle into an RMS
+// value and a frequency and packs them, as zigzag varint deltas, into blocks of
+// WAVE_BLOCK_CYCLES. A finished block waits for room in the UART buffer
+// without blocking the loop while new cycles queue up in the ring; when the
+// ring overflows the stream decimates until the link keeps up again.
+const uint8_t WAVE_RING_SIZE = 8;             // cycles between the interrupt and the loop, covers a
+                                              // loop pass held up by a long JSON frame
+const uint8_t WAVE_BLOCK_CYCLES = 8;
+const uint8_t WAVE_BLOCK_DATA = 42;           // 7 delta pairs of at most 3 bytes each
+const uint8_t WAVE_FRAME_OVERHEAD = 14;       // sync, header, base values, length and crc
+const int16_t WAVE_HYSTERESIS = 8;            // counts below the midpoint that arm a crossing
+const uint16_t WAVE_MAX_SAMPLES = 480;        // no crossing for 50 ms: report a dead cycle
+const uint8_t WAVE_MAX_DECIMATION = 16;
+const uint8_t WAVE_RECOVER_BLOCKS = 4;        // blocks sent with room to spare before decimation halves
+const uint32_t WAVE_CHZ_SCALE = F_CPU / 13 * 25 / 2;  // sample rate * 100 * 16: centi-Hz from 1/16-sample periods
+const uint32_t WAVE_SAMPLE_NS = 13UL * 128 * 1000000UL / (F_CPU / 1000);  // one conversion, free running
+const uint16_t WAVE_SAMPLE_LAG = 1472000000UL / F_CPU;  // us from sample-and-hold to the interrupt, 11.5 ADC clocks
+
+struct WaveCycle {
+  uint32_t sumSquares;  // around the midpoint, in counts^2
+  uint16_t samples;
+  uint16_t period;      // in 1/16 samples, 0 when no crossing was seen
+};
+
+enum WaveChannel { WAVE_GEN, WAVE_GRID, WAVE_UNIT, WAVE_OFF = 0xFF };  // WAVE_UNIT: waveUnitPin, not streamed
+const uint8_t WAVE_USER_ZC = 0x01;
+const uint8_t WAVE_USER_SOFT = 0x02;
+const uint8_t WAVE_USER_CRANK = 0x04;
+
+volatile WaveCycle waveRing[WAVE_RING_SIZE];
+volatile uint8_t waveHead = 0;       // written by the interrupt
+volatile boolean waveOverrun = false;  // the interrupt dropped a cycle because the ring was full
+uint8_t waveTail = 0;                // written by the loop
+uint8_t waveChannel = WAVE_OFF;
+uint8_t waveUsers = 0;               // WAVE_USER_ bits of those that moved the sampler off the grid bands
+int waveUnitPin = NO_PIN;            // sense input of WAVE_UNIT
+
+// sampler state, interrupt only
+int16_t waveMid = 512;
+int32_t waveMid16 = 512 << 4;        // midpoint in 1/16 counts, follows the average of each cycle
+int16_t wavePrev = 0;
+boolean waveArmed = false;
+uint8_t waveOffset = 0xFF;           // previous crossing in 1/16 samples before its sample, 0xFF = none yet
+uint32_t waveSumSquares = 0;
+int32_t waveSum = 0;
+uint16_t waveSamples = 0;
+
+// the last rising crossing, for timing relay closes to the waveform
+volatile unsigned long waveCrossAt = 0;   // micros() in the interrupt of the sample after it
+volatile uint8_t waveCrossOffset = 0;     // 1/16 samples the crossing lies before that sample
+volatile uint16_t waveCrossPeriod = 0;    // 1/16 samples since the one before, 0 = none yet
+
+// block encoder
+uint8_t waveBlock[WAVE_BLOCK_DATA];
+uint8_t waveLength = 0;
+uint8_t waveCount = 0;
+uint8_t waveSeq = 0;
+uint8_t waveDecimation = 1;
+uint8_t waveSkip = 0;
+uint8_t waveRoomy = 0;
+boolean wavePending = false;         // finished block waiting for room in the UART buffer
+uint16_t waveBaseRms = 0;
+uint16_t waveBaseChz = 0;
+uint16_t waveLastRms = 0;
+uint16_t waveLastChz = 0;
+
+// Zero-crossing closes. With zc_sync set, a source relay close that has waited
+// out its dead time is held on to the first voltage zero crossing of the
+// incoming source that its contacts can still meet, given the relay's pickup.
+// The crossings come from the waveform sampler, which is moved to the incoming
+// source's sense input for the transfer unless a stream has it. After the
+// close, the sampler's next crossing shows how far off the contacts met theirs.
+enum ZcState { ZC_IDLE, ZC_LOCKING, ZC_TIMED, ZC_CHECKING };
+const unsigned long ZC_LEAD = 30000UL;         // us before the close is due that its crossing is picked
+const unsigned long ZC_LOCK_TIMEOUT = 100000UL;  // us past due to wait for crossings before closing anyway
+const unsigned long ZC_MARGIN = 500;           // us the close command needs to be set up
+const unsigned long ZC_MIN_CYCLE = 10000UL;    // us, crossings further apart than 33 to 100 Hz are
+const unsigned long ZC_MAX_CYCLE = 30000UL;    // noise or a dying source, not something to time to
+
+uint8_t zcState = ZC_IDLE;
+uint8_t zcChannel = WAVE_OFF;         // sense input the close is timed on
+unsigned long zcTarget = 0;           // micros() of the crossing the contacts are to meet
+unsigned long zcDue = 0;              // micros() the close command is to go out
+unsigned long zcHalf = 0;             // us between crossings, both directions
+uint16_t zcCloses = 0;                // since boot: closes timed to a crossing and checked
+uint16_t zcMissed = 0;                // closes that found no crossings to time them to
+int16_t zcLastError = 0;              // 0.1 degree, positive when the contacts met late
+uint32_t zcErrorSum = 0;              // of the absolute errors
+uint16_t zcErrorMax = 0;
+uint16_t zcJitterMax = 0;             // us the close command went out off its time
+
+// Soft start. When the load bus goes onto the generator, the main circuit and
+// then the extra circuits, by priority, are connected one step at a time. Each
+// step waits for the generator voltage, measured every cycle by the sampler, to
+// be back within soft_pct of its level before the step and to have levelled
+// off, rather than for a fixed delay. The load checks hold off while a step
+// settles, so the dip of a step isn't taken for a failed load. A step that
+// doesn't recover within SOFT_STEP_TIMEOUT is undone and ends the sequence.
+enum SoftState { SOFT_IDLE, SOFT_WAIT, SOFT_STEP, SOFT_DONE };
+const uint8_t SOFT_STABLE_CYCLES = 3;          // recovered cycles in a row that end a step
+const unsigned long SOFT_STEP_TIMEOUT = 5000;  // ms
+
+uint8_t softState = SOFT_IDLE;
+int8_t softChannel = 0;               // circuit of the step that is settling
+uint16_t softRef = 0;                 // RMS before the step, 1/16 counts, 0 = not seen
+uint16_t softLast = 0;                // RMS of the previous cycle
+uint8_t softStable = 0;
+unsigned long softSince = 0;          // millis() of the step, and of the first one
+unsigned long softBegan = 0;
+uint16_t softLastTime = 0;            // ms from the bus going on to the last step settling
+uint8_t softLastSteps = 0;            // steps in the last sequence
+uint16_t softTimeouts = 0;            // since boot: steps that didn't recover
+boolean waveStreaming = false;       // cycles are sent, not only checked against the grid bands
+
+// One conversion of another input, taken by the interrupt between two samples
+// when `senseRead` needs the ADC while the sampler has it
+const uint8_t ADC_NO_SIDE = 0xFF;
+uint8_t waveAdcChannel = 0;
+volatile uint8_t adcSideChannel = ADC_NO_SIDE;  // set by the loop, cleared by the interrupt when done
+volatile uint16_t adcSideValue = 0;
+uint8_t adcSideStep = 0;             // interrupt only
+int16_t adcLastRaw = 0;
+
+// Outage risk. Two estimates of an imminent grid loss, in percent, combined as
+// independent chances: a score that every sag or flicker raises and that decays
+// over minutes, and a histogram of outage starts by hour of the day (UTC, only
+// while the clock is set) whose buckets decay by a day's share every 24 hours.
+// A bucket settles at RISK_HOUR_FULL for one outage in that hour every day.
+const uint8_t RISK_SAG_STEP = 20;
+const unsigned long RISK_DECAY_INTERVAL = 60000UL;     // the recent score loses 1/8 every minute
+const unsigned long RISK_DAY = 86400000UL;
+const uint8_t RISK_OUTAGE_STEP = 16;
+const uint8_t RISK_HOUR_FULL = 112;
+const uint8_t PRESTART_HYSTERESIS = 10;                // percent below prestart_pct that stops a pre-start
+const unsigned long PRESTART_SETTLE = 100;             // grid loss confirmation with a warm generator standing by
+const unsigned long RISK_SAVE_INTERVAL = 3600000UL;    // histogram writes, at most
+
+uint8_t riskHours[24];
+uint8_t riskRecent = 0;
+boolean riskGridUp = true;
+boolean riskOutage = false;           // the current grid loss was counted as an outage
+boolean riskDirty = false;
+unsigned long riskGridSince = 0;
+unsigned long lastRiskDecay = 0;
+unsigned long lastRiskDay = 0;
+unsigned long lastRiskSave = 0;
+
+// Sensor plausibility. On every pass the sense inputs are checked against the
+// relays, against each other and against the measurements behind them. A rule
+// that stays broken for its hold time trips once and counts a fault against a
+// sensor, a source or the load. The sense input a tripped rule blames is
+// suspect: where there is a better witness its reading gives way to it, until
+// the rule sees the input agree again. The load is tripped only for a fault of
+// the load itself, not for a dead load_check or a source that went away.
+enum FaultClass { FC_SENSOR, FC_SOURCE, FC_LOAD, FC_COUNT };
+enum PlausRule {
+  PL_LOAD_UNFED,    // load_check live with the load relay or both sources open
+  PL_LOAD_DRAWN,    // load_check dead while the generator feed carries current
+  PL_GRID_FEEDS,    // grid_check dead while the grid alone feeds a live load
+  PL_GEN_FEEDS,     // generator_check dead while the generator alone feeds a live load
+  PL_GRID_WAVE,     // grid_check against the voltage on grid_sense
+  PL_GEN_IDLE,      // generator_check live with no unit on the bus
+  PL_LOAD_LOST,     // load_check dead with its source up
+  PL_GEN_FOLLOWS,   // the generator side not up a power check delay after its relay closed
+  PL_COUNT
+};
+struct PlausInfo {
+  uint8_t fault;    // FaultClass
+  uint8_t sensor;   // readInputMask bit of the sense input it blames, 0 for none
+  uint16_t hold;    // ms broken before it trips
+};
+const PlausInfo plausInfo[PL_COUNT] PROGMEM = {
+  { FC_SENSOR, 0x04, 2000 },    // longer than the load relay takes to drop out
+  { FC_SENSOR, 0x04, 2000 },
+  { FC_SENSOR, 0x01, 500 },     // trips before the power check delay confirms a grid loss
+  { FC_SENSOR, 0x02, 500 },
+  { FC_SENSOR, 0x01, 500 },     // the sampler may only be back on the grid for a grid connect
+  { FC_SENSOR, 0x02, 2000 },
+  { FC_LOAD, 0, 300 },          // lets the source inputs catch up when the source went
+  { FC_SOURCE, 0, 2000 },       // past the transfer logic's own power check, which acts first
+};
+static_assert(PL_COUNT <= 8, "one bit per rule in plausTripped");
+enum PlausVerdict { PLAUS_IDLE, PLAUS_OK, PLAUS_BROKEN };  // IDLE: the rule doesn't apply right now
+const uint8_t PLAUS_CURRENT_PCT = 10;   // generator load that can't flow into a dead load bus
+
+uint8_t plausBroken = 0;              // bit per rule, broken on the last pass
+uint8_t plausTripped = 0;             // bit per rule, broken for its hold time
+uint8_t plausSuspect = 0;             // readInputMask bits of the inputs blamed by tripped rules
+uint16_t plausSince[PL_COUNT];        // low bits of millis() broken since, holds are far shorter
+uint8_t plausRelays = 0;              // relay bits of outputLatch, and since when they are unchanged
+unsigned long plausRelaysSince = 0;
+uint16_t faultCounts[FC_COUNT];       // since boot, by FaultClass
 
 // Function prototypes
 void serialPrint(String message);
@@ -91,9 +951,155 @@ boolean turnLoadOn();
 boolean turnGenOn();
 boolean turnGridOn();
 void loadFailAction();
+void transferService();
+void transferEnter(TransferState state);
+void genRun(boolean on);
+void genService();
+int genPick(boolean start);
+void unitStart(uint8_t unit);
+void unitRelease(uint8_t unit);
+void unitStop(uint8_t unit);
+void unitCrank(uint8_t unit);
+void crankCycle(uint16_t chz);
+void crankEnd(uint8_t unit);
+boolean genStarting();
+uint8_t unitsCarrying();
+void unitHoursLoad();
+void unitHoursSave();
+void watchdogInit();
+void watchdogService();
+int freeMemory();
+void idleInit();
+void idleSleep();
+boolean idleBusy();
+boolean zcStart(int8_t relay);
+void softService();
+void softCycle(uint16_t rms);
+void softNext();
+void softFinish();
+boolean softSettling();
+void plausService();
+uint8_t plausCheck(uint8_t rule);
+void plausTrip(uint8_t rule);
+boolean plausHolds(uint8_t rule);
+boolean plausFeeds(int8_t relay);
+boolean plausDrawn();
+void faultCount(uint8_t fault);
+boolean genSensed();
+unsigned long zcCrossing(unsigned long &cycle);
+boolean zcSchedule();
+void zcCheck();
+void zcEnd();
+boolean gridGood();
+void gridBandUpdate(uint16_t rms, uint16_t chz);
+void gridSenseStart();
+void loadService();
+void loadSwitch(uint8_t channel, boolean on);
+void loadsDrop();
+int loadPick(boolean on);
+uint16_t senseRead(int pin);
+void riskLoad();
+void riskSave();
+void riskService();
+uint8_t riskLevel();
+void relayInit();
+void relayClose(int8_t relay);
+void relayArm();
+void relayOpened(int8_t relay);
+void relayService();
+void relayMeasured();
+void relaySaveTiming();
+CommandResult timingCommand(String args);
+void sendTiming();
+boolean transferApproved(Proposal action);
+void proposalRaise(Proposal action);
+void proposalEnd(ProposalResult result);
+CommandResult proposalAnswer(boolean yes);
 void sendLedData();
-void receiveData();
+bool receiveData();
+void handleLine(const char *line);
 void processMessage(String message);
+CommandResult runCommand(String message);
+CommandResult batchCommand(String args);
+void applyBatch(Mode mode, ControlMode control);
+void sendAck(long seq, CommandResult result);
+void writeOutput(int pin, uint8_t level);
+uint8_t readInputMask();
+void traceStart();
+void traceStop();
+void traceRecord(uint8_t kind, uint8_t value);
+TraceRecord &traceSlot();
+void traceSampleInputs();
+void traceSampleOutputs();
+void traceCommand(CommandId id);
+void traceModeChange();
+void traceDump();
+uint16_t crc16Update(uint16_t crc, uint8_t data);
+void journalInit();
+void journalAppend(JournalEvent code, uint16_t payload);
+void journalFlush();
+void journalService();
+void journalWatchGrid();
+void journalDump();
+uint8_t packModes();
+uint32_t uptimeSeconds();
+uint32_t clockNow();
+CommandResult timeCommand(String args);
+void sendTime();
+void countersInit();
+boolean countersReadSlot(int address, uint8_t size, RuntimeCounters &stored, uint8_t &seq);
+void countersService();
+void countersCheckpoint();
+void sendCounters();
+void writeFrameByte(uint8_t data, uint16_t &crc);
+void configLoad();
+void configLoadBlock(int address, uint8_t first, uint8_t maxCount);
+void configSave();
+void configSaveBlock(int address, uint8_t first, uint8_t count);
+int configFind(const char *name);
+boolean configInRange(uint8_t key, long value);
+boolean configConsistent();
+void sendConfig();
+CommandResult configCommand(String args);
+uint8_t readSafeRelays();
+void restoreRelays(uint8_t mask);
+boolean relaysVerified(uint8_t mask);
+void bootResume();
+void bootRevalidate();
+void safeStateService();
+void linkInit();
+void linkNegotiate(uint8_t target);
+void linkService();
+void linkProbe(uint8_t rate);
+void linkSwitch(uint8_t rate, LinkState next);
+void linkFinish(boolean ok);
+boolean linkReplyOk();
+int linkRateIndex(unsigned long baud);
+void sendLinkStatus(boolean ok);
+void xferStart(uint8_t source, uint16_t offset);
+void xferAck(uint16_t offset, boolean resend);
+void xferService();
+uint8_t xferByte(uint16_t offset);
+int findName(const char *names, uint8_t count, const char *name);
+void printName(const char *names, uint8_t index);
+boolean wordIs(const String &text, PGM_P word);
+boolean wordStarts(const String &text, PGM_P prefix);
+CommandResult subCommand(String args);
+void subService();
+void sendFields(uint32_t mask);
+void sendSubscriptions();
+void sendTelemetry();
+CommandResult streamCommand(String args);
+void waveStart(uint8_t channel);
+void waveStop();
+boolean waveBorrow(uint8_t user, uint8_t channel);
+void waveReturn(uint8_t user);
+void waveSample(int16_t raw);
+void waveService();
+void waveVarint(int32_t delta);
+boolean waveSendBlock();
+uint16_t isqrt32(uint32_t value);
+void adcSelect(uint8_t channel);
 
 
 
@@ -102,7 +1108,17 @@ void processMessage(String message);
  * alarm pin, and loads saved modes from EEPROM.
  */
 void setup() {
-  Serial.begin(9600);
+  // Stage 1: put the load back on its last verified source before anything else
+  savedSafeRelays = readSafeRelays();
+  restoreRelays(savedSafeRelays);
+  bootRestoreMicros = micros();
+  watchdogInit();
+
+  linkInit();
+  configLoad();
+  idleInit();
+  relayInit();
+  gridSenseStart();
 
   // Initialize LED pins
   pinMode(load_fail_led, OUTPUT);
@@ -123,18 +1139,51 @@ void setup() {
   pinMode(generator_check, INPUT);
   pinMode(load_check, INPUT);
 
-  // Initialize relay pins
-  pinMode(grid_relay, OUTPUT);
-  pinMode(generator_relay, OUTPUT);
-  pinMode(load_relay, OUTPUT);
+  // Relay pins were set up by restoreRelays(); the extra load circuits start open and follow the
+  // main one from loadService()
+  for (uint8_t i = 1; i < LOAD_COUNT; i++) {
+    digitalWrite(loadChannels[i].pin, LOW);
+    pinMode(loadChannels[i].pin, OUTPUT);
+  }
 
   // Initialize alarm pin
   pinMode(alarm_pin, OUTPUT);
+  for (uint8_t i = 0; i < GEN_COUNT; i++) {
+    if (genUnits[i].run != NO_PIN) {
+      pinMode(genUnits[i].run, OUTPUT);
+    }
+    pinMode(genUnits[i].ready, INPUT);
+    if (genUnits[i].breaker != NO_PIN) {
+      digitalWrite(genUnits[i].breaker, LOW);
+      pinMode(genUnits[i].breaker, OUTPUT);
+    }
+    if (genUnits[i].crank != NO_PIN) {
+      digitalWrite(genUnits[i].crank, LOW);
+      pinMode(genUnits[i].crank, OUTPUT);
+    }
+  }
+
+  // Bluetooth module stays in data mode unless a rate change is being negotiated
+  pinMode(bt_key_pin, OUTPUT);
+  digitalWrite(bt_key_pin, LOW);
+  if (linkRate != LINK_DEFAULT_RATE) {
+    // a faster rate was negotiated before: make sure the module still runs at it
+    linkNegotiate(linkRate);
+  }
 
   // Load the saved mode from EEPROM
   currentMode = readModeFromEEPROM();
   currentControlMode = readControlModeFromEEPROM();
-  selectMode(currentMode);
+  journalInit();
+  journalAppend(JE_BOOT, packModes());
+  if (resetCause & (RESET_WATCHDOG | RESET_BROWN_OUT)) {
+    journalAppend(JE_RESET, resetCause);
+  }
+  countersInit();
+  unitHoursLoad();
+  riskLoad();
+  // Stage 2: revalidate the restored sources from loop() instead of re-running the mode now
+  bootResume();
 
 
     lastPowerCheckTime = millis();
@@ -151,49 +1200,85 @@ void loop() {
   // Handle button press and mode selection
 
    unsigned long currentTime = millis();
+  uptimeSeconds();  // keeps the uptime going across millis() overflows
+  traceSampleInputs();
   buttonPress();
+  passDone |= PASS_INPUTS;
 
   // Check power sources and update LEDs
   // checkPowerSources();
  // Check power sources periodically instead of constant checking
-  if (currentTime - lastPowerCheckTime >= POWER_CHECK_DELAY) {
+  if (currentTime - lastPowerCheckTime >= config[CFG_POWER_CHECK_DELAY]) {
     checkPowerSources();
+    journalWatchGrid();
     lastPowerCheckTime = currentTime;
   }
   
   // sendLedData();
-// Send LED data periodically
-  if (currentTime - lastSerialUpdateTime >= SERIAL_UPDATE_INTERVAL) {
-    sendLedData();
-    lastSerialUpdateTime = currentTime;
+// Send LED data periodically, less often while a bulk transfer needs the link
+  unsigned long serialInterval = config[CFG_SERIAL_UPDATE_INTERVAL];
+  if (xferSource) {
+    serialInterval *= XFER_TELEMETRY_FACTOR;
+  }
+  if (linkState == LINK_IDLE) {
+    if (subActive) {
+      subService();
+    } else if (currentTime - lastSerialUpdateTime >= serialInterval) {
+      sendLedData();
+      lastSerialUpdateTime = currentTime;
+    }
   }
   // Handle alarm if active
-  if (alarmActive && (currentTime - alarmStartTime >= ALARM_DURATION)) {
-    digitalWrite(alarm_pin, LOW);
+  if (alarmActive && (currentTime - alarmStartTime >= config[CFG_ALARM_DURATION])) {
+    writeOutput(alarm_pin, LOW);
     alarmActive = false;
   }
-  receiveData();
-
-
-
-    if (messageComplete) {
-    processMessage(receivedMessage);
-    receivedMessage = "";  // Clear the buffer after processing
-    messageComplete = false; // Reset the flag
+  // the serial port belongs to the link negotiation while it runs
+  if (linkState == LINK_IDLE) {
+    for (uint8_t lines = 0; lines < RX_LINES_PER_PASS && receiveData(); lines++) {
+      handleLine(receivedMessage);
+    }
   }
+  linkService();
+  plausService();
 
   // Execute the current mode
-  switch (currentMode) {
-    case MANUAL:
-      manualMode();
-      break;
-    case SEMI_AUTO:
-      semiAutoMode();
-      break;
-    case FULLY_AUTO:
-      fullyAutoMode();
-      break;
+  if (bootRevalidating) {
+    bootRevalidate();
+    passDone |= PASS_MODE;
+  } else {
+    switch (currentMode) {
+      case MANUAL:
+        manualMode();
+        passDone |= PASS_MODE;
+        break;
+      case SEMI_AUTO:
+        semiAutoMode();
+        passDone |= PASS_MODE;
+        break;
+      case FULLY_AUTO:
+        fullyAutoMode();
+        passDone |= PASS_MODE;
+        break;
+    }
   }
+  traceSampleOutputs();
+  relayService();
+  genService();
+  softService();
+  loadService();
+  passDone |= PASS_OUTPUTS;
+  riskService();
+  safeStateService();
+  journalService();
+  countersService();
+  passDone |= PASS_STATE;
+  if (linkState == LINK_IDLE) {
+    xferService();
+    waveService();
+  }
+  watchdogService();
+  idleSleep();
 
   // Check for Bluetooth commands
  
@@ -217,8 +1302,20 @@ void serialPrint(String message) {
  * represents different operating modes such as `MANUAL`, `SEMI_AUTO`, and `FULLY_AUTO`.
  */
 void selectMode(Mode mode) {
-  currentMode = mode;
+  bootRevalidating = false;
+  transferState = TS_ENTRY;
+  if (mode != SEMI_AUTO) {
+    if (proposal != PROPOSE_NONE) {
+      proposalEnd(PR_WITHDRAWN);
+    }
+    proposalDenied = PROPOSE_NONE;
+  }
+  if (mode != currentMode) {
+    currentMode = mode;
+    journalAppend(JE_MODE, packModes());
+  }
   saveModeToEEPROM(mode);
+  traceModeChange();
 
   if (mode == MANUAL) {
     digitalWrite(manual_led, LOW);
@@ -250,8 +1347,14 @@ void selectMode(Mode mode) {
  * and `STOP`.
  */
 void controlMode(ControlMode mode) {
-  currentControlMode = mode;
+  bootRevalidating = false;
+  transferState = TS_ENTRY;
+  if (mode != currentControlMode) {
+    currentControlMode = mode;
+    journalAppend(JE_MODE, packModes());
+  }
   saveControlModeToEEPROM(mode);
+  traceModeChange();
 
   if (mode == GEN) {
     turnGenOn();
@@ -305,53 +1408,31 @@ void manualMode() {
 }
 
 /**
- * The semiAutoMode function checks if a select button is pressed to switch between manual and fully
- * automatic modes.
+ * The function `semiAutoMode` runs the transfer state machine with the moves between sources held
+ * for confirmation, withdraws a proposal that wasn't asked for again on this pass and blinks the
+ * semi-auto LED while one is waiting.
  */
 void semiAutoMode() {
-
-  if(digitalRead(select_button) == HIGH) {
-   manualMode();
+  proposalAsked = PROPOSE_NONE;
+  transferService();
+  if (proposal != PROPOSE_NONE && proposalAsked != proposal) {
+    proposalEnd(PR_WITHDRAWN);
   }
-  else{
-
-fullyAutoMode();
+  if (proposalDenied != proposalAsked) {
+    proposalDenied = PROPOSE_NONE;
+  }
+  if (proposal != PROPOSE_NONE) {
+    digitalWrite(semi_auto_led, (millis() / config[CFG_LED_UPDATE_INTERVAL]) & 1 ? HIGH : LOW);
   }
 }
 
 
 /**
- * The function `fullyAutoMode` checks if the grid is on, turns on the generator if needed, and then
- * turns on the load with appropriate actions for failures.
+ * The function `fullyAutoMode` runs the automatic transfer state machine: the load stays on the grid
+ * while it is up and moves to the generator, after its warm-up, when the grid is lost.
  */
 void fullyAutoMode() {
-boolean on_grid = turnGridOn();
-if(on_grid == false) {
-  boolean on_gen = turnGenOn();
-  if(on_gen == true) {
-  
-    if(turnLoadOn() == false) {
- loadFailAction();
-    }
-   
-}else{
-  boolean turn_load_on = turnLoadOn();
-  if(turn_load_on == false) {
-    loadFailAction();
-  }
-
-}
-}else{
-
-  boolean turn_load_on = turnLoadOn();
-  if(turn_load_on == false) {
-    loadFailAction();
-  }
-
-}
-
-  sendLedData();
-
+  transferService();
 }
 
 
@@ -360,7 +1441,7 @@ if(on_grid == false) {
 
 // Modified power control functions
 boolean turnLoadOn() {
-  digitalWrite(load_relay, HIGH);
+  writeOutput(load_relay, HIGH);
   load_on = true;
   
   // Use non-blocking delay for load check
@@ -370,14 +1451,14 @@ boolean turnLoadOn() {
     return true;
   }
   
-  if (millis() - loadStartTime >= LOAD_CHECK_DELAY) {
+  if (millis() - loadStartTime >= config[CFG_LOAD_CHECK_DELAY] && !softSettling()) {
     loadStartTime = 0;
-    if(digitalRead(load_check) == LOW) {
+    if(plausHolds(PL_LOAD_LOST)) {
       loadFailAction();
       return false;
     } else {
       digitalWrite(load_fail_led, HIGH);
-      digitalWrite(load_relay, HIGH);
+      writeOutput(load_relay, HIGH);
       load_on = true;
       load_fail = false;
       return true;
@@ -403,28 +1484,50 @@ void updateLEDs() {
 }
 
 boolean turnGenOn() {
-  digitalWrite(grid_relay, LOW);
-  digitalWrite(load_relay, LOW);
+  // the generator relay was open and isn't waiting to close: this call starts a new attempt
+  boolean starting = !(outputLatch & 0x02) && relayPending != RELAY_GEN;
+  writeOutput(grid_relay, LOW);
+  writeOutput(load_relay, LOW);
   digitalWrite(grid_on_led, HIGH);
-  digitalWrite(generator_relay, HIGH);
+  relayClose(RELAY_GEN);
+  genRun(true);
   gen_on = true;
   
   static unsigned long genStartTime = 0;
+  static boolean genStartFailed = false;  // the attempt's failure is counted
+  if (starting) {
+    genStartTime = 0;
+    genStartFailed = false;
+  }
   if (genStartTime == 0) {
     genStartTime = millis();
+    if (starting && digitalRead(generator_check) == LOW) {
+      counters.genStarts++;
+      countersDirty = true;
+    }
     return true;
   }
   
-  if (millis() - genStartTime >= POWER_CHECK_DELAY) {
+  if (millis() - genStartTime >= config[CFG_POWER_CHECK_DELAY]) {
     genStartTime = 0;
     if(digitalRead(generator_check) == LOW) {
-      digitalWrite(grid_relay, LOW);
+      writeOutput(grid_relay, LOW);
+      if (!gen_fail) {
+        journalAppend(JE_GEN_FAIL, 0);
+      }
+      gen_fail = true;
+      if (!genStartFailed) {
+        genStartFailed = true;
+        counters.genStartFailures++;
+        countersDirty = true;
+      }
       digitalWrite(gen_fail_led, HIGH);
       ledControl(gen_on_led, false);
       gen_on = false;
       turnOnAlarm();
       return false;
     } else {
+      gen_fail = false;
       digitalWrite(gen_fail_led, HIGH);
       ledControl(gen_on_led, false);
       return true;
@@ -434,9 +1537,12 @@ boolean turnGenOn() {
 }
 
 boolean turnGridOn() {
-  digitalWrite(generator_relay, LOW);
-  digitalWrite(load_relay, LOW);
-  digitalWrite(grid_relay, HIGH);
+  writeOutput(generator_relay, LOW);
+  writeOutput(load_relay, LOW);
+  genCooling = false;
+  genPrestart = false;
+  genRun(false);
+  relayClose(RELAY_GRID);
   digitalWrite(grid_on_led, LOW);
   ledControl(gen_on_led, true);
   gen_on = false;
@@ -447,10 +1553,10 @@ boolean turnGridOn() {
     return true;
   }
   
-  if (millis() - gridStartTime >= POWER_CHECK_DELAY) {
+  if (millis() - gridStartTime >= config[CFG_POWER_CHECK_DELAY]) {
     gridStartTime = 0;
     if(digitalRead(grid_check) == LOW) {
-      digitalWrite(grid_relay, LOW);
+      writeOutput(grid_relay, LOW);
       ledControl(grid_on_led, false);
       grid_on = false;
       return false;
@@ -463,34 +1569,25 @@ boolean turnGridOn() {
 }
 
 void turnOnAlarm() {
-  digitalWrite(alarm_pin, HIGH);
+  writeOutput(alarm_pin, HIGH);
   alarmActive = true;
   alarmStartTime = millis();
 }
 /**
- * The function `loadFailAction` checks for load failure and takes appropriate actions if a failure is
- * detected.
+ * The function `loadFailAction` takes the load off for a load fault, once the PL_LOAD_LOST rule
+ * holds: load_check has been read there, against the relays and with its source up. Every relay
+ * opens through `turnOffAllRelays`, the alarm sounds and the failure is journaled once.
  */
-void  loadFailAction(){
-  if(load_fail == true || digitalRead(load_check) == LOW){
-    digitalWrite(load_relay, LOW);
-    ledControl(load_fail, true);
-    ledControl(load_on, false);
-    //led control
-    ledControl(load_fail_led, false);
-    ledControl(load_on_led, true);
-     load_on = false;
-    load_fail = true;
-
-       
-    digitalWrite(grid_relay,LOW);
-    digitalWrite(generator_relay,LOW);
-    turnOnAlarm();
-    
+void loadFailAction() {
+  if (!load_fail) {
+    journalAppend(JE_LOAD_FAIL, 0);
   }
-  sendLedData();
-
-
+  load_fail = true;
+  load_on = false;
+  turnOffAllRelays();
+  ledControl(load_fail_led, false);
+  ledControl(load_on_led, true);
+  turnOnAlarm();
 }
 
 /**
@@ -501,6 +1598,23 @@ void buttonPress() {
   static unsigned long lastDebounceTime = 0;
   const unsigned long debounceDelay = 50;
   
+  // while a proposal waits, the select button answers it: a short press confirms, holding it denies
+  if (proposalPress) {
+    if (digitalRead(select_button) == LOW) {
+      proposalPress = false;
+      if (proposal != PROPOSE_NONE && millis() - proposalPressAt < CONFIRM_HOLD) {
+        proposalAnswer(true);
+      }
+      lastDebounceTime = millis();
+    } else if (proposal != PROPOSE_NONE && millis() - proposalPressAt >= CONFIRM_HOLD) {
+      proposalAnswer(false);
+    }
+  } else if (proposal != PROPOSE_NONE && digitalRead(select_button) == HIGH &&
+             (millis() - lastDebounceTime) > debounceDelay) {
+    proposalPress = true;
+    proposalPressAt = millis();
+  }
+
   if ((millis() - lastDebounceTime) > debounceDelay) {
     if (digitalRead(menu_button) == HIGH) {
       if (currentMode == MANUAL) {
@@ -512,7 +1626,7 @@ void buttonPress() {
       }
       lastDebounceTime = millis();
     }
-    if(digitalRead(select_button) == HIGH) {
+    if(!proposalPress && currentMode == MANUAL && digitalRead(select_button) == HIGH) {
       if(currentControlMode == GEN) {
         controlMode(GRID);
       } else if(currentControlMode == GRID) {
@@ -535,7 +1649,7 @@ void buttonPress() {
  * control modes for your system.
  */
 void saveControlModeToEEPROM(ControlMode mode) {
-  EEPROM.write(controlModeAddress, mode);
+  EEPROM.update(controlModeAddress, mode);  // called every pass in manual mode, only write changes
 }
 ControlMode readControlModeFromEEPROM() {
   return static_cast<ControlMode>(EEPROM.read(controlModeAddress));
@@ -547,7 +1661,7 @@ ControlMode readControlModeFromEEPROM() {
  * @param mode The `mode` parameter is the mode that you want to save to the EEPROM.
  */
 void saveModeToEEPROM(Mode mode) {
-  EEPROM.write(modeAddress, mode);
+  EEPROM.update(modeAddress, mode);
 }
 
 
@@ -570,17 +1684,16 @@ Mode readModeFromEEPROM() {
  * The function `turnOffAllRelays` turns off all relays and corresponding LEDs.
  */
 void turnOffAllRelays() {
-  digitalWrite(grid_relay, LOW);
-  digitalWrite(generator_relay, LOW);
-  digitalWrite(load_relay, LOW);
+  writeOutput(grid_relay, LOW);
+  writeOutput(generator_relay, LOW);
+  writeOutput(load_relay, LOW);
+  genCooling = false;
+  genPrestart = false;
+  genRun(false);
   // indicate with the leds as well that the relays are off
   digitalWrite(grid_on_led, LOW);
   digitalWrite(gen_on_led, LOW);
   digitalWrite(load_on_led, LOW);
-
-  delay(1000);
-
-  sendLedData();
 }
 
 /**
@@ -595,9 +1708,6 @@ void turnOffAllLEDs() {
   digitalWrite(gen_on_led, HIGH);
   digitalWrite(gen_fail_led, HIGH);
   digitalWrite(grid_on_led, HIGH);
-    delay(1000);
-  sendLedData();
-
 }
 
 
@@ -633,76 +1743,4040 @@ void setPinStatus(int pin, boolean status) {
 void sendLedData() {
   // Serial.print("start_json");
    JsonDocument  jsonDoc;
-  jsonDoc["load_fail"] = getPinStatus(load_fail_led)?false:true;
-  jsonDoc["manual"] = getPinStatus(manual_led)?false:true;
-  jsonDoc["semi_auto"] = getPinStatus(semi_auto_led)?false:true;
-  jsonDoc["fully_auto"] = getPinStatus(fully_auto_led)?false:true;
-  jsonDoc["load_on"] = getPinStatus(load_on_led)?false:true;
-  jsonDoc["gen_on"] = getPinStatus(gen_on_led)?false:true;
-  jsonDoc["gen_fail"] = getPinStatus(gen_fail_led)?false:true;
-  jsonDoc["grid_on"] = getPinStatus(grid_on_led)?false:true;
+  jsonDoc[F("load_fail")] = getPinStatus(load_fail_led)?false:true;
+  jsonDoc[F("manual")] = getPinStatus(manual_led)?false:true;
+  jsonDoc[F("semi_auto")] = getPinStatus(semi_auto_led)?false:true;
+  jsonDoc[F("fully_auto")] = getPinStatus(fully_auto_led)?false:true;
+  jsonDoc[F("load_on")] = getPinStatus(load_on_led)?false:true;
+  jsonDoc[F("gen_on")] = getPinStatus(gen_on_led)?false:true;
+  jsonDoc[F("gen_fail")] = getPinStatus(gen_fail_led)?false:true;
+  jsonDoc[F("grid_on")] = getPinStatus(grid_on_led)?false:true;
 
   
 
 
-  // serializeJsonPretty(jsonDoc, Serial);+
-+  // char jsonString[256]; // Buffer to hold JSON as a string
+  // serializeJsonPretty(jsonDoc, Serial);
+  // char jsonString[256]; // Buffer to hold JSON as a string
   // serializeJson(jsonDocument, jsonString); // Serialize JSON to string
 serializeJson(jsonDoc, Serial);
+  Serial.println();  // one frame per line so replies can't run into it
 
 
 // Serial.println(jsonString); // Send JSON string over Bluetooth
 
-  delay(1000);
-
 
 }
 
 
 
-void receiveData() {
+/**
+ * The function `receiveData` collects serial input into `receivedMessage` until a newline.
+ *
+ * @return true when a complete line is in the buffer. A line longer than the buffer is cut short
+ * and flagged in `messageOverflow`.
+ */
+bool receiveData() {
   while (Serial.available() > 0) {
     char receivedChar = Serial.read();
     
     if (receivedChar == '\n') {  // Assuming messages end with a newline character
-      messageComplete = true;
-      break;
+      receivedMessage[receivedLength] = '\0';
+      receivedLength = 0;
+      return true;
     } else if (receivedChar != '\r') { // Ignore carriage return character
-      receivedMessage += receivedChar;  // Append character to message buffer
+      if (receivedLength < RX_LINE_SIZE - 1) {
+        receivedMessage[receivedLength++] = receivedChar;  // Append character to message buffer
+      } else {
+        messageOverflow = true;
+      }
     }
   }
+  return false;
 }
 
+/**
+ * The function `handleLine` dispatches one received line. Framed requests ("@<seq> <command>") are
+ * answered with an acknowledgement carrying the same sequence number, so a client can send several
+ * requests back to back and match the replies afterwards. Bare commands keep their old echoes.
+ *
+ * @param line The received line without its line ending.
+ */
+void handleLine(const char *line) {
+  bool overflow = messageOverflow;
+  messageOverflow = false;
 
-void processMessage(String message) {
+  if (line[0] != '@') {
+    if (overflow) {
+      Serial.println(F("Unknown command"));
+    } else {
+      processMessage(line);
+    }
+    return;
+  }
+
+  char *end;
+  long seq = strtol(line + 1, &end, 10);
+  if (end == line + 1 || seq < 0 || seq > 0xFFFF || (*end != ' ' && *end != '\0')) {
+    sendAck(-1, RESULT_ERROR);
+    return;
+  }
+  while (*end == ' ') {
+    end++;
+  }
+  sendAck(seq, overflow ? RESULT_ERROR : runCommand(end));
+}
+
+/**
+ * The function `sendAck` writes the acknowledgement for a framed request as one JSON line.
+ *
+ * @param seq The request's sequence number, or -1 if it could not be read.
+ * @param result The `CommandResult` of the request.
+ */
+void sendAck(long seq, CommandResult result) {
+  Serial.print(F("{\"ack\":"));
+  Serial.print(seq);
+  Serial.print(F(",\"st\":\""));
+  Serial.print(result == RESULT_OK ? F("ok") : result == RESULT_REJECTED ? F("rej") : F("err"));
+  Serial.println(F("\"}"));
+}
 
+/**
+ * The function `processMessage` runs a bare command and prints the echo the app has always
+ * received for it.
+ */
+void processMessage(String message) {
+  CommandResult result = runCommand(message);
+  if (result == RESULT_ERROR) {
+    Serial.println(F("Unknown command"));
+  } else if (result == RESULT_OK) {
+    if (wordIs(message, PSTR("man"))) {
+      Serial.print(F("manual"));
+    } else if (wordIs(message, PSTR("semi")) || wordIs(message, PSTR("auto")) || wordIs(message, PSTR("gen")) ||
+               wordIs(message, PSTR("grid")) || wordIs(message, PSTR("stop"))) {
+      Serial.print(message);
+    }
+  }
+}
 
-  if (message == "man") {
-    Serial.print("manual");
+/**
+ * The function `runCommand` executes one command.
+ *
+ * @return `RESULT_OK`, `RESULT_REJECTED` when the command is not allowed in the current mode, or
+ * `RESULT_ERROR` when it is unknown or malformed.
+ */
+CommandResult runCommand(String message) {
+  if (wordIs(message, PSTR("man"))) {
+    traceCommand(CMD_MAN);
     selectMode(MANUAL);
-  } else if (message == "semi") {
-    Serial.print("semi");
+  } else if (wordIs(message, PSTR("semi"))) {
+    traceCommand(CMD_SEMI);
     selectMode(SEMI_AUTO);
-  } else if (message == "auto") {
-    Serial.print("auto");
+  } else if (wordIs(message, PSTR("auto"))) {
+    traceCommand(CMD_AUTO);
     selectMode(FULLY_AUTO);
-  } else if (message == "gen") {
-    if (currentMode == MANUAL || currentMode == SEMI_AUTO) {
-      Serial.print("gen");
+  } else if (wordIs(message, PSTR("gen"))) {
+    traceCommand(CMD_GEN);
+    if (currentMode == MANUAL) {
       controlMode(GEN);
+    } else {
+      return RESULT_REJECTED;
     }
-  } else if (message == "grid") {
-    if (currentMode == MANUAL || currentMode == SEMI_AUTO) {
-      Serial.print("grid");
+  } else if (wordIs(message, PSTR("grid"))) {
+    traceCommand(CMD_GRID);
+    if (currentMode == MANUAL) {
       controlMode(GRID);
+    } else {
+      return RESULT_REJECTED;
     }
-  } else if (message == "stop") {
-    if (currentMode == MANUAL || currentMode == SEMI_AUTO) {
-      Serial.print("stop");
+  } else if (wordIs(message, PSTR("stop"))) {
+    traceCommand(CMD_STOP);
+    if (currentMode == MANUAL) {
       controlMode(STOP);
+    } else {
+      return RESULT_REJECTED;
+    }
+  } else if (wordIs(message, PSTR("confirm"))) {
+    traceCommand(CMD_CONFIRM);
+    return proposalAnswer(true);
+  } else if (wordIs(message, PSTR("deny"))) {
+    traceCommand(CMD_DENY);
+    return proposalAnswer(false);
+  } else if (wordIs(message, PSTR("trace_on"))) {
+    traceStart();
+  } else if (wordIs(message, PSTR("trace_off"))) {
+    traceStop();
+  } else if (wordIs(message, PSTR("trace_dump"))) {
+    traceDump();
+  } else if (wordIs(message, PSTR("journal_dump"))) {
+    journalDump();
+  } else if (wordIs(message, PSTR("stats"))) {
+    sendCounters();
+  } else if (wordIs(message, PSTR("sub")) || wordStarts(message, PSTR("sub "))) {
+    return subCommand(message.substring(3));
+  } else if (wordIs(message, PSTR("time")) || wordStarts(message, PSTR("time "))) {
+    return timeCommand(message.substring(4));
+  } else if (wordStarts(message, PSTR("stream "))) {
+    return streamCommand(message.substring(7));
+  } else if (wordStarts(message, PSTR("batch "))) {
+    return batchCommand(message.substring(6));
+  } else if (wordIs(message, PSTR("cfg")) || wordStarts(message, PSTR("cfg "))) {
+    return configCommand(message.substring(3));
+  } else if (wordIs(message, PSTR("timing")) || wordStarts(message, PSTR("timing "))) {
+    return timingCommand(message.substring(6));
+  } else if (wordStarts(message, PSTR("xfer "))) {
+    // xfer <journal|trace|stats> [offset]
+    String args = message.substring(5);
+    uint8_t source = XFER_NONE;
+    if (wordStarts(args, PSTR("journal"))) {
+      source = XFER_JOURNAL;
+    } else if (wordStarts(args, PSTR("trace"))) {
+      source = XFER_TRACE;
+    } else if (wordStarts(args, PSTR("stats"))) {
+      source = XFER_COUNTERS;
+    } else {
+      return RESULT_ERROR;
+    }
+    int space = args.indexOf(' ');
+    xferStart(source, space > 0 ? args.substring(space + 1).toInt() : 0);
+  } else if (wordIs(message, PSTR("link"))) {
+    sendLinkStatus(true);
+  } else if (wordStarts(message, PSTR("link "))) {
+    int rate = linkRateIndex(message.substring(5).toInt());
+    if (rate < 0) {
+      return RESULT_ERROR;
+    }
+    linkPending = rate;
+  } else if (wordStarts(message, PSTR("ack "))) {
+    xferAck(message.substring(4).toInt(), false);
+  } else if (wordStarts(message, PSTR("nak "))) {
+    xferAck(message.substring(4).toInt(), true);
+  } else {
+    return RESULT_ERROR;
+  }
+  return RESULT_OK;
+}
+
+
+
+// field trace capture
+/**
+ * The function `writeOutput` drives a relay or the alarm pin and keeps the traced output mask in
+ * step with it.
+ *
+ * @param pin The output pin to drive.
+ * @param level `HIGH` or `LOW`.
+ */
+void writeOutput(int pin, uint8_t level) {
+  if (pin == NO_PIN) {
+    return;
+  }
+  digitalWrite(pin, level);
+
+  uint8_t bit = 0;
+  if (pin == grid_relay) {
+    bit = 0x01;
+  } else if (pin == generator_relay) {
+    bit = 0x02;
+  }
+  if (bit != 0 && level == LOW) {
+    relayOpened(bit == 0x01 ? RELAY_GRID : RELAY_GEN);
+  } else if (pin == load_relay) {
+    bit = 0x04;
+    if (level == LOW) {
+      loadsDrop();  // the other circuits never stay on without the main one
     }
+  } else if (pin == alarm_pin) {
+    bit = 0x08;
+  }
+  if (level == HIGH) {
+    outputLatch |= bit;
   } else {
-    Serial.println("Unknown command");
+    outputLatch &= ~bit;
+  }
+}
+
+/**
+ * The function `readInputMask` packs the sense inputs and buttons into one byte:
+ * bit0 grid_check, bit1 generator_check, bit2 load_check, bit3 menu_button, bit4 select_button.
+ */
+uint8_t readInputMask() {
+  uint8_t mask = 0;
+  if (digitalRead(grid_check) == HIGH) mask |= 0x01;
+  if (digitalRead(generator_check) == HIGH) mask |= 0x02;
+  if (digitalRead(load_check) == HIGH) mask |= 0x04;
+  if (digitalRead(menu_button) == HIGH) mask |= 0x08;
+  if (digitalRead(select_button) == HIGH) mask |= 0x10;
+  return mask;
+}
+
+/**
+ * The function `traceStart` clears the ring and starts a capture from a snapshot of the current
+ * modes, inputs and outputs so a replay can begin from the same state.
+ */
+void traceStart() {
+  traceHead = 0;
+  traceCount = 0;
+  traceActive = true;
+  traceLastTime = millis();
+  traceBaseTime = traceLastTime;
+
+  traceModes = (currentMode << 4) | currentControlMode;
+  traceInputs = readInputMask();
+  traceOutputs = outputLatch;
+  traceBase[0] = traceModes;
+  traceBase[1] = traceInputs;
+  traceBase[2] = traceOutputs;
+}
+
+void traceStop() {
+  traceActive = false;
+}
+
+/**
+ * The function `traceRecord` appends one record to the ring, overwriting the oldest once it is
+ * full so the ring always holds the most recent history. Gaps longer than a record's 16-bit delta
+ * are split into `TRACE_GAP` records.
+ *
+ * @param kind The `TraceKind` of the record.
+ * @param value The record payload.
+ */
+void traceRecord(uint8_t kind, uint8_t value) {
+  if (!traceActive) {
+    return;
+  }
+
+  unsigned long now = millis();
+  unsigned long dt = now - traceLastTime;
+  traceLastTime = now;
+
+  while (dt > 0xFFFF) {
+    TraceRecord &gap = traceSlot();
+    gap.dt = 0xFFFF;
+    gap.kind = TRACE_GAP;
+    gap.value = 0;
+    dt -= 0xFFFF;
+  }
+
+  TraceRecord &rec = traceSlot();
+  rec.dt = dt;
+  rec.kind = kind;
+  rec.value = value;
+}
+
+/**
+ * The function `traceSlot` claims the next ring slot. When the ring is full the oldest record is
+ * folded into the base snapshot before it is overwritten, so the dump always says what state the
+ * oldest remaining record starts from.
+ */
+TraceRecord &traceSlot() {
+  TraceRecord &rec = traceRing[traceHead];
+  if (traceCount < TRACE_RING_SIZE) {
+    traceCount++;
+    traceHead = (traceHead + 1) % TRACE_RING_SIZE;
+    return rec;
+  }
+
+  traceBaseTime += rec.dt;
+  if (rec.kind == TRACE_MODE) {
+    traceBase[0] = rec.value;
+  } else if (rec.kind == TRACE_INPUTS) {
+    traceBase[1] = rec.value;
+  } else if (rec.kind == TRACE_OUTPUTS) {
+    traceBase[2] = rec.value;
+  }
+  traceHead = (traceHead + 1) % TRACE_RING_SIZE;
+  return rec;
+}
+
+/**
+ * The function `traceSampleInputs` records an input edge whenever any sense input or button
+ * changed since the last record. Called once at the top of every loop pass.
+ */
+void traceSampleInputs() {
+  if (!traceActive) {
+    return;
+  }
+  uint8_t mask = readInputMask();
+  if (mask != traceInputs) {
+    traceInputs = mask;
+    traceRecord(TRACE_INPUTS, mask);
+  }
+}
+
+/**
+ * The function `traceSampleOutputs` records the relay/alarm state reached at the end of a loop
+ * pass when it differs from the last record. Sampling once per pass keeps the ring from filling
+ * with the intermediate writes the mode functions make on every pass.
+ */
+void traceSampleOutputs() {
+  if (traceActive && outputLatch != traceOutputs) {
+    traceOutputs = outputLatch;
+    traceRecord(TRACE_OUTPUTS, outputLatch);
+  }
+}
+
+void traceCommand(CommandId id) {
+  traceRecord(TRACE_COMMAND, id);
+}
+
+/**
+ * The function `traceModeChange` records the mode and control mode (packed as mode << 4 | control
+ * mode) when either one changed.
+ */
+void traceModeChange() {
+  uint8_t modes = packModes();
+  if (traceActive && modes != traceModes) {
+    traceModes = modes;
+    traceRecord(TRACE_MODE, modes);
+  }
+}
+
+/**
+ * The function `traceDump` streams the ring, oldest record first, as one binary frame:
+ * A5 5A 'T' version count modes inputs outputs uptime records[count] crc16. modes, inputs and
+ * outputs are the base snapshot the first record starts from, uptime (u32, ms) is when it was
+ * taken, and the CRC covers everything from 'T' up to the last record. Multi-byte fields are
+ * little endian.
+ */
+void traceDump() {
+  uint8_t header[10] = { 'T', TRACE_VERSION, traceCount, traceBase[0], traceBase[1], traceBase[2],
+                         (uint8_t)traceBaseTime, (uint8_t)(traceBaseTime >> 8),
+                         (uint8_t)(traceBaseTime >> 16), (uint8_t)(traceBaseTime >> 24) };
+  uint16_t crc = 0xFFFF;
+
+  Serial.write(FRAME_SYNC1);
+  Serial.write(FRAME_SYNC2);
+  for (uint8_t i = 0; i < sizeof(header); i++) {
+    Serial.write(header[i]);
+    crc = crc16Update(crc, header[i]);
+  }
+
+  uint8_t index = (traceHead + TRACE_RING_SIZE - traceCount) % TRACE_RING_SIZE;
+  for (uint8_t n = 0; n < traceCount; n++) {
+    const TraceRecord &rec = traceRing[index];
+    uint8_t bytes[4] = { (uint8_t)(rec.dt & 0xFF), (uint8_t)(rec.dt >> 8), rec.kind, rec.value };
+    for (uint8_t i = 0; i < sizeof(bytes); i++) {
+      Serial.write(bytes[i]);
+      crc = crc16Update(crc, bytes[i]);
+    }
+    index = (index + 1) % TRACE_RING_SIZE;
+  }
+
+  Serial.write((uint8_t)(crc & 0xFF));
+  Serial.write((uint8_t)(crc >> 8));
+}
+
+/**
+ * The function `crc16Update` folds one byte into a CRC-16/CCITT (polynomial 0x1021, start value
+ * 0xFFFF) used by all binary frames.
+ */
+uint16_t crc16Update(uint16_t crc, uint8_t data) {
+  crc ^= (uint16_t)data << 8;
+  for (uint8_t i = 0; i < 8; i++) {
+    crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+  }
+  return crc;
+}
+
+
+
+// event journal
+/**
+ * The function `journalInit` locates the ring position left by the previous run. Sequence numbers
+ * increase by one per record, so the head is the first slot that does not continue the sequence
+ * of the slot before it; an erased first slot means an empty journal.
+ */
+void journalInit() {
+  journalHead = 0;
+  journalCount = 0;
+  journalSeq = 0;
+  journalPendingCount = 0;
+  journalLastTime = uptimeSeconds();
+  journalGridUp = digitalRead(grid_check) == HIGH;
+
+  uint8_t first = EEPROM.read(journalAddress);
+  if (first == 0xFF) {
+    return;
+  }
+
+  uint8_t prev = first;
+  uint8_t slot = 1;
+  for (; slot < JOURNAL_RECORDS; slot++) {
+    uint8_t seq = EEPROM.read(journalAddress + slot * JOURNAL_RECORD_SIZE);
+    if (seq != (prev + 1) % JOURNAL_SEQ_MODULO) {
+      break;
+    }
+    prev = seq;
+  }
+
+  journalHead = slot % JOURNAL_RECORDS;
+  journalSeq = (prev + 1) % JOURNAL_SEQ_MODULO;
+  boolean wrapped = slot < JOURNAL_RECORDS &&
+                    EEPROM.read(journalAddress + slot * JOURNAL_RECORD_SIZE) != 0xFF;
+  journalCount = (wrapped || slot == JOURNAL_RECORDS) ? JOURNAL_RECORDS : slot;
+}
+
+/**
+ * The function `journalAppend` queues one event in RAM. The queue is written to EEPROM once it
+ * holds a full batch, or by `journalService` once the oldest queued record has waited
+ * `JOURNAL_FLUSH_INTERVAL`.
+ *
+ * @param code The `JournalEvent` to record.
+ * @param payload Event specific data.
+ */
+void journalAppend(JournalEvent code, uint16_t payload) {
+  uint32_t now = uptimeSeconds();
+  uint32_t dt = now - journalLastTime;
+  if (dt > 0xFFFF && clockSet && code != JE_CLOCK) {
+    journalAppend(JE_CLOCK, 0);  // the gap doesn't fit dt: anchor the wall clock again first
+    dt = 0;
+  }
+  journalLastTime = now;
+
+  if (journalPendingCount == 0) {
+    journalPendingSince = millis();
+  }
+  JournalRecord &rec = journalPending[journalPendingCount++];
+  rec.seq = journalSeq;
+  rec.code = code;
+  rec.dt = dt > 0xFFFF ? 0xFFFF : dt;
+  rec.payload = payload;
+  if (code == JE_CLOCK) {
+    uint32_t time = clockNow();
+    rec.dt = time >> 16;
+    rec.payload = time & 0xFFFF;
+  }
+  journalSeq = (journalSeq + 1) % JOURNAL_SEQ_MODULO;
+
+  if (journalPendingCount == JOURNAL_BATCH) {
+    journalFlush();
   }
 }
 
+/**
+ * The function `journalFlush` writes the queued records to the ring. `EEPROM.update` skips cells
+ * that already hold the right value, and the ring itself spreads the writes over all slots.
+ */
+void journalFlush() {
+  for (uint8_t i = 0; i < journalPendingCount; i++) {
+    int address = journalAddress + journalHead * JOURNAL_RECORD_SIZE;
+    const JournalRecord &rec = journalPending[i];
+    EEPROM.update(address, rec.seq);
+    EEPROM.update(address + 1, rec.code);
+    EEPROM.update(address + 2, rec.dt & 0xFF);
+    EEPROM.update(address + 3, rec.dt >> 8);
+    EEPROM.update(address + 4, rec.payload & 0xFF);
+    EEPROM.update(address + 5, rec.payload >> 8);
+    journalHead = (journalHead + 1) % JOURNAL_RECORDS;
+    if (journalCount < JOURNAL_RECORDS) journalCount++;
+  }
+  journalPendingCount = 0;
+}
+
+void journalService() {
+  if (journalPendingCount > 0 && millis() - journalPendingSince >= JOURNAL_FLUSH_INTERVAL) {
+    journalFlush();
+  }
+}
+
+/**
+ * The function `journalWatchGrid` records grid outages and how long they lasted. It runs at the
+ * power check rate, which also keeps a flickering grid from flooding the journal.
+ */
+void journalWatchGrid() {
+  boolean gridUp = digitalRead(grid_check) == HIGH;
+  if (gridUp == journalGridUp) {
+    return;
+  }
+  journalGridUp = gridUp;
+
+  if (!gridUp) {
+    gridLostTime = millis();
+    journalAppend(JE_GRID_LOST, 0);
+  } else {
+    unsigned long outage = (millis() - gridLostTime) / 1000;
+    journalAppend(JE_GRID_BACK, outage > 0xFFFF ? 0xFFFF : outage);
+  }
+}
+
+/**
+ * The function `journalDump` flushes anything still queued and streams the whole journal, oldest
+ * record first, as one binary frame: A5 5A 'J' version count records[count] crc16. Each record is
+ * seq, code, dt (u16), payload (u16), little endian.
+ */
+void journalDump() {
+  journalFlush();
+
+  uint8_t header[3] = { 'J', JOURNAL_VERSION, journalCount };
+  uint16_t crc = 0xFFFF;
+
+  Serial.write(FRAME_SYNC1);
+  Serial.write(FRAME_SYNC2);
+  for (uint8_t i = 0; i < sizeof(header); i++) {
+    Serial.write(header[i]);
+    crc = crc16Update(crc, header[i]);
+  }
+
+  uint8_t slot = (journalHead + JOURNAL_RECORDS - journalCount) % JOURNAL_RECORDS;
+  for (uint8_t n = 0; n < journalCount; n++) {
+    int address = journalAddress + slot * JOURNAL_RECORD_SIZE;
+    for (uint8_t i = 0; i < JOURNAL_RECORD_SIZE; i++) {
+      uint8_t b = EEPROM.read(address + i);
+      Serial.write(b);
+      crc = crc16Update(crc, b);
+    }
+    slot = (slot + 1) % JOURNAL_RECORDS;
+  }
+
+  Serial.write((uint8_t)(crc & 0xFF));
+  Serial.write((uint8_t)(crc >> 8));
+}
+
+uint8_t packModes() {
+  return (currentMode << 4) | currentControlMode;
+}
+
+
+
+// runtime counters
+/**
+ * The function `countersInit` restores the newest checkpoint with a valid CRC. Slots are written in
+ * rotation with an increasing sequence number, so a reset in the middle of a checkpoint write only
+ * loses that one slot.
+ */
+void countersInit() {
+  memset(&counters, 0, sizeof(counters));
+  counterSlot = COUNTER_SLOTS - 1;
+  counterSeq = 0;
+  boolean found = false;
+
+  // checkpoints from before the last counters were added are only read if there are no newer
+  // ones; the next checkpoint converts them
+  for (uint8_t pass = 0; pass <= COUNTER_LEGACY_LAYOUTS && !found; pass++) {
+    uint8_t slotSize = pass == 0 ? COUNTER_SLOT_SIZE : counterLegacy[pass - 1][0];
+    uint8_t size = pass == 0 ? sizeof(RuntimeCounters) : counterLegacy[pass - 1][1];
+    for (uint8_t slot = 0; slot < COUNTER_SLOTS; slot++) {
+      RuntimeCounters stored;
+      uint8_t seq;
+      if (!countersReadSlot(countersAddress + slot * slotSize, size, stored, seq)) {
+        continue;
+      }
+      if (!found || (int8_t)(seq - counterSeq) > 0) {
+        counters = stored;
+        counterSlot = slot;
+        counterSeq = seq;
+        found = true;
+      }
+    }
+  }
+
+  counterLastTime = millis();
+  lastCheckpointTime = counterLastTime;
+  countersDirty = false;
+}
+
+/**
+ * The function `countersReadSlot` reads one checkpoint slot. Counters beyond `size` bytes are
+ * zero.
+ *
+ * @param address EEPROM address of the slot's sequence byte.
+ * @param size Number of counter bytes stored in the slot.
+ * @param stored Receives the counters.
+ * @param seq Receives the slot's sequence number.
+ * @return true if the slot's CRC checks out.
+ */
+boolean countersReadSlot(int address, uint8_t size, RuntimeCounters &stored, uint8_t &seq) {
+  memset(&stored, 0, sizeof(stored));
+  seq = EEPROM.read(address);
+  uint8_t *bytes = (uint8_t *)&stored;
+  uint16_t crc = crc16Update(0xFFFF, seq);
+  for (uint8_t i = 0; i < size; i++) {
+    bytes[i] = EEPROM.read(address + 1 + i);
+    crc = crc16Update(crc, bytes[i]);
+  }
+  uint16_t storedCrc;
+  EEPROM.get(address + 1 + size, storedCrc);
+  return crc == storedCrc;
+}
+
+/**
+ * The function `countersService` runs once per loop pass. It accumulates generator run time and
+ * grid outage time, counts a transfer whenever the source relay closed at the end of a pass
+ * changes, and writes a checkpoint every `COUNTER_CHECKPOINT_INTERVAL` if anything changed.
+ */
+void countersService() {
+  unsigned long now = millis();
+  unsigned int elapsed = now - counterLastTime;
+  counterLastTime = now;
+
+  if ((outputLatch & 0x02) && digitalRead(generator_check) == HIGH) {
+    genRunMillis += elapsed;
+    if (genRunMillis >= 1000) {
+      counters.genRunSeconds += genRunMillis / 1000;
+      genRunMillis %= 1000;
+      countersDirty = true;
+    }
+  }
+  if (digitalRead(grid_check) == LOW) {
+    outageMillis += elapsed;
+    if (outageMillis >= 1000) {
+      counters.gridOutageSeconds += outageMillis / 1000;
+      outageMillis %= 1000;
+      countersDirty = true;
+    }
+  }
+
+  uint8_t source = outputLatch & 0x03;
+  if (source != counterSource) {
+    if (source == 0x02) {
+      counters.transfersToGen++;
+      countersDirty = true;
+    } else if (source == 0x01) {
+      counters.transfersToGrid++;
+      countersDirty = true;
+    }
+    counterSource = source;
+  }
+
+  if (countersDirty && now - lastCheckpointTime >= COUNTER_CHECKPOINT_INTERVAL) {
+    countersCheckpoint();
+  }
+}
+
+/**
+ * The function `countersCheckpoint` writes the counters to the next slot in rotation, which keeps
+ * each slot's write rate at a quarter of the checkpoint rate.
+ */
+void countersCheckpoint() {
+  counterSlot = (counterSlot + 1) % COUNTER_SLOTS;
+  counterSeq++;
+  int address = countersAddress + counterSlot * COUNTER_SLOT_SIZE;
+
+  uint16_t crc = crc16Update(0xFFFF, counterSeq);
+  const uint8_t *bytes = (const uint8_t *)&counters;
+  for (uint8_t i = 0; i < sizeof(counters); i++) {
+    crc = crc16Update(crc, bytes[i]);
+  }
+  EEPROM.update(address, counterSeq);
+  EEPROM.put(address + 1, counters);
+  EEPROM.put(address + 1 + sizeof(counters), crc);
+  unitHoursSave();
+
+  countersDirty = false;
+  lastCheckpointTime = millis();
+}
+
+/**
+ * The function `sendCounters` answers the `stats` query with all runtime counters in one JSON
+ * object.
+ */
+void sendCounters() {
+  JsonDocument jsonDoc;
+  jsonDoc[F("gen_run_s")] = counters.genRunSeconds;
+  jsonDoc[F("gen_starts")] = counters.genStarts;
+  jsonDoc[F("gen_start_fail")] = counters.genStartFailures;
+  jsonDoc[F("to_gen")] = counters.transfersToGen;
+  jsonDoc[F("to_grid")] = counters.transfersToGrid;
+  jsonDoc[F("retransfer_abort")] = counters.retransferAborts;
+  jsonDoc[F("crank_attempts")] = counters.crankAttempts;
+  jsonDoc[F("start_ok_pct")] = counters.genStarts != 0
+    ? (uint32_t)(counters.genStarts - counters.genStartFailures) * 100 / counters.genStarts : 100;
+  jsonDoc[F("outage_s")] = counters.gridOutageSeconds;
+  jsonDoc[F("fault_sensor")] = faultCounts[FC_SENSOR];
+  jsonDoc[F("fault_source")] = faultCounts[FC_SOURCE];
+  jsonDoc[F("fault_load")] = faultCounts[FC_LOAD];
+  jsonDoc[F("suspect")] = plausSuspect;
+  if (GEN_COUNT > 1) {
+    char key[12];                    // a writable key, so the document keeps a copy
+    strcpy_P(key, PSTR("unit0_run_s"));
+    for (uint8_t i = 0; i < GEN_COUNT; i++) {
+      key[4] = '0' + i;
+      jsonDoc[key] = unitRunSeconds[i];
+    }
+  }
+  jsonDoc[F("boot_us")] = bootRestoreMicros;
+  jsonDoc[F("boot_ok")] = bootRevalidated;
+  jsonDoc[F("wdt_resets")] = resetCounts.watchdog;
+  jsonDoc[F("bor_resets")] = resetCounts.brownOut;
+  jsonDoc[F("reset_cause")] = resetCause;
+  jsonDoc[F("idle_pct")] = idlePercent;
+  jsonDoc[F("sleep_max_us")] = idleLongest;
+  jsonDoc[F("soft_ms")] = softLastTime;
+  jsonDoc[F("soft_steps")] = softLastSteps;
+  jsonDoc[F("soft_timeouts")] = softTimeouts;
+  jsonDoc[F("time")] = clockNow();
+  serializeJson(jsonDoc, Serial);
+  Serial.println();
+}
+
+
+
+// chunked bulk transfer
+/**
+ * The function `writeFrameByte` sends one byte of a binary frame and folds it into the frame CRC.
+ */
+void writeFrameByte(uint8_t data, uint16_t &crc) {
+  Serial.write(data);
+  crc = crc16Update(crc, data);
+}
+
+/**
+ * The function `xferStart` starts a transfer, or resumes one after a dropped connection, from the
+ * given offset. Chunks are then sent by `xferService` from the main loop.
+ *
+ * @param source The `XferSource` to send, `XFER_NONE` cancels the current transfer.
+ * @param offset First byte to send; bytes before it are considered received.
+ */
+void xferStart(uint8_t source, uint16_t offset) {
+  xferSource = source;
+  if (source == XFER_JOURNAL) {
+    journalFlush();
+    xferTotal = journalCount * JOURNAL_RECORD_SIZE;
+  } else if (source == XFER_TRACE) {
+    traceStop();  // freeze the ring so offsets stay valid
+    xferTotal = TRACE_BASE_SIZE + traceCount * sizeof(TraceRecord);
+  } else if (source == XFER_COUNTERS) {
+    xferCounters = counters;
+    xferTotal = sizeof(xferCounters);
+  } else {
+    xferSource = XFER_NONE;
+    return;
+  }
+
+  xferAcked = offset > xferTotal ? xferTotal : offset;
+  xferNext = xferAcked;
+  xferLastAckTime = millis();
+  xferLastProgressTime = xferLastAckTime;
+}
+
+/**
+ * The function `xferAck` handles a cumulative acknowledgement from the client. A `nak` names the
+ * offset of a chunk that failed its CRC and makes the sender go back to it at once instead of
+ * waiting for `XFER_ACK_TIMEOUT`.
+ *
+ * @param offset Every byte below this offset was received intact.
+ * @param resend True for a `nak`.
+ */
+void xferAck(uint16_t offset, boolean resend) {
+  if (xferSource == XFER_NONE || offset > xferTotal) {
+    return;
+  }
+  xferLastAckTime = millis();
+  if (offset > xferAcked) {
+    xferAcked = offset;
+    xferLastProgressTime = xferLastAckTime;
+    if (xferNext < xferAcked) {
+      xferNext = xferAcked;
+    }
+  }
+  if (resend) {
+    xferNext = xferAcked;
+  }
+  if (xferAcked == xferTotal) {
+    xferSource = XFER_NONE;
+  }
+}
+
+/**
+ * The function `xferService` sends at most one chunk per loop pass, and only when the UART buffer
+ * can take the whole frame, so the transfer never blocks the control loop. Up to `XFER_WINDOW`
+ * chunks go out ahead of the last acknowledgement. Frame layout:
+ * A5 5A 'C' source total(u16) offset(u16) len data[len] crc16, CRC from 'C' to the last data byte.
+ */
+void xferService() {
+  if (xferSource == XFER_NONE) {
+    return;
+  }
+
+  unsigned long now = millis();
+  if (now - xferLastAckTime >= XFER_ABANDON_TIMEOUT) {
+    xferSource = XFER_NONE;
+    return;
+  }
+  if (xferNext > xferAcked && now - xferLastProgressTime >= XFER_ACK_TIMEOUT) {
+    xferNext = xferAcked;  // go back and resend everything unacknowledged
+    xferLastProgressTime = now;
+  }
+
+  if (xferNext >= xferTotal || xferNext - xferAcked >= XFER_WINDOW * XFER_CHUNK_SIZE) {
+    return;
+  }
+  uint16_t len = xferTotal - xferNext;
+  if (len > XFER_CHUNK_SIZE) {
+    len = XFER_CHUNK_SIZE;
+  }
+  if (Serial.availableForWrite() < (int)(len + XFER_FRAME_OVERHEAD)) {
+    return;
+  }
+
+  uint16_t crc = 0xFFFF;
+  Serial.write(FRAME_SYNC1);
+  Serial.write(FRAME_SYNC2);
+  writeFrameByte('C', crc);
+  writeFrameByte(xferSource, crc);
+  writeFrameByte(xferTotal & 0xFF, crc);
+  writeFrameByte(xferTotal >> 8, crc);
+  writeFrameByte(xferNext & 0xFF, crc);
+  writeFrameByte(xferNext >> 8, crc);
+  writeFrameByte(len, crc);
+  for (uint16_t i = 0; i < len; i++) {
+    writeFrameByte(xferByte(xferNext + i), crc);
+  }
+  Serial.write((uint8_t)(crc & 0xFF));
+  Serial.write((uint8_t)(crc >> 8));
+
+  xferNext += len;
+}
+
+/**
+ * The function `xferByte` returns one byte of the current transfer payload. Journal and trace
+ * bytes are laid out oldest record first, exactly as in their dump frames.
+ */
+uint8_t xferByte(uint16_t offset) {
+  if (xferSource == XFER_JOURNAL) {
+    uint8_t slot = (journalHead + JOURNAL_RECORDS - journalCount + offset / JOURNAL_RECORD_SIZE) % JOURNAL_RECORDS;
+    return EEPROM.read(journalAddress + slot * JOURNAL_RECORD_SIZE + offset % JOURNAL_RECORD_SIZE);
+  }
+  if (xferSource == XFER_TRACE) {
+    // the base snapshot comes first, as in the trace_dump header
+    if (offset < TRACE_BASE_SIZE) {
+      return offset < 3 ? traceBase[offset] : (uint8_t)(traceBaseTime >> (8 * (offset - 3)));
+    }
+    offset -= TRACE_BASE_SIZE;
+    uint8_t index = (traceHead + TRACE_RING_SIZE - traceCount + offset / sizeof(TraceRecord)) % TRACE_RING_SIZE;
+    const TraceRecord &rec = traceRing[index];
+    uint8_t bytes[4] = { (uint8_t)(rec.dt & 0xFF), (uint8_t)(rec.dt >> 8), rec.kind, rec.value };
+    return bytes[offset % sizeof(TraceRecord)];
+  }
+  return ((const uint8_t *)&xferCounters)[offset];
+}
+
+
+
+// runtime configuration
+/**
+ * The function `configLoad` fills `config` with the defaults and then overlays each EEPROM block
+ * whose version and CRC check out. A block written by an older firmware with fewer values is still
+ * used; the values it doesn't have keep their defaults. A stored value outside its range falls back
+ * to its default, and a set whose bands close up falls back to the defaults as a whole.
+ */
+void configLoad() {
+  for (uint8_t i = 0; i < CFG_COUNT; i++) {
+    config[i] = pgm_read_word(&configDefaults[i]);
+  }
+  configLoadBlock(configAddress, 0, CONFIG_MAX_COUNT);
+  configLoadBlock(configExtAddress, CONFIG_MAX_COUNT, CONFIG_EXT_MAX_COUNT);
+  if (!configConsistent()) {
+    // each value is in range but the bands close up: don't guess which one is wrong
+    for (uint8_t i = 0; i < CFG_COUNT; i++) {
+      config[i] = configDefaults[i];
+    }
+  }
+}
+
+/**
+ * The function `configLoadBlock` overlays `config` with one EEPROM block.
+ *
+ * @param address EEPROM address of the block.
+ * @param first Index of the block's first value in `config`.
+ * @param maxCount Most values the block can hold.
+ */
+void configLoadBlock(int address, uint8_t first, uint8_t maxCount) {
+  uint8_t version = EEPROM.read(address);
+  uint8_t count = EEPROM.read(address + 1);
+  if (version != CONFIG_VERSION || count == 0 || count > maxCount) {
+    return;
+  }
+
+  uint16_t crc = crc16Update(crc16Update(0xFFFF, version), count);
+  for (uint8_t i = 0; i < count * 2; i++) {
+    crc = crc16Update(crc, EEPROM.read(address + 2 + i));
+  }
+  uint16_t storedCrc;
+  EEPROM.get(address + 2 + count * 2, storedCrc);
+  if (crc != storedCrc) {
+    return;
+  }
+
+  for (uint8_t i = 0; i < count && first + i < CFG_COUNT; i++) {
+    EEPROM.get(address + 2 + i * 2, config[first + i]);
+    if (!configInRange(first + i, config[first + i])) {
+      config[first + i] = configDefaults[first + i];
+    }
+  }
+}
+
+/**
+ * The function `configSave` writes the blocks back; `EEPROM.update` leaves unchanged cells
+ * alone, so setting one value only wears the cells that actually differ.
+ */
+void configSave() {
+  configSaveBlock(configAddress, 0, CONFIG_BASE_COUNT);
+  if (CFG_COUNT > CONFIG_BASE_COUNT) {
+    configSaveBlock(configExtAddress, CONFIG_BASE_COUNT, CFG_COUNT - CONFIG_BASE_COUNT);
+  }
+}
+
+/**
+ * The function `configSaveBlock` writes `count` values from `config[first]` on as one block.
+ */
+void configSaveBlock(int address, uint8_t first, uint8_t count) {
+  uint16_t crc = crc16Update(crc16Update(0xFFFF, CONFIG_VERSION), count);
+  EEPROM.update(address, CONFIG_VERSION);
+  EEPROM.update(address + 1, count);
+  for (uint8_t i = 0; i < count; i++) {
+    uint16_t value = config[first + i];
+    EEPROM.update(address + 2 + i * 2, value & 0xFF);
+    EEPROM.update(address + 3 + i * 2, value >> 8);
+    crc = crc16Update(crc16Update(crc, value & 0xFF), value >> 8);
+  }
+  EEPROM.put(address + 2 + count * 2, crc);
+}
+
+/**
+ * The function `configFind` looks a name up in `configNames`.
+ *
+ * @return The `ConfigKey` index, or -1 if there is no such value.
+ */
+int configFind(const char *name) {
+  return findName(configNames, CFG_COUNT, name);
+}
+
+/**
+ * The function `sendConfig` reports every configuration value as one JSON object.
+ */
+void sendConfig() {
+  const char *p = configNames;
+  Serial.print(F("{\""));
+  for (uint8_t i = 0; i < CFG_COUNT; i++) {
+    char c;
+    while ((c = pgm_read_byte(p++)) != ',' && c != '\0') {
+      Serial.print(c);
+    }
+    Serial.print(F("\":"));
+    Serial.print((unsigned int)config[i]);
+    Serial.print(i + 1 < CFG_COUNT ? F(",\"") : F("}"));
+  }
+  Serial.println();
+}
+
+/**
+ * The function `configInRange` checks a value against the range `configLimits` gives its key.
+ */
+boolean configInRange(uint8_t key, long value) {
+  return value >= (long)configLimits[key][0] && value <= (long)configLimits[key][1];
+}
+
+/**
+ * The function `configConsistent` checks that both grid bands stay open once the hysteresis margin is
+ * taken off each end, so a grid that left its band can always come back into it, and that shed
+ * circuits reconnect below the load that sheds them.
+ */
+boolean configConsistent() {
+  return config[CFG_GRID_V_MIN] + 2 * config[CFG_GRID_V_HYST] < config[CFG_GRID_V_MAX] &&
+         config[CFG_GRID_F_MIN] + 2 * config[CFG_GRID_F_HYST] < config[CFG_GRID_F_MAX] &&
+         config[CFG_RESTORE_LEVEL] < config[CFG_SHED_LEVEL];
+}
+
+/**
+ * The function `configCommand` handles `cfg` (report), `cfg defaults` (restore and save the
+ * defaults) and `cfg <name> <value>` (change one value live and save it). The value must be a
+ * plain decimal number within its key's range.
+ *
+ * @param args Everything after `cfg`.
+ * @return `RESULT_ERROR` for an unknown name or a value out of range.
+ */
+CommandResult configCommand(String args) {
+  args.trim();
+  if (args.length() == 0) {
+    sendConfig();
+    return RESULT_OK;
+  }
+  if (wordIs(args, PSTR("defaults"))) {
+    for (uint8_t i = 0; i < CFG_COUNT; i++) {
+      config[i] = pgm_read_word(&configDefaults[i]);
+    }
+    configSave();
+    if (!waveStreaming) {
+      gridSenseStart();
+    }
+    sendConfig();
+    return RESULT_OK;
+  }
+
+  int space = args.indexOf(' ');
+  int key = space > 0 ? configFind(args.substring(0, space).c_str()) : -1;
+  String text = args.substring(space + 1);
+  const char *digits = text.c_str();
+  char *end;
+  long value = strtol(digits, &end, 10);
+  if (key < 0 || *digits < '0' || *digits > '9' || *end != '\0' || !configInRange(key, value)) {
+    return RESULT_ERROR;
+  }
+  uint16_t previous = config[key];
+  config[key] = value;
+  if (!configConsistent()) {
+    config[key] = previous;
+    return RESULT_ERROR;
+  }
+  configSave();
+  if (key == CFG_GRID_V_SCALE && !waveStreaming) {
+    gridSenseStart();
+  }
+  sendConfig();
+  return RESULT_OK;
+}
+
+
+
+// fast-resume boot
+/**
+ * The function `readSafeRelays` returns the relay configuration saved by `safeStateService`, or 0
+ * (everything open) if the stored byte and its complement don't match or describe both sources
+ * closed at once.
+ */
+uint8_t readSafeRelays() {
+  uint8_t mask = EEPROM.read(safeRelaysAddress);
+  uint8_t check = EEPROM.read(safeRelaysAddress + 1);
+  if ((uint8_t)~mask != check || (mask & ~RELAY_MASK) || (mask & 0x03) == 0x03) {
+    return 0;
+  }
+  return mask;
+}
+
+/**
+ * The function `restoreRelays` drives the relay pins straight through their port registers, which
+ * takes microseconds instead of a `pinMode`/`digitalWrite` round per pin. The output level is set
+ * before the pin is switched to output so a closed relay never glitches open. A pin past the
+ * core's digital pin table has no port entry to look up and takes the normal path.
+ *
+ * @param mask Relay bits as in `outputLatch`: 0x01 grid, 0x02 generator, 0x04 load.
+ */
+void restoreRelays(uint8_t mask) {
+  const int pins[3] = { grid_relay, generator_relay, load_relay };
+  for (uint8_t i = 0; i < 3; i++) {
+    boolean on = mask & (1 << i);
+#if defined(__AVR__)
+    if (pins[i] < NUM_DIGITAL_PINS) {
+      uint8_t port = digitalPinToPort(pins[i]);
+      uint8_t bit = digitalPinToBitMask(pins[i]);
+      if (on) {
+        *portOutputRegister(port) |= bit;
+      } else {
+        *portOutputRegister(port) &= ~bit;
+      }
+      *portModeRegister(port) |= bit;
+      continue;
+    }
+#endif
+    digitalWrite(pins[i], on ? HIGH : LOW);
+    pinMode(pins[i], OUTPUT);
+  }
+  outputLatch = (outputLatch & ~RELAY_MASK) | mask;
+}
+
+/**
+ * The function `relaysVerified` checks a relay configuration against the sense inputs: every closed
+ * source must be live, a closed load relay must see the load powered, and the two sources must
+ * never be closed together.
+ */
+boolean relaysVerified(uint8_t mask) {
+  if ((mask & 0x03) == 0x03) {
+    return false;
+  }
+  if ((mask & 0x01) && digitalRead(grid_check) == LOW) {
+    return false;
+  }
+  if ((mask & 0x02) && digitalRead(generator_check) == LOW) {
+    return false;
+  }
+  if ((mask & 0x04) && ((mask & 0x03) == 0 || digitalRead(load_check) == LOW)) {
+    return false;
+  }
+  return true;
+}
+
+/**
+ * The function `bootResume` shows the saved mode on the LEDs and, if relays were restored, holds
+ * the mode logic off until `bootRevalidate` has checked them.
+ */
+void bootResume() {
+  digitalWrite(manual_led, currentMode == MANUAL ? LOW : HIGH);
+  digitalWrite(semi_auto_led, currentMode == SEMI_AUTO ? LOW : HIGH);
+  digitalWrite(fully_auto_led, currentMode == FULLY_AUTO ? LOW : HIGH);
+
+  bootRestoreTime = millis();
+  safeCandidate = savedSafeRelays;
+  safeCandidateSince = bootRestoreTime;
+  bootRevalidating = savedSafeRelays != 0;
+  bootRevalidated = false;
+  if (!bootRevalidating) {
+    bootRestoreMicros = 0;  // nothing was restored
+  }
+}
+
+/**
+ * The function `bootRevalidate` runs in place of the mode logic while the restored relays settle.
+ * After the power check delay it checks them against the sense inputs and hands control back to
+ * the mode logic, which keeps a good configuration and transfers away from a bad one.
+ */
+void bootRevalidate() {
+  if (millis() - bootRestoreTime < config[CFG_POWER_CHECK_DELAY]) {
+    return;
+  }
+  bootRevalidated = relaysVerified(outputLatch & RELAY_MASK);
+  bootRevalidating = false;
+}
+
+/**
+ * The function `safeStateService` saves the relay configuration once it has stayed the same and
+ * verified for `SAFE_STATE_HOLD`. Only changes are written, so a steady site never touches EEPROM.
+ */
+void safeStateService() {
+  uint8_t relays = outputLatch & RELAY_MASK;
+  unsigned long now = millis();
+  if (relays != safeCandidate) {
+    safeCandidate = relays;
+    safeCandidateSince = now;
+    return;
+  }
+  if (relays == savedSafeRelays || now - safeCandidateSince < SAFE_STATE_HOLD) {
+    return;
+  }
+  if (!relaysVerified(relays)) {
+    safeCandidateSince = now;  // start timing again once it checks out
+    return;
+  }
+  EEPROM.update(safeRelaysAddress, relays);
+  EEPROM.update(safeRelaysAddress + 1, ~relays);
+  savedSafeRelays = relays;
+}
+
+
+
+// bluetooth link speed
+/**
+ * The function `linkInit` opens the serial port at the rate negotiated last time, or 9600 baud if
+ * there is none.
+ */
+void linkInit() {
+  uint8_t stored = EEPROM.read(linkRateAddress);
+  uint8_t rate = stored & ~LINK_HC06_FLAG;
+  if (rate >= LINK_RATE_COUNT || (uint8_t)~stored != EEPROM.read(linkRateAddress + 1)) {
+    stored = 0;
+    rate = LINK_DEFAULT_RATE;
+  }
+  linkModule = stored & LINK_HC06_FLAG ? LINK_HC06 : LINK_HC05;
+  linkRate = rate;
+  linkTarget = rate;
+  linkUartRate = rate;
+  Serial.begin(pgm_read_dword(&linkRates[linkRate]));
+}
+
+/**
+ * The function `linkNegotiate` starts switching the module and the UART to `target`. It first
+ * finds the rate the module answers at, starting with the current one and the module type that
+ * answered last time.
+ *
+ * @param target Index into `linkRates`.
+ */
+void linkNegotiate(uint8_t target) {
+  linkTarget = target;
+  linkFallingBack = false;
+  linkProbeCount = 0;
+  linkProbe(linkRate);
+}
+
+/**
+ * The function `linkProbe` sends a bare `AT` at the given rate, once the UART is on it, and waits
+ * for `OK`.
+ */
+void linkProbe(uint8_t rate) {
+  linkSwitch(rate, LINK_PROBE);
+}
+
+/**
+ * The function `linkSwitch` moves the UART to another rate as soon as what is queued at the
+ * current one has left, then enters `next`: a probe, or `LINK_IDLE` to report the outcome.
+ *
+ * @param rate Index into `linkRates`.
+ * @param next State to enter at the new rate.
+ */
+void linkSwitch(uint8_t rate, LinkState next) {
+  // the bytes still in the buffer plus the one being shifted out, 10 bit times each
+  unsigned long queued = SERIAL_TX_BUFFER_SIZE - Serial.availableForWrite();
+  linkProbeRate = rate;
+  linkNext = next;
+  linkState = LINK_DRAIN;
+  linkDeadline = millis() + queued * 10000UL / pgm_read_dword(&linkRates[linkUartRate]) + 1;
+}
+
+/**
+ * The function `linkService` advances the negotiation by at most one step per loop pass, so the
+ * control logic keeps running while the UART drains and the module answers.
+ */
+void linkService() {
+  if (linkState == LINK_IDLE) {
+    if (linkPending != 0xFF) {
+      linkNegotiate(linkPending);  // the request's ack leaves at the old rate first
+      linkPending = 0xFF;
+    }
+    return;
+  }
+
+  boolean ok = linkState != LINK_DRAIN && linkState != LINK_RESTART && linkReplyOk();
+  boolean timedOut = (long)(millis() - linkDeadline) >= 0;
+  if (!ok && !timedOut) {
+    return;
+  }
+
+  switch (linkState) {
+    case LINK_DRAIN:
+      Serial.begin(pgm_read_dword(&linkRates[linkProbeRate]));
+      linkUartRate = linkProbeRate;
+      while (Serial.available() > 0) {
+        Serial.read();  // a late reply to the previous command must not count
+      }
+      linkReplyLength = 0;
+      linkState = linkNext;
+      if (linkState == LINK_IDLE) {
+        sendLinkStatus(linkResult);
+        return;
+      }
+      digitalWrite(bt_key_pin, HIGH);
+      Serial.print(linkModule == LINK_HC06 ? F("AT") : F("AT\r\n"));
+      linkDeadline = millis() + LINK_REPLY_TIMEOUT;
+      break;
+
+    case LINK_PROBE:
+      if (ok) {
+        linkRate = linkProbeRate;
+        if (linkRate == linkTarget) {
+          linkFinish(!linkFallingBack);
+          return;
+        }
+        linkReplyLength = 0;
+        if (linkModule == LINK_HC06) {
+          Serial.print(F("AT+BAUD"));
+          Serial.print(linkTarget + 4);  // AT+BAUD4 is 9600
+        } else {
+          Serial.print(F("AT+UART="));
+          Serial.print(pgm_read_dword(&linkRates[linkTarget]));
+          Serial.print(F(",0,0\r\n"));
+        }
+        linkState = LINK_SET_RATE;
+        linkDeadline = millis() + LINK_REPLY_TIMEOUT;
+      } else if (++linkProbeCount < 2 * LINK_RATE_COUNT) {
+        if (linkProbeCount == LINK_RATE_COUNT) {
+          // no answer at any rate: try the other module type's commands
+          linkModule = linkModule == LINK_HC06 ? LINK_HC05 : LINK_HC06;
+        }
+        linkProbe((linkProbeRate + 1) % LINK_RATE_COUNT);  // scan for the module
+      } else {
+        linkRate = LINK_DEFAULT_RATE;  // module not answering at all
+        linkFinish(false);
+      }
+      break;
+
+    case LINK_SET_RATE:
+      if (!ok) {
+        linkFinish(false);  // module kept its rate
+      } else if (linkModule == LINK_HC06) {
+        linkSwitch(linkTarget, LINK_VERIFY);  // HC-06 switches immediately
+      } else {
+        Serial.print(F("AT+RESET\r\n"));  // HC-05 applies the new rate after a restart
+        linkState = LINK_RESTART;
+        linkDeadline = millis() + LINK_RESTART_TIME;
+      }
+      break;
+
+    case LINK_RESTART:
+      linkSwitch(linkTarget, LINK_VERIFY);
+      break;
+
+    case LINK_VERIFY:
+      if (ok) {
+        linkRate = linkTarget;
+        linkFinish(!linkFallingBack);
+      } else if (!linkFallingBack) {
+        // the module didn't answer at the new rate: find it and put it back on the old one
+        linkFallingBack = true;
+        linkTarget = linkRate;
+        linkProbeCount = 0;
+        linkProbe(linkRate);
+      } else {
+        linkFinish(false);
+      }
+      break;
+
+    default:
+      break;
+  }
+}
+
+/**
+ * The function `linkFinish` returns the module to data mode, stores `linkRate` and the module type
+ * when the negotiation succeeded and has the outcome reported once the UART is back on that rate.
+ */
+void linkFinish(boolean ok) {
+  digitalWrite(bt_key_pin, LOW);
+  if (ok) {
+    uint8_t stored = linkRate | (linkModule == LINK_HC06 ? LINK_HC06_FLAG : 0);
+    EEPROM.update(linkRateAddress, stored);
+    EEPROM.update(linkRateAddress + 1, ~stored);
+  }
+  linkTarget = linkRate;
+  linkResult = ok;
+  linkSwitch(linkRate, LINK_IDLE);
+}
+
+/**
+ * The function `linkReplyOk` collects the module's reply and returns true once it has said `OK`.
+ */
+boolean linkReplyOk() {
+  while (Serial.available() > 0) {
+    char c = Serial.read();
+    if (linkReplyLength < sizeof(linkReply)) {
+      linkReply[linkReplyLength++] = c;
+    }
+    if (linkReplyLength >= 2 && linkReply[0] == 'O' && linkReply[1] == 'K') {
+      return true;
+    }
+    if (c == '\n') {
+      linkReplyLength = 0;  // some other line, keep waiting
+    }
+  }
+  return false;
+}
+
+int linkRateIndex(unsigned long baud) {
+  for (uint8_t i = 0; i < LINK_RATE_COUNT; i++) {
+    if (pgm_read_dword(&linkRates[i]) == baud) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void sendLinkStatus(boolean ok) {
+  Serial.print(F("{\"link\":"));
+  Serial.print(pgm_read_dword(&linkRates[linkRate]));
+  Serial.print(ok ? F(",\"ok\":true}") : F(",\"ok\":false}"));
+  Serial.println();
+}
+
+
+
+// batched commands
+
+/**
+ * The function `batchCommand` runs several mode and control commands as one, e.g. `batch man gen`.
+ * All words are checked before anything changes, so a batch is applied completely or not at all.
+ *
+ * @param args The commands, separated by spaces: at most one of man/semi/auto and at most one of
+ * gen/grid/stop.
+ * @return `RESULT_ERROR` for an unknown word, a repeated kind or an empty batch, `RESULT_REJECTED`
+ * when a control command is combined with fully automatic mode, otherwise `RESULT_OK`.
+ */
+CommandResult batchCommand(String args) {
+  int mode = -1;
+  int control = -1;
+
+  args.trim();
+  while (args.length() > 0) {
+    int space = args.indexOf(' ');
+    String word = space < 0 ? args : args.substring(0, space);
+    args = space < 0 ? String() : args.substring(space + 1);
+    args.trim();
+
+    int wordMode = wordIs(word, PSTR("man")) ? MANUAL
+                   : wordIs(word, PSTR("semi")) ? SEMI_AUTO
+                   : wordIs(word, PSTR("auto")) ? FULLY_AUTO : -1;
+    int wordControl = wordIs(word, PSTR("gen")) ? GEN
+                      : wordIs(word, PSTR("grid")) ? GRID
+                      : wordIs(word, PSTR("stop")) ? STOP : -1;
+    if (wordMode >= 0 && mode < 0) {
+      mode = wordMode;
+    } else if (wordControl >= 0 && control < 0) {
+      control = wordControl;
+    } else {
+      return RESULT_ERROR;
+    }
+  }
+
+  if (mode < 0 && control < 0) {
+    return RESULT_ERROR;
+  }
+  if (mode < 0) {
+    mode = currentMode;
+  }
+  if (control >= 0 && mode != MANUAL) {
+    return RESULT_REJECTED;  // the transfer logic picks the source outside manual mode
+  }
+  if (control < 0) {
+    control = currentControlMode;
+  }
+  applyBatch(static_cast<Mode>(mode), static_cast<ControlMode>(control));
+  return RESULT_OK;
+}
+
+/**
+ * The function `applyBatch` switches mode and control mode together within one loop pass: both
+ * are set and saved before the mode logic runs, so the relays never act on a half-applied
+ * change, and a single journal record and telemetry frame report the result.
+ */
+void applyBatch(Mode mode, ControlMode control) {
+  traceRecord(TRACE_BATCH, mode << 4 | control);
+  if (mode != currentMode || control != currentControlMode) {
+    currentMode = mode;
+    currentControlMode = control;
+    journalAppend(JE_MODE, packModes());
+  }
+  saveModeToEEPROM(mode);
+  saveControlModeToEEPROM(control);
+
+  selectMode(mode);  // LEDs and one pass of the mode logic with both changes in place
+  sendTelemetry();
+}
+
+
+
+// telemetry subscriptions
+
+/**
+ * The function `findName` looks a name up in a comma-separated list kept in flash.
+ *
+ * @return The position of the name in the list, or -1 if it is not there.
+ */
+int findName(const char *names, uint8_t count, const char *name) {
+  const char *p = names;
+  for (uint8_t index = 0; index < count; index++) {
+    const char *n = name;
+    char c;
+    while ((c = pgm_read_byte(p)) != ',' && c != '\0' && c == *n) {
+      p++;
+      n++;
+    }
+    if ((c == ',' || c == '\0') && *n == '\0') {
+      return index;
+    }
+    while ((c = pgm_read_byte(p)) != ',' && c != '\0') {
+      p++;
+    }
+    p++;
+  }
+  return -1;
+}
+
+/**
+ * The function `printName` prints entry `index` of a comma-separated list kept in flash.
+ */
+void printName(const char *names, uint8_t index) {
+  const char *p = names;
+  char c;
+  while (index > 0) {
+    if (pgm_read_byte(p++) == ',') {
+      index--;
+    }
+  }
+  while ((c = pgm_read_byte(p++)) != ',' && c != '\0') {
+    Serial.print(c);
+  }
+}
+
+/**
+ * The function `wordIs` compares received text with a word kept in flash, so command words don't
+ * take up RAM.
+ */
+boolean wordIs(const String &text, PGM_P word) {
+  return strcmp_P(text.c_str(), word) == 0;
+}
+
+/**
+ * The function `wordStarts` tells whether received text begins with a prefix kept in flash.
+ */
+boolean wordStarts(const String &text, PGM_P prefix) {
+  return strncmp_P(text.c_str(), prefix, strlen_P(prefix)) == 0;
+}
+
+/**
+ * The function `subCommand` handles `sub` (report the subscriptions), `sub default` (back to the
+ * legacy LED frame), `sub off` (no telemetry) and `sub <field>=<ms> ...`, which sets the period of
+ * each named field and leaves the others as they are. `leds` names all eight LED fields, a period
+ * of 0 unsubscribes. Every word is checked before any period changes.
+ *
+ * @param args Everything after `sub`.
+ * @return `RESULT_ERROR` for an unknown field, a period over 25500 ms or too many words.
+ */
+CommandResult subCommand(String args) {
+  uint8_t fields[SUB_MAX_WORDS];
+  uint8_t periods[SUB_MAX_WORDS];
+  uint8_t words = 0;
+
+  args.trim();
+  if (args.length() == 0) {
+    sendSubscriptions();
+    return RESULT_OK;
+  }
+  if (wordIs(args, PSTR("default"))) {
+    subActive = false;
+    return RESULT_OK;
+  }
+  if (wordIs(args, PSTR("off"))) {
+    memset(subPeriod, 0, sizeof(subPeriod));
+    subActive = true;
+    return RESULT_OK;
+  }
+
+  while (args.length() > 0) {
+    int space = args.indexOf(' ');
+    String word = space < 0 ? args : args.substring(0, space);
+    args = space < 0 ? String() : args.substring(space + 1);
+    args.trim();
+
+    int equals = word.indexOf('=');
+    if (equals <= 0 || words == SUB_MAX_WORDS) {
+      return RESULT_ERROR;
+    }
+    String name = word.substring(0, equals);
+    int field = wordIs(name, PSTR("leds")) ? TF_COUNT : findName(fieldNames, TF_COUNT, name.c_str());
+    long ms = word.substring(equals + 1).toInt();
+    if (field < 0 || ms < 0 || ms > (long)(255 * SUB_TICK)) {
+      return RESULT_ERROR;
+    }
+    fields[words] = field;
+    periods[words] = (ms + SUB_TICK - 1) / SUB_TICK;
+    words++;
+  }
+
+  if (!subActive) {
+    memset(subPeriod, 0, sizeof(subPeriod));  // the client lists what it wants from scratch
+    subActive = true;
+  }
+  for (uint8_t i = 0; i < words; i++) {
+    if (fields[i] == TF_COUNT) {
+      memset(subPeriod, periods[i], TF_LED_COUNT);
+    } else {
+      subPeriod[fields[i]] = periods[i];
+    }
+  }
+  return RESULT_OK;
+}
+
+/**
+ * The function `subService` advances the subscription tick and sends the fields that fall due on
+ * it as one frame. Ticks stretch by XFER_TELEMETRY_FACTOR while a bulk transfer runs.
+ */
+void subService() {
+  unsigned long tick = SUB_TICK;
+  if (xferSource) {
+    tick *= XFER_TELEMETRY_FACTOR;
+  }
+  if (millis() - lastSubTickTime < tick) {
+    return;
+  }
+  lastSubTickTime = millis();
+  subTick++;
+
+  uint32_t due = 0;
+  for (uint8_t i = 0; i < TF_COUNT; i++) {
+    if (subPeriod[i] != 0 && subTick % subPeriod[i] == 0) {
+      due |= 1UL << i;
+    }
+  }
+  if (due) {
+    sendFields(due);
+  }
+}
+
+/**
+ * The function `sendFields` sends the selected fields as one flat JSON frame, using the same keys
+ * and values as the LED and stats frames.
+ *
+ * @param mask One bit per `TelemetryField`.
+ */
+void sendFields(uint32_t mask) {
+  const int ledPins[TF_LED_COUNT] = {
+    load_fail_led, manual_led, semi_auto_led, fully_auto_led, load_on_led, gen_on_led, gen_fail_led, grid_on_led
+  };
+  char separator = '{';
+
+  for (uint8_t i = 0; i < TF_COUNT; i++) {
+    if (!(mask & 1UL << i)) {
+      continue;
+    }
+    Serial.print(separator);
+    Serial.print('"');
+    printName(fieldNames, i);
+    Serial.print(F("\":"));
+    separator = ',';
+
+    if (i < TF_LED_COUNT) {
+      Serial.print(getPinStatus(ledPins[i]) ? F("false") : F("true"));  // LEDs are active low
+      continue;
+    }
+    switch (i) {
+      case TF_MODE:
+        Serial.print(currentMode);
+        break;
+      case TF_CONTROL:
+        Serial.print(currentControlMode);
+        break;
+      case TF_RELAYS:
+        Serial.print(outputLatch);
+        break;
+      case TF_UPTIME:
+        Serial.print(uptimeSeconds());
+        break;
+      case TF_GEN_RUN:
+        Serial.print(counters.genRunSeconds);
+        break;
+      case TF_OUTAGE:
+        Serial.print(counters.gridOutageSeconds);
+        break;
+      case TF_GEN_STARTS:
+        Serial.print(counters.genStarts);
+        break;
+      case TF_TIME:
+        Serial.print(clockNow());
+        break;
+      case TF_TRANSFER:
+        Serial.print(transferState);
+        break;
+      case TF_GRID_V:
+        Serial.print(gridVolts);
+        break;
+      case TF_GRID_F:
+        Serial.print(gridDeciHz);
+        break;
+      case TF_LOADS:
+        Serial.print(loadsOn | (outputLatch & 0x04 ? 0x01 : 0));
+        break;
+      case TF_GEN_LOAD:
+        Serial.print(genLoad);
+        break;
+      case TF_RISK:
+        Serial.print(riskLevel());
+        break;
+      case TF_PROPOSAL:
+        Serial.print(proposal);
+        break;
+      case TF_UNITS:
+        Serial.print(unitsOnline);
+        break;
+      case TF_RESETS:
+        Serial.print(resetCounts.watchdog);
+        break;
+      case TF_RESET_CAUSE:
+        Serial.print(resetCause);
+        break;
+    }
+  }
+  if (separator != '{') {
+    Serial.println('}');
+  }
+}
+
+/**
+ * The function `sendSubscriptions` reports the subscribed fields and their periods in ms.
+ */
+void sendSubscriptions() {
+  Serial.print(F("{\"sub\":"));
+  Serial.print(subActive ? F("true") : F("false"));
+  for (uint8_t i = 0; i < TF_COUNT; i++) {
+    if (subActive && subPeriod[i] != 0) {
+      Serial.print(F(",\""));
+      printName(fieldNames, i);
+      Serial.print(F("\":"));
+      Serial.print(subPeriod[i] * SUB_TICK);
+    }
+  }
+  Serial.println('}');
+}
+
+/**
+ * The function `sendTelemetry` sends a status frame right away: every subscribed field, or the
+ * legacy LED frame when there are no subscriptions.
+ */
+void sendTelemetry() {
+  if (!subActive) {
+    sendLedData();
+    lastSerialUpdateTime = millis();
+    return;
+  }
+  uint32_t mask = 0;
+  for (uint8_t i = 0; i < TF_COUNT; i++) {
+    if (subPeriod[i] != 0) {
+      mask |= 1UL << i;
+    }
+  }
+  sendFields(mask);
+}
+
+
+
+// waveform stream
+
+/**
+ * The function `streamCommand` handles `stream gen`, `stream grid` and `stream off`.
+ */
+CommandResult streamCommand(String args) {
+  args.trim();
+  if (wordIs(args, PSTR("gen"))) {
+    waveStart(WAVE_GEN);
+    waveStreaming = true;
+  } else if (wordIs(args, PSTR("grid"))) {
+    waveStart(WAVE_GRID);
+    waveStreaming = true;
+  } else if (wordIs(args, PSTR("off"))) {
+    gridSenseStart();
+  } else {
+    return RESULT_ERROR;
+  }
+  return RESULT_OK;
+}
+
+/**
+ * The function `waveStart` resets the sampler and the block encoder and starts the ADC in
+ * free-running mode on the sense input of the given channel.
+ *
+ * @param channel `WAVE_GEN` or `WAVE_GRID`.
+ */
+void waveStart(uint8_t channel) {
+  waveStop();
+  waveMid = 512;
+  waveMid16 = 512 << 4;
+  waveArmed = false;
+  waveOffset = 0xFF;
+  waveSumSquares = 0;
+  waveSum = 0;
+  waveSamples = 0;
+  waveHead = 0;
+  waveTail = 0;
+  waveLength = 0;
+  waveCount = 0;
+  waveDecimation = 1;
+  waveSkip = 0;
+  waveRoomy = 0;
+  wavePending = false;
+  waveOverrun = false;
+  waveCrossPeriod = 0;
+  waveChannel = channel;
+
+#if defined(__AVR__)
+  uint8_t pin = channel == WAVE_GEN ? generator_sense : channel == WAVE_GRID ? grid_sense : waveUnitPin;
+  waveAdcChannel = pin - A0;
+  adcSelect(waveAdcChannel);  // also selects free running
+  ADCSRA = (1 << ADEN) | (1 << ADSC) | (1 << ADATE) | (1 << ADIE) | 0x07;  // clock / 128
+#endif
+}
+
+/**
+ * The function `waveStop` stops the stream and hands the ADC back to `analogRead`.
+ */
+void waveStop() {
+#if defined(__AVR__)
+  ADCSRA = (1 << ADEN) | 0x07;
+#endif
+  waveChannel = WAVE_OFF;
+}
+
+/**
+ * The function `waveBorrow` gets the sampler onto a channel for a background job. It is moved
+ * there unless a stream or another job holds it on the other channel.
+ *
+ * @param user The job's WAVE_USER_ bit, to hand it back with `waveReturn`.
+ * @param channel `WAVE_GEN` or `WAVE_GRID`.
+ * @return `true` when the sampler is on the channel.
+ */
+boolean waveBorrow(uint8_t user, uint8_t channel) {
+  if (waveChannel != channel) {
+    if (waveStreaming || (waveUsers & ~user) != 0) {
+      return false;
+    }
+    waveStart(channel);
+    waveUsers |= user;
+  } else if (waveUsers != 0) {
+    waveUsers |= user;  // moved by another job: keep it there until both are done
+  }
+  return true;
+}
+
+/**
+ * The function `waveReturn` ends a background job's hold on the sampler. The last job out hands
+ * it back to the grid bands, unless a stream has taken it since.
+ */
+void waveReturn(uint8_t user) {
+  if (!(waveUsers & user)) {
+    return;
+  }
+  waveUsers &= ~user;
+  if (waveUsers == 0 && !waveStreaming) {
+    gridSenseStart();
+  }
+}
+
+#if defined(__AVR__)
+/**
+ * The function `adcSelect` points the ADC at an analog input, with the AVcc reference. The input
+ * changes with the next conversion that starts, which in free-running mode is the one after the
+ * conversion already under way.
+ */
+void adcSelect(uint8_t channel) {
+  ADMUX = (1 << REFS0) | (channel & 0x07);
+#if defined(MUX5)
+  ADCSRB = channel & 0x08 ? (1 << MUX5) : 0;
+#else
+  ADCSRB = 0;
+#endif
+}
+
+ISR(ADC_vect) {
+  int16_t raw = ADC;
+  if (adcSideStep == 2) {
+    // this conversion was the side input: hand it over and repeat the last sample in its place
+    adcSideValue = raw;
+    adcSideChannel = ADC_NO_SIDE;
+    adcSideStep = 0;
+    waveSample(adcLastRaw);
+    return;
+  }
+  waveSample(raw);
+  adcLastRaw = raw;
+  if (adcSideStep == 1) {
+    adcSelect(waveAdcChannel);  // the side conversion has started, switch back behind it
+    adcSideStep = 2;
+  } else if (adcSideChannel != ADC_NO_SIDE) {
+    adcSelect(adcSideChannel);
+    adcSideStep = 1;
+  }
+}
+#endif
+
+/**
+ * The function `waveSample` takes one ADC sample, called from the ADC interrupt. A cycle ends on a
+ * rising crossing of the midpoint after the signal has been at least WAVE_HYSTERESIS below it. The
+ * crossing is interpolated between the two samples around it to 1/16 of a sample, and the midpoint
+ * follows the signal's average so the bias of the sense circuit needn't be exact. The last
+ * crossing's time is kept for `zcCrossing`.
+ *
+ * @param raw The 10-bit conversion result.
+ */
+void waveSample(int16_t raw) {
+  int16_t x = raw - waveMid;
+  int16_t prev = wavePrev;
+  boolean crossed = waveArmed && prev < 0 && x >= 0;
+  wavePrev = x;
+  if (x < -WAVE_HYSTERESIS) {
+    waveArmed = true;
+  }
+
+  if (crossed || waveSamples >= WAVE_MAX_SAMPLES) {
+    uint8_t offset = 0;  // the crossing lies this many 1/16 samples before this sample
+    uint16_t period = 0;
+    if (crossed) {
+      offset = ((int32_t)x << 4) / (x - prev);
+      waveArmed = false;
+      if (waveOffset != 0xFF) {
+        period = (waveSamples << 4) + waveOffset - offset;
+      }
+      waveCrossAt = micros();
+      waveCrossOffset = offset;
+      waveCrossPeriod = period;
+    }
+    uint8_t next = (waveHead + 1) % WAVE_RING_SIZE;
+    if (period == 0 && crossed) {
+      // the first crossing only starts a cycle
+    } else if (next == waveTail) {
+      waveOverrun = true;
+    } else {
+      waveRing[waveHead].sumSquares = waveSumSquares;
+      waveRing[waveHead].samples = waveSamples;
+      waveRing[waveHead].period = period;
+      waveHead = next;
+    }
+    if (period != 0 || !crossed) {
+      // not from the part cycle before the first crossing, whose average is off
+      waveMid16 += ((waveSum << 4) / waveSamples - waveMid16) / 8;
+      waveMid = waveMid16 >> 4;
+    }
+    waveOffset = crossed ? offset : 0xFF;
+    waveSumSquares = 0;
+    waveSum = 0;
+    waveSamples = 0;
+  }
+
+  waveSumSquares += (int32_t)x * x;
+  waveSum += raw;
+  waveSamples++;
+}
+
+/**
+ * The function `waveService` turns the cycles measured by the interrupt into RMS and frequency
+ * values, keeps every `waveDecimation`-th one and adds it to the current block.
+ */
+void waveService() {
+  if (wavePending && waveSendBlock()) {
+    wavePending = false;
+  }
+  while (!wavePending && waveTail != waveHead) {
+    volatile WaveCycle &cycle = waveRing[waveTail];
+    uint32_t meanSquare = cycle.sumSquares / cycle.samples;
+    uint16_t period = cycle.period;
+    waveTail = (waveTail + 1) % WAVE_RING_SIZE;
+
+    uint16_t rms = isqrt32(meanSquare << 8);  // in 1/16 counts
+    uint32_t chz = period != 0 ? WAVE_CHZ_SCALE / period : 0;
+    if (chz > 0xFFFF) {
+      chz = 0xFFFF;
+    }
+    if (waveChannel == WAVE_GRID) {
+      gridBandUpdate(rms, chz);
+    } else if (waveChannel == WAVE_GEN) {
+      softCycle(rms);
+    } else {
+      crankCycle(chz);
+    }
+    if (!waveStreaming || ++waveSkip < waveDecimation) {
+      continue;
+    }
+    waveSkip = 0;
+    if (waveCount == 0) {
+      waveBaseRms = rms;
+      waveBaseChz = chz;
+    } else {
+      waveVarint((int32_t)rms - waveLastRms);
+      waveVarint((int32_t)chz - waveLastChz);
+    }
+    waveLastRms = rms;
+    waveLastChz = chz;
+    if (++waveCount == WAVE_BLOCK_CYCLES) {
+      wavePending = !waveSendBlock();
+    }
+  }
+}
+
+/**
+ * The function `waveVarint` appends a signed delta to the block as a zigzag varint: 7 bits per
+ * byte, low bits first, high bit set on all but the last byte.
+ */
+void waveVarint(int32_t delta) {
+  uint32_t zigzag = ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31);
+  while (zigzag >= 0x80) {
+    waveBlock[waveLength++] = zigzag | 0x80;
+    zigzag >>= 7;
+  }
+  waveBlock[waveLength++] = zigzag;
+}
+
+/**
+ * The function `waveSendBlock` sends the finished block as
+ * A5 5A 'W' channel seq decimation count rms(u16) chz(u16) len data[len] crc16, where rms (1/16 ADC
+ * counts) and chz (centi-Hz) are the block's first cycle and data holds the zigzag varint deltas
+ * (rms, then chz) of the others. The CRC covers everything from 'W' up to the last data byte.
+ *
+ * If the interrupt had to drop cycles since the last block, the decimation doubles; it halves again
+ * after WAVE_RECOVER_BLOCKS blocks went out with room to spare.
+ *
+ * @return false when the UART buffer can't take the whole block yet.
+ */
+boolean waveSendBlock() {
+  int size = waveLength + WAVE_FRAME_OVERHEAD;
+  if (Serial.availableForWrite() < size) {
+    return false;
+  }
+
+  uint16_t crc = 0xFFFF;
+  Serial.write(FRAME_SYNC1);
+  Serial.write(FRAME_SYNC2);
+  writeFrameByte('W', crc);
+  writeFrameByte(waveChannel, crc);
+  writeFrameByte(waveSeq, crc);
+  writeFrameByte(waveDecimation, crc);
+  writeFrameByte(waveCount, crc);
+  writeFrameByte(waveBaseRms & 0xFF, crc);
+  writeFrameByte(waveBaseRms >> 8, crc);
+  writeFrameByte(waveBaseChz & 0xFF, crc);
+  writeFrameByte(waveBaseChz >> 8, crc);
+  writeFrameByte(waveLength, crc);
+  for (uint8_t i = 0; i < waveLength; i++) {
+    writeFrameByte(waveBlock[i], crc);
+  }
+  Serial.write((uint8_t)(crc & 0xFF));
+  Serial.write((uint8_t)(crc >> 8));
+
+  if (waveOverrun) {
+    waveOverrun = false;
+    if (waveDecimation < WAVE_MAX_DECIMATION) {
+      waveDecimation *= 2;
+    }
+    waveRoomy = 0;
+  } else if (Serial.availableForWrite() < size) {
+    waveRoomy = 0;
+  } else if (waveDecimation > 1 && ++waveRoomy >= WAVE_RECOVER_BLOCKS) {
+    waveDecimation /= 2;
+    waveRoomy = 0;
+  }
+  waveSeq++;
+  waveCount = 0;
+  waveLength = 0;
+  return true;
+}
+
+/**
+ * The function `isqrt32` returns the integer square root of a 32-bit value, bit by bit.
+ */
+uint16_t isqrt32(uint32_t value) {
+  uint32_t root = 0;
+  uint32_t bit = 1UL << 30;
+  while (bit > value) {
+    bit >>= 2;
+  }
+  while (bit != 0) {
+    if (value >= root + bit) {
+      value -= root + bit;
+      root = (root >> 1) + bit;
+    } else {
+      root >>= 1;
+    }
+    bit >>= 2;
+  }
+  return root;
+}
+
+
+
+// wall clock
+
+/**
+ * The function `uptimeSeconds` returns the seconds since boot. It folds the time since its last call
+ * into the uptime, so it keeps counting across millis() overflows as long as it runs at least once
+ * every 49 days; `loop` calls it on every pass.
+ */
+uint32_t uptimeSeconds() {
+  unsigned long now = millis();
+  unsigned long elapsed = now - uptimeLast;
+  uptimeLast = now;
+  uptimeSecs += elapsed / 1000;
+  uptimeMillis += elapsed % 1000;
+  if (uptimeMillis >= 1000) {
+    uptimeMillis -= 1000;
+    uptimeSecs++;
+  }
+  return uptimeSecs;
+}
+
+/**
+ * The function `clockNow` returns the unix time in seconds, or 0 while the clock is unset.
+ */
+uint32_t clockNow() {
+  return clockSet ? clockOffset + uptimeSeconds() : 0;
+}
+
+/**
+ * The function `timeCommand` handles `time` (report the clock) and `time <unix seconds>` (set it).
+ * Setting the clock records a `JE_CLOCK` anchor in the journal, unless it only corrects the clock
+ * by a few seconds.
+ *
+ * @param args Everything after `time`.
+ * @return `RESULT_ERROR` for a time that isn't a plain number or a plausible unix time.
+ */
+CommandResult timeCommand(String args) {
+  args.trim();
+  if (args.length() == 0) {
+    sendTime();
+    return RESULT_OK;
+  }
+  const char *digits = args.c_str();
+  char *end;
+  uint32_t time = strtoul(digits, &end, 10);
+  // a plain decimal number, and not before 2001
+  if (*digits < '0' || *digits > '9' || *end != '\0' || time < 1000000000UL) {
+    return RESULT_ERROR;
+  }
+  int32_t drift = time - clockNow();
+  boolean anchor = !clockSet || drift > CLOCK_TOLERANCE || drift < -CLOCK_TOLERANCE;
+  clockOffset = time - uptimeSeconds();
+  clockSet = true;
+  if (anchor) {
+    journalAppend(JE_CLOCK, 0);
+  }
+  return RESULT_OK;
+}
+
+/**
+ * The function `sendTime` reports the wall clock and the uptime in seconds.
+ */
+void sendTime() {
+  Serial.print(F("{\"time\":"));
+  Serial.print(clockNow());
+  Serial.print(F(",\"uptime_s\":"));
+  Serial.print(uptimeSeconds());
+  Serial.println('}');
+}
+
+
+
+// automatic transfer
+
+/**
+ * The function `transferService` advances the automatic transfer by one step. It is called on every
+ * pass in automatic mode and only compares timers, so faults and commands are handled as quickly
+ * during warm-up and cool-down as at any other time.
+ */
+void transferService() {
+  unsigned long now = millis();
+  unsigned long inState = now - transferSince;
+  unsigned long settle = config[CFG_POWER_CHECK_DELAY];
+  unsigned long window = config[CFG_RETRANSFER_TIME] * 1000UL;
+  if (window < settle) {
+    window = settle;
+  }
+  boolean genUp = genSensed();
+  boolean gridUp = gridGood();
+  boolean onGen = transferState == TS_WARM_UP || transferState == TS_GEN;
+  if (gridUp != transferGridUp) {
+    if (!gridUp && onGen && now - transferGridSince >= settle) {
+      counters.retransferAborts++;  // would have been a transfer without the window
+      countersDirty = true;
+    }
+    transferGridUp = gridUp;
+    transferGridSince = now;
+  }
+  boolean gridSteady = now - transferGridSince >= settle;
+  boolean gridLost = !gridUp && gridSteady;
+  boolean gridBack = gridUp && gridSteady;
+  boolean gridStable = gridUp && now - transferGridSince >= window;  // safe to take the load off a running generator
+
+  if (genCooling && now - genCoolSince >= config[CFG_COOL_DOWN_TIME] * 1000UL) {
+    genCooling = false;
+    genRun(false);
+  }
+
+  // pre-start: run the generator unloaded while the grid still carries the load and an outage
+  // looks likely, so the next one only costs the relay transfer
+  if (transferState == TS_GRID && gen_run_pin != NO_PIN && config[CFG_PRESTART_LEVEL] != 0) {
+    uint8_t risk = riskLevel();
+    if (!genPrestart && risk >= config[CFG_PRESTART_LEVEL]) {
+      genPrestart = true;
+      genPrestartSince = now;
+      if (!genCooling && !genUp) {
+        counters.genStarts++;
+        countersDirty = true;
+      }
+      genCooling = false;
+      genRun(true);
+    } else if (genPrestart && risk + PRESTART_HYSTERESIS < config[CFG_PRESTART_LEVEL]) {
+      genPrestart = false;
+      genCooling = true;  // it has been running: cool down, then stop
+      genCoolSince = now;
+    }
+  }
+  if (genPrestart && genUp && !gridUp && now - transferGridSince >= PRESTART_SETTLE) {
+    gridLost = true;
+  }
+
+  switch (transferState) {
+    case TS_ENTRY: {
+      uint8_t relays = outputLatch & RELAY_MASK;
+      load_fail = false;
+      ledControl(load_fail_led, true);
+      if ((relays & 0x02) && genUp) {
+        genRun(true);
+        transferEnter((relays & 0x04) ? TS_GEN : TS_WARM_UP);  // keep a running generator
+      } else if (relays == 0x05 && gridUp) {
+        transferState = TS_GRID;
+        transferSince = now;
+      } else if (gridUp) {
+        transferEnter(TS_GRID_CONNECT);
+      } else if (transferApproved(PROPOSE_GEN)) {
+        transferEnter(TS_GEN_START);
+      }
+      break;
+    }
+
+    case TS_GRID_CONNECT:
+      if (inState >= settle) {
+        transferEnter(gridUp ? TS_GRID : TS_GEN_START);
+      }
+      break;
+
+    case TS_GRID:
+      if (gridLost) {
+        if (!transferApproved(PROPOSE_GEN)) {
+          // the load stays on the dead grid until the operator agrees
+        } else if (genPrestart && genUp && now - genPrestartSince >= config[CFG_WARM_UP_TIME] * 1000UL) {
+          transferEnter(TS_GEN);  // warm generator standing by: only the source relays move
+        } else {
+          transferEnter(TS_GEN_START);
+        }
+      } else if (gridUp && inState >= config[CFG_LOAD_CHECK_DELAY] && plausHolds(PL_LOAD_LOST)) {
+        // a sag takes load_check down with it; only a live grid says anything about the load
+        transferEnter(TS_LOAD_FAILED);
+      }
+      break;
+
+    case TS_GEN_START:
+      if (genUp) {
+        gen_fail = false;
+        ledControl(gen_fail_led, true);
+        transferEnter(genWarm ? TS_GEN : TS_WARM_UP);
+      } else if (gridBack) {
+        transferEnter(TS_GRID_CONNECT);
+      } else if (inState >= settle && !genStarting()) {
+        counters.genStartFailures++;
+        countersDirty = true;
+        transferEnter(TS_GEN_FAILED);
+      }
+      break;
+
+    case TS_WARM_UP:
+      if (!genUp) {
+        transferEnter(TS_GEN_FAILED);
+      } else if (gridStable) {
+        transferEnter(TS_GRID_CONNECT);
+      } else if (inState >= config[CFG_WARM_UP_TIME] * 1000UL) {
+        transferEnter(TS_GEN);
+      }
+      break;
+
+    case TS_GEN:
+      if (!genUp) {
+        transferEnter(TS_GEN_FAILED);
+      } else if (gridStable && transferApproved(PROPOSE_GRID)) {
+        if (gen_run_pin != NO_PIN) {
+          genCooling = true;  // keep it running unloaded for the cool-down
+          genCoolSince = now;
+        }
+        transferEnter(TS_GRID);  // the grid has proven itself: the load stays on across the transfer
+      } else if (inState >= config[CFG_LOAD_CHECK_DELAY] && !softSettling() && plausHolds(PL_LOAD_LOST)) {
+        transferEnter(TS_LOAD_FAILED);
+      }
+      break;
+
+    case TS_GEN_FAILED:
+      if (gridBack) {
+        transferEnter(TS_GRID_CONNECT);
+      } else if (inState >= GEN_RETRY_DELAY) {
+        transferEnter(TS_GEN_START);
+      }
+      break;
+
+    case TS_LOAD_FAILED:
+      break;
+  }
+}
+
+/**
+ * The function `transferEnter` switches the transfer to a new state and sets the outputs for it.
+ * Sources are always switched with the load relay open, and the two source relays are never closed
+ * together.
+ *
+ * @param state The `TransferState` to enter.
+ */
+void transferEnter(TransferState state) {
+  transferState = state;
+  transferSince = millis();
+
+  switch (state) {
+    case TS_GRID_CONNECT:
+      writeOutput(load_relay, LOW);
+      writeOutput(generator_relay, LOW);
+      genWarmCredit = 0;
+      if (genPrestart) {
+        genPrestart = false;  // it has been running: cool down, then stop
+        genCooling = true;
+        genCoolSince = transferSince;
+      }
+      if (!genCooling) {
+        genRun(false);
+      }
+      relayClose(RELAY_GRID);
+      break;
+
+    case TS_GRID:
+      if (!genCooling) {
+        genRun(false);
+      }
+      relayClose(RELAY_GRID);  // already closed, unless straight from the generator
+      writeOutput(load_relay, HIGH);
+      break;
+
+    case TS_GEN_START: {
+      writeOutput(load_relay, LOW);
+      writeOutput(grid_relay, LOW);
+      unsigned long warmFor = genPrestart ? millis() - genPrestartSince : 0;
+      // still running from the last outage or pre-started long enough: no need to start or warm it
+      genWarm = genCooling || warmFor >= config[CFG_WARM_UP_TIME] * 1000UL;
+      genWarmCredit = genWarm ? 0 : warmFor;
+      boolean running = genCooling || genPrestart;
+      genCooling = false;
+      genPrestart = false;
+      if (!running && digitalRead(generator_check) == LOW) {
+        counters.genStarts++;
+        countersDirty = true;
+      }
+      genRun(true);
+      break;
+    }
+
+    case TS_WARM_UP:
+      transferSince -= genWarmCredit;  // pre-start time already spent warming up
+      genWarmCredit = 0;
+      break;
+
+    case TS_GEN:
+      genPrestart = false;
+      relayClose(RELAY_GEN);
+      writeOutput(load_relay, HIGH);
+      break;
+
+    case TS_GEN_FAILED:
+      writeOutput(load_relay, LOW);
+      writeOutput(generator_relay, LOW);
+      genWarmCredit = 0;
+      genCooling = false;
+      genRun(false);
+      if (!gen_fail) {
+        journalAppend(JE_GEN_FAIL, 0);
+      }
+      gen_fail = true;
+      faultCount(FC_SOURCE);
+      ledControl(gen_fail_led, false);
+      turnOnAlarm();
+      break;
+
+    case TS_LOAD_FAILED:
+      loadFailAction();
+      break;
+
+    default:
+      break;
+  }
+}
+
+/**
+ * The function `genRun` starts or stops the generator side: through the units' run outputs where
+ * there are any, otherwise through `generator_relay`, which then also connects the single unit.
+ */
+void genRun(boolean on) {
+  genDemand = on;
+  if (gen_run_pin != NO_PIN) {
+    genService();  // start or stop the lead unit right away
+  } else if (on) {
+    relayClose(RELAY_GEN);
+  } else {
+    writeOutput(generator_relay, LOW);
+  }
+}
+
+/**
+ * The function `gridGood` tells whether the grid may carry the load: grid_check is HIGH and, while
+ * the grid bands are in use, the last mains cycle on grid_sense kept the grid in band. The bands
+ * are skipped while the generator is being streamed, since the ADC is busy with it. While a
+ * background job has the sampler, the last cycle checked stands. Once grid_check is suspect, the
+ * last band check decides alone where there are bands.
+ */
+boolean gridGood() {
+  if ((plausSuspect & 0x01) && config[CFG_GRID_V_SCALE] != 0) {
+    return gridInBand;
+  }
+  if (digitalRead(grid_check) == LOW) {
+    return false;
+  }
+  return config[CFG_GRID_V_SCALE] == 0 || (waveChannel != WAVE_GRID && waveUsers == 0) || gridInBand;
+}
+
+/**
+ * The function `gridBandUpdate` checks one mains cycle of the grid against the voltage and
+ * frequency bands.
+ *
+ * @param rms The cycle's RMS in 1/16 ADC counts.
+ * @param chz Its frequency in centi-Hz, 0 for a dead cycle.
+ */
+void gridBandUpdate(uint16_t rms, uint16_t chz) {
+  long volts = (uint32_t)rms * config[CFG_GRID_V_SCALE] / 1600;
+  long deciHz = chz / 10;
+  long vHyst = gridInBand ? 0 : config[CFG_GRID_V_HYST];
+  long fHyst = gridInBand ? 0 : config[CFG_GRID_F_HYST];
+  gridVolts = volts;
+  gridDeciHz = deciHz;
+  gridInBand = volts >= config[CFG_GRID_V_MIN] + vHyst && volts + vHyst <= config[CFG_GRID_V_MAX]
+    && deciHz >= config[CFG_GRID_F_MIN] + fHyst && deciHz + fHyst <= config[CFG_GRID_F_MAX];
+}
+
+/**
+ * The function `gridSenseStart` hands the ADC back to the grid bands when no stream is running:
+ * it samples grid_sense without sending anything if grid_v_scale is set, and stops otherwise.
+ */
+void gridSenseStart() {
+  waveStreaming = false;
+  if (config[CFG_GRID_V_SCALE] != 0) {
+    waveStart(WAVE_GRID);
+  } else {
+    waveStop();
+  }
+}
+
+
+
+// load shedding
+
+/**
+ * The function `loadService` runs the load circuits once every LOAD_TICK. It measures the
+ * generator load while the generator is connected, then either sheds one circuit, if the load is
+ * at `shed_pct` or above, or connects one, once the load has stayed below `restore_pct` for that
+ * circuit's reconnect delay. Nothing moves while the main circuit is off, and nothing connects while
+ * the soft start sequences the circuits.
+ */
+void loadService() {
+  unsigned long now = millis();
+  if (now - lastLoadTick < LOAD_TICK) {
+    return;
+  }
+  lastLoadTick = now;
+
+  if ((outputLatch & 0x02) && gen_load_sense != NO_PIN && config[CFG_GEN_LOAD_FULL] != 0) {
+    uint32_t level = (uint32_t)senseRead(gen_load_sense) * 100 / config[CFG_GEN_LOAD_FULL];
+    if (level > 999) {
+      level = 999;
+    }
+    genLoad = (genLoad * 3 + level) / 4;
+  } else {
+    genLoad = 0;
+  }
+  uint8_t units = unitsCarrying();  // the levels are per unit
+
+  boolean busOn = (outputLatch & 0x04) != 0;
+  if (busOn && !loadBusOn) {
+    loadCalmSince = now;  // the main circuit just came on, the others follow from here
+  }
+  loadBusOn = busOn;
+  if (!busOn || LOAD_COUNT < 2) {
+    return;
+  }
+
+  if (genLoad >= config[CFG_SHED_LEVEL] * units) {
+    int channel = loadPick(true);
+    if (channel > 0 && now - lastShedTime >= LOAD_SHED_SETTLE) {
+      loadSwitch(channel, false);
+      lastShedTime = now;
+      if (softState == SOFT_STEP) {
+        softFinish();  // the generator is full: the rest reconnect as the load allows
+      }
+    }
+    loadCalmSince = now;
+  } else if (genLoad >= config[CFG_RESTORE_LEVEL] * units || softSettling()) {
+    loadCalmSince = now;
+  } else {
+    int channel = loadPick(false);
+    if (channel > 0 && now - loadCalmSince >= loadChannels[channel].reconnect) {
+      loadSwitch(channel, true);
+      loadCalmSince = now;
+    }
+  }
+}
+
+/**
+ * The function `loadPick` finds the circuit to switch next, among all but the main one.
+ *
+ * @param on true for the connected circuit to shed first (highest priority number), false for the
+ * disconnected circuit to connect first (lowest priority number). Ties go to the later channel when
+ * shedding and the earlier one when connecting.
+ * @return The channel, or -1 if there is none.
+ */
+int loadPick(boolean on) {
+  int best = -1;
+  for (uint8_t i = 1; i < LOAD_COUNT; i++) {
+    if (((loadsOn >> i) & 1) != on) {
+      continue;
+    }
+    if (best < 0 || (on ? loadChannels[i].priority >= loadChannels[best].priority
+                        : loadChannels[i].priority < loadChannels[best].priority)) {
+      best = i;
+    }
+  }
+  return best;
+}
+
+/**
+ * The function `loadSwitch` switches one of the extra load circuits.
+ */
+void loadSwitch(uint8_t channel, boolean on) {
+  digitalWrite(loadChannels[channel].pin, on ? HIGH : LOW);
+  if (on) {
+    loadsOn |= 1 << channel;
+  } else {
+    loadsOn &= ~(1 << channel);
+  }
+}
+
+/**
+ * The function `loadsDrop` opens every extra circuit at once, called whenever the main circuit
+ * opens so that sources are never switched with a circuit still closed.
+ */
+void loadsDrop() {
+  for (uint8_t i = 1; i < LOAD_COUNT; i++) {
+    digitalWrite(loadChannels[i].pin, LOW);
+  }
+  loadsOn = 0;
+}
+
+/**
+ * The function `senseRead` reads an analog input. While the waveform sampler has the ADC, the
+ * interrupt slips the conversion in between two samples, which takes about 0.3 ms.
+ */
+uint16_t senseRead(int pin) {
+#if defined(__AVR__)
+  if (waveChannel != WAVE_OFF) {
+    adcSideChannel = pin - A0;
+    unsigned long start = micros();
+    while (adcSideChannel != ADC_NO_SIDE) {
+      if (micros() - start > 1000) {
+        adcSideChannel = ADC_NO_SIDE;  // sampler stopped in the meantime
+        return 0;
+      }
+    }
+    return adcSideValue;
+  }
+#endif
+  return analogRead(pin);
+}
+
+
+
+// outage risk
+
+/**
+ * The function `riskLoad` reads the outage histogram from EEPROM, or starts an empty one if its
+ * CRC doesn't check out.
+ */
+void riskLoad() {
+  uint16_t crc = 0xFFFF;
+  for (uint8_t i = 0; i < 24; i++) {
+    riskHours[i] = EEPROM.read(riskAddress + i);
+    crc = crc16Update(crc, riskHours[i]);
+  }
+  uint16_t storedCrc;
+  EEPROM.get(riskAddress + 24, storedCrc);
+  if (crc != storedCrc) {
+    memset(riskHours, 0, sizeof(riskHours));
+  }
+  riskGridUp = gridGood();
+  riskGridSince = millis();
+  lastRiskDecay = riskGridSince;
+  lastRiskDay = riskGridSince;
+  lastRiskSave = riskGridSince;
+}
+
+/**
+ * The function `riskSave` writes the histogram back; unchanged buckets are left alone.
+ */
+void riskSave() {
+  uint16_t crc = 0xFFFF;
+  for (uint8_t i = 0; i < 24; i++) {
+    EEPROM.update(riskAddress + i, riskHours[i]);
+    crc = crc16Update(crc, riskHours[i]);
+  }
+  EEPROM.put(riskAddress + 24, crc);
+  riskDirty = false;
+  lastRiskSave = millis();
+}
+
+/**
+ * The function `riskService` feeds the risk model in every mode. Each time the grid goes bad it
+ * raises the recent score, and once the grid has been bad for `power_check_delay` it counts an
+ * outage in the bucket of the current hour. It also runs both decays and saves the histogram at
+ * most once an hour.
+ */
+void riskService() {
+  unsigned long now = millis();
+  boolean up = gridGood();
+  if (up != riskGridUp) {
+    riskGridUp = up;
+    riskGridSince = now;
+    riskOutage = false;
+    if (!up) {
+      riskRecent = riskRecent + RISK_SAG_STEP > 100 ? 100 : riskRecent + RISK_SAG_STEP;
+    }
+  }
+  if (!up && !riskOutage && clockSet && now - riskGridSince >= config[CFG_POWER_CHECK_DELAY]) {
+    uint8_t &bucket = riskHours[clockNow() / 3600 % 24];
+    bucket = bucket + RISK_OUTAGE_STEP > 255 ? 255 : bucket + RISK_OUTAGE_STEP;
+    riskOutage = true;
+    riskDirty = true;
+  }
+
+  if (now - lastRiskDecay >= RISK_DECAY_INTERVAL) {
+    lastRiskDecay = now;
+    riskRecent -= (riskRecent + 7) / 8;
+  }
+  if (now - lastRiskDay >= RISK_DAY) {
+    lastRiskDay = now;
+    for (uint8_t i = 0; i < 24; i++) {
+      riskHours[i] -= (riskHours[i] + 7) / 8;
+    }
+    riskDirty = true;
+  }
+  if (riskDirty && now - lastRiskSave >= RISK_SAVE_INTERVAL) {
+    riskSave();
+  }
+}
+
+/**
+ * The function `riskLevel` estimates the chance of a grid loss in the near future, in percent: the
+ * recent score combined with the worse of the current and the next hour's bucket.
+ */
+uint8_t riskLevel() {
+  uint16_t hourly = 0;
+  if (clockSet) {
+    uint8_t hour = clockNow() / 3600 % 24;
+    uint8_t count = riskHours[hour] > riskHours[(hour + 1) % 24] ? riskHours[hour] : riskHours[(hour + 1) % 24];
+    hourly = count >= RISK_HOUR_FULL ? 100 : count * 100 / RISK_HOUR_FULL;
+  }
+  return hourly + riskRecent - hourly * riskRecent / 100;
+}
+
+
+
+// relay driver
+
+/**
+ * The function `relayInit` loads the measured relay timing, or the defaults if the EEPROM record
+ * doesn't check out, and sets Timer1 counting at F_CPU / 64 with no interrupt enabled yet.
+ */
+void relayInit() {
+  uint8_t timing[4];
+  uint16_t crc = 0xFFFF;
+  for (uint8_t i = 0; i < 4; i++) {
+    timing[i] = EEPROM.read(relayTimingAddress + i);
+    crc = crc16Update(crc, timing[i]);
+  }
+  uint16_t storedCrc;
+  EEPROM.get(relayTimingAddress + 4, storedCrc);
+  boolean valid = crc == storedCrc;
+  for (uint8_t r = 0; r < 2; r++) {
+    relayPickup[r] = valid ? timing[r * 2] : RELAY_DEFAULT_PICKUP;
+    relayDropout[r] = valid ? timing[r * 2 + 1] : RELAY_DEFAULT_DROPOUT;
+    relayOpenedAt[r] = micros() - RELAY_MAX_WAIT;  // restored relays have long settled
+  }
+
+#if defined(__AVR__)
+  TCCR1A = 0;
+  TCCR1B = (1 << CS11) | (1 << CS10);  // normal mode, clock / 64: 4 us per tick at 16 MHz
+  TIMSK1 = 0;
+  // load_check edges for the timing measurement; without a pin change interrupt the timing keeps
+  // its stored or default values, since polled edges would be a loop pass late
+  if (digitalPinToPCICR(load_check)) {
+    *digitalPinToPCMSK(load_check) |= 1 << digitalPinToPCMSKbit(load_check);
+    *digitalPinToPCICR(load_check) |= 1 << digitalPinToPCICRbit(load_check);
+    relayMeasuring = true;
+  }
+#else
+  relayMeasuring = true;  // polled by relayService
+#endif
+}
+
+/**
+ * The function `relayClose` closes a source relay, break-before-make. The other relay is opened
+ * first if it isn't already, and the close waits until that relay's contacts have had their
+ * dropout time plus `dead_time_ms` to part, less this relay's pickup time, and with zc_sync set
+ * further until the next zero crossing it can be timed to. Asking again for a close that is already
+ * done or waiting does nothing. Timer1 fires the close through the port registers; a pin past the
+ * core's digital pin table has none to look up and is fired from the loop.
+ *
+ * @param relay `RELAY_GRID` or `RELAY_GEN`.
+ */
+void relayClose(int8_t relay) {
+  const int pins[2] = { grid_relay, generator_relay };
+  int8_t other = 1 - relay;
+  relayService();  // account for a close Timer1 has just fired
+  if ((outputLatch & (1 << relay)) || relayPending == relay) {
+    return;
+  }
+  writeOutput(pins[other], LOW);
+
+  long wait = ((long)relayDropout[other] + config[CFG_DEAD_TIME] - relayPickup[relay]) * 1000L
+              - (long)(micros() - relayOpenedAt[other]);
+  if (wait > (long)RELAY_MAX_WAIT) {
+    wait = RELAY_MAX_WAIT;
+  }
+  if (measureFrom == other && (outputLatch & 0x04)) {
+    measureTo = relay;
+  }
+  boolean synced = config[CFG_ZC_SYNC] != 0 && zcStart(relay);
+  if (wait <= 0 && !synced) {
+    writeOutput(pins[relay], HIGH);
+    relayClosedAt = micros();
+    return;
+  }
+
+  relayPending = relay;
+  relayPendingAt = micros();
+  relayPendingWait = wait > 0 ? wait : 0;
+  relayFired = false;
+  relayArmed = false;
+  relayTimed = false;
+#if defined(__AVR__)
+  if (pins[relay] < NUM_DIGITAL_PINS) {
+    relayPort = portOutputRegister(digitalPinToPort(pins[relay]));
+    relayBit = digitalPinToBitMask(pins[relay]);
+    relayTimed = true;
+  }
+#endif
+  relayArm();
+}
+
+/**
+ * The function `relayArm` hands the pending close to Timer1 once it is due within
+ * RELAY_TIMER_SPAN, and with zc_sync on, once it has been timed to a zero crossing. Where Timer1
+ * can't drive the pin, it fires the close itself when it is due.
+ */
+void relayArm() {
+  if ((zcState == ZC_LOCKING && !zcSchedule()) || relayArmed || relayFired) {
+    return;
+  }
+  long remaining = relayPendingWait - (long)(micros() - relayPendingAt);
+  if (!relayTimed) {
+    if (remaining <= 0) {
+      relayClosedAt = micros();
+      relayFired = true;
+    }
+    return;
+  }
+#if defined(__AVR__)
+  if (remaining < (long)RELAY_TIMER_SPAN) {
+    uint16_t ticks = (remaining > 0 ? remaining / (64000000UL / F_CPU) : 0) + 2;
+    noInterrupts();
+    OCR1A = TCNT1 + ticks;
+    TIFR1 = 1 << OCF1A;
+    TIMSK1 |= 1 << OCIE1A;
+    interrupts();
+    relayArmed = true;
+  }
+#endif
+}
+
+#if defined(__AVR__)
+ISR(TIMER1_COMPA_vect) {
+  *relayPort |= relayBit;
+  TIMSK1 &= ~(1 << OCIE1A);
+  relayClosedAt = micros();
+  relayFired = true;
+}
+
+ISR(LOAD_CHECK_PCINT_vect) {
+  boolean live = digitalRead(load_check) == HIGH;
+  if (!live && !(measureEdges & 0x01)) {
+    measureFellAt = micros();
+    measureEdges |= 0x01;
+  } else if (live && (measureEdges & 0x01) && !(measureEdges & 0x02)) {
+    measureRoseAt = micros();
+    measureEdges |= 0x02;
+  }
+}
+#endif
+
+/**
+ * The function `relayOpened` is called by `writeOutput` whenever a source relay pin is written
+ * LOW. It drops a close of that relay that is still waiting and, if the relay was closed, notes
+ * when it opened; with the load live on it, that starts a timing measurement.
+ */
+void relayOpened(int8_t relay) {
+  if (relayPending == relay) {
+#if defined(__AVR__)
+    TIMSK1 &= ~(1 << OCIE1A);
+#endif
+    relayPending = RELAY_NONE;
+    relayFired = false;
+    relayArmed = false;
+    zcEnd();
+  }
+  if (!(outputLatch & (1 << relay))) {
+    return;
+  }
+  relayOpenedAt[relay] = micros();
+  if (relayMeasuring && (outputLatch & 0x04) && digitalRead(load_check) == HIGH) {
+    measureFrom = relay;
+    measureTo = RELAY_NONE;
+    measureEdges = 0;
+  }
+}
+
+/**
+ * The function `relayService` moves a waiting close on through `relayArm`, books one that has fired
+ * into `outputLatch`, checks the crossing it was timed to, and finishes a measurement once
+ * load_check had RELAY_MEASURE_TIME to come back after the close.
+ */
+void relayService() {
+  const int pins[2] = { grid_relay, generator_relay };
+  if (relayPending != RELAY_NONE) {
+    relayArm();
+    if (relayFired) {
+      int pin = pins[relayPending];
+      relayPending = RELAY_NONE;
+      relayFired = false;
+      relayArmed = false;
+      writeOutput(pin, HIGH);
+      if (zcState == ZC_TIMED) {
+        zcState = ZC_CHECKING;
+      }
+    }
+  }
+  if (zcState == ZC_CHECKING) {
+    zcCheck();
+  }
+
+#if !defined(__AVR__)
+  if (measureFrom != RELAY_NONE) {
+    boolean live = digitalRead(load_check) == HIGH;  // polled where there is no pin change interrupt
+    if (!live && !(measureEdges & 0x01)) {
+      measureFellAt = micros();
+      measureEdges |= 0x01;
+    } else if (live && (measureEdges & 0x01) && !(measureEdges & 0x02)) {
+      measureRoseAt = micros();
+      measureEdges |= 0x02;
+    }
+  }
+#endif
+  if (measureFrom != RELAY_NONE && measureTo != RELAY_NONE && relayPending == RELAY_NONE
+      && micros() - relayClosedAt >= RELAY_MEASURE_TIME) {
+    relayMeasured();
+  }
+}
+
+/**
+ * The function `relayMeasured` folds a finished measurement into the relay timing. A longer
+ * dropout or a shorter pickup than expected is taken at once, since it shortens the real dead
+ * time; the other way the estimate only moves a quarter of the difference. Readings beyond
+ * 255 ms are discarded as not belonging to the transfer. A transfer without any gap can't be told
+ * from overlapping contacts, so it lengthens the old relay's dropout by RELAY_DROPOUT_STEP.
+ */
+void relayMeasured() {
+  noInterrupts();
+  uint8_t edges = measureEdges;
+  unsigned long fell = measureFellAt;
+  unsigned long rose = measureRoseAt;
+  interrupts();
+  int8_t from = measureFrom;
+  int8_t to = measureTo;
+  measureFrom = RELAY_NONE;
+  measureTo = RELAY_NONE;
+  if (!(edges & 0x01)) {
+    // the load never went dark: the contacts may have overlapped, so allow the old relay longer
+    relayDropout[from] = relayDropout[from] > 255 - RELAY_DROPOUT_STEP ? 255 : relayDropout[from] + RELAY_DROPOUT_STEP;
+    relayLastGap = 0;
+    relaySaveTiming();
+    return;
+  }
+
+  boolean changed = false;
+  unsigned long dropout = (fell - relayOpenedAt[from]) / 1000;
+  if (dropout <= 255) {
+    uint8_t estimate = dropout > relayDropout[from] ? dropout : (relayDropout[from] * 3 + dropout) / 4;
+    changed |= estimate != relayDropout[from];
+    relayDropout[from] = estimate;
+  }
+  if (edges & 0x02) {
+    unsigned long pickup = (rose - relayClosedAt) / 1000;
+    if ((long)(rose - relayClosedAt) >= 0 && pickup <= 255) {
+      uint8_t estimate = pickup < relayPickup[to] ? pickup : (relayPickup[to] * 3 + pickup) / 4;
+      changed |= estimate != relayPickup[to];
+      relayPickup[to] = estimate;
+    }
+    relayLastGap = (rose - fell) / 1000;
+  }
+  if (changed) {
+    relaySaveTiming();
+  }
+}
+
+/**
+ * The function `relaySaveTiming` writes the relay timing back to EEPROM.
+ */
+void relaySaveTiming() {
+  uint16_t crc = 0xFFFF;
+  for (uint8_t r = 0; r < 2; r++) {
+    EEPROM.update(relayTimingAddress + r * 2, relayPickup[r]);
+    EEPROM.update(relayTimingAddress + r * 2 + 1, relayDropout[r]);
+    crc = crc16Update(crc16Update(crc, relayPickup[r]), relayDropout[r]);
+  }
+  EEPROM.put(relayTimingAddress + 4, crc);
+}
+
+/**
+ * The function `timingCommand` handles `timing`, which reports the relay timing, and
+ * `timing <grid|gen> <pickup_ms> <dropout_ms>`, which seeds it for a relay, e.g. from its data
+ * sheet before the first measured transfer.
+ */
+CommandResult timingCommand(String args) {
+  args.trim();
+  if (args.length() == 0) {
+    sendTiming();
+    return RESULT_OK;
+  }
+  int first = args.indexOf(' ');
+  int second = first > 0 ? args.indexOf(' ', first + 1) : -1;
+  if (second < 0) {
+    return RESULT_ERROR;
+  }
+  String name = args.substring(0, first);
+  long pickup = args.substring(first + 1, second).toInt();
+  long dropout = args.substring(second + 1).toInt();
+  int8_t relay = wordIs(name, PSTR("grid")) ? RELAY_GRID : wordIs(name, PSTR("gen")) ? RELAY_GEN : RELAY_NONE;
+  if (relay == RELAY_NONE || pickup < 0 || pickup > 255 || dropout < 0 || dropout > 255) {
+    return RESULT_ERROR;
+  }
+  relayPickup[relay] = pickup;
+  relayDropout[relay] = dropout;
+  relaySaveTiming();
+  sendTiming();
+  return RESULT_OK;
+}
+
+/**
+ * The function `sendTiming` reports the relay timing in ms, the time the load was dark in the last
+ * measured transfer, and how well closes have met their zero crossings, in 0.1 degree.
+ */
+void sendTiming() {
+  JsonDocument jsonDoc;
+  jsonDoc[F("dead_time_ms")] = config[CFG_DEAD_TIME];
+  jsonDoc[F("grid_pickup_ms")] = relayPickup[RELAY_GRID];
+  jsonDoc[F("grid_dropout_ms")] = relayDropout[RELAY_GRID];
+  jsonDoc[F("gen_pickup_ms")] = relayPickup[RELAY_GEN];
+  jsonDoc[F("gen_dropout_ms")] = relayDropout[RELAY_GEN];
+  jsonDoc[F("gap_ms")] = relayLastGap;
+  jsonDoc[F("measure")] = relayMeasuring;
+  jsonDoc[F("zc_closes")] = zcCloses;
+  jsonDoc[F("zc_missed")] = zcMissed;
+  jsonDoc[F("zc_err_last")] = zcLastError;
+  jsonDoc[F("zc_err_avg")] = zcCloses != 0 ? zcErrorSum / zcCloses : 0;
+  jsonDoc[F("zc_err_max")] = zcErrorMax;
+  jsonDoc[F("zc_jitter_us")] = zcJitterMax;
+  serializeJson(jsonDoc, Serial);
+  Serial.println();
+}
+
+
+// semi-automatic confirmation
+
+/**
+ * The function `transferApproved` is asked by the transfer state machine before it moves the load
+ * to the other source, on every pass for as long as the move is due. Outside SEMI_AUTO the answer
+ * is always yes; in it the first ask raises a proposal and the move goes ahead once the proposal is
+ * confirmed, or times out with confirm_apply set.
+ *
+ * @param action The move that is due.
+ * @return `true` when the transfer may go ahead now.
+ */
+boolean transferApproved(Proposal action) {
+  if (currentMode != SEMI_AUTO) {
+    return true;
+  }
+  proposalAsked = action;
+  if (action == proposalDenied) {
+    return false;
+  }
+  if (proposal != action) {
+    proposalRaise(action);
+    return false;
+  }
+  if (proposalApproved) {
+    proposalEnd(PR_CONFIRMED);
+    return true;
+  }
+  unsigned long timeout = config[CFG_CONFIRM_TIME] * 1000UL;
+  if (timeout != 0 && millis() - proposalSince >= timeout) {
+    if (config[CFG_CONFIRM_APPLY] != 0) {
+      proposalEnd(PR_APPLIED);
+      return true;
+    }
+    proposalDenied = action;
+    proposalEnd(PR_ABORTED);
+  }
+  return false;
+}
+
+/**
+ * The function `proposalRaise` makes `action` the pending proposal and announces it, e.g.
+ * `{"proposal":"gen","timeout_s":60,"on_timeout":"apply"}`.
+ */
+void proposalRaise(Proposal action) {
+  proposal = action;
+  proposalSince = millis();
+  proposalApproved = false;
+  Serial.print(F("{\"proposal\":\""));
+  printName(proposalNames, action);
+  Serial.print(F("\",\"timeout_s\":"));
+  Serial.print(config[CFG_CONFIRM_TIME]);
+  Serial.print(F(",\"on_timeout\":\""));
+  Serial.print(config[CFG_CONFIRM_APPLY] != 0 ? F("apply") : F("abort"));
+  Serial.println(F("\"}"));
+}
+
+/**
+ * The function `proposalEnd` closes the pending proposal, reports how it ended, e.g.
+ * `{"proposal":"gen","result":"confirmed"}`, and journals every outcome but a withdrawal.
+ */
+void proposalEnd(ProposalResult result) {
+  Serial.print(F("{\"proposal\":\""));
+  printName(proposalNames, proposal);
+  Serial.print(F("\",\"result\":\""));
+  printName(proposalResults, result);
+  Serial.println(F("\"}"));
+  if (result != PR_WITHDRAWN) {
+    journalAppend(JE_PROPOSAL, proposal << 4 | result);
+  }
+  proposal = PROPOSE_NONE;
+  proposalApproved = false;
+  digitalWrite(semi_auto_led, currentMode == SEMI_AUTO ? LOW : HIGH);
+}
+
+/**
+ * The function `proposalAnswer` takes the operator's answer to the pending proposal. A confirmed
+ * transfer is carried out by the state machine on its next pass.
+ *
+ * @param yes `true` to confirm, `false` to deny.
+ * @return `RESULT_REJECTED` when there is nothing to answer.
+ */
+CommandResult proposalAnswer(boolean yes) {
+  if (proposal == PROPOSE_NONE) {
+    return RESULT_REJECTED;
+  }
+  if (yes) {
+    proposalApproved = true;
+  } else {
+    proposalDenied = proposal;
+    proposalEnd(PR_DENIED);
+  }
+  return RESULT_OK;
+}
+
+
+// generator units
+
+/**
+ * The function `genService` runs once per loop pass and whenever the demand changes. It follows
+ * each unit through start, bus connection and cool-down, works out from the measured load how many
+ * units are needed, and starts or releases one unit per pass to match. O(GEN_COUNT) per pass.
+ */
+void genService() {
+  if (gen_run_pin == NO_PIN) {
+    // generator_relay runs the single unit, see genRun
+    unitsOnline = (outputLatch & 0x02) && digitalRead(generator_check) == HIGH ? 1 : 0;
+    return;
+  }
+  unsigned long now = millis();
+  unsigned int elapsed = now - genLastPass;
+  genLastPass = now;
+  uint8_t active = 0;
+  unitsOnline = 0;
+  for (uint8_t i = 0; i < GEN_COUNT; i++) {
+    boolean ready = digitalRead(genUnits[i].ready) == HIGH;
+    switch (unitState[i]) {
+      case UNIT_CRANKING:
+        if (ready || (crankWatch == i && crankFast >= CRANK_FIRED_CYCLES)) {
+          writeOutput(genUnits[i].crank, LOW);  // fired: it comes up from here as a self-starting unit would
+          crankEnd(i);
+          unitState[i] = UNIT_STARTING;
+          unitSince[i] = now;
+        } else if (now - unitSince[i] >= config[CFG_CRANK_TIME] * 1000UL) {
+          writeOutput(genUnits[i].crank, LOW);
+          if (unitCranks[i] >= config[CFG_CRANK_TRIES]) {
+            unitsFailed |= 1 << i;
+            unitStop(i);
+          } else {
+            unitState[i] = UNIT_RESTING;
+            unitSince[i] = now;
+          }
+        }
+        break;
+      case UNIT_RESTING:
+        if (now - unitSince[i] >= config[CFG_CRANK_REST] * 1000UL) {
+          unitCrank(i);
+        }
+        break;
+      case UNIT_STARTING:
+        if (ready) {
+          writeOutput(genUnits[i].breaker, HIGH);
+          unitState[i] = UNIT_ONLINE;
+          unitSince[i] = now;
+          unitsFailed &= ~(1 << i);
+        } else if (now - unitSince[i] >= config[CFG_POWER_CHECK_DELAY]) {
+          unitsFailed |= 1 << i;  // didn't come up in the time the transfer logic allows the first one
+          unitStop(i);
+        }
+        break;
+      case UNIT_ONLINE:
+        if (!ready) {
+          unitsFailed |= 1 << i;  // dropped out: another one is started below if there is one
+          unitStop(i);
+        }
+        break;
+      case UNIT_COOLING:
+        if (!ready || now - unitSince[i] >= config[CFG_COOL_DOWN_TIME] * 1000UL) {
+          unitStop(i);
+        }
+        break;
+    }
+    if ((unitState[i] == UNIT_ONLINE || unitState[i] == UNIT_COOLING) && ready) {
+      unitRunMillis[i] += elapsed;
+      if (unitRunMillis[i] >= 1000) {
+        unitRunSeconds[i] += unitRunMillis[i] / 1000;
+        unitRunMillis[i] %= 1000;
+        countersDirty = true;
+      }
+    }
+    if (unitState[i] == UNIT_ONLINE) {
+      unitsOnline |= 1 << i;
+    }
+    if (unitState[i] != UNIT_STOPPED && unitState[i] != UNIT_COOLING) {
+      active++;
+    }
+  }
+
+  if (!genDemand) {
+    // the transfer logic has already cooled the generator side down: stop every unit
+    genWanted = 0;
+    for (uint8_t i = 0; i < GEN_COUNT; i++) {
+      if (unitState[i] == UNIT_STARTING && now - unitSince[i] >= config[CFG_POWER_CHECK_DELAY]) {
+        unitsFailed |= 1 << i;  // given up on
+      }
+      if (unitState[i] != UNIT_STOPPED) {
+        unitStop(i);
+      }
+    }
+    return;
+  }
+
+  // units needed for the measured load, with a margin and a hold time before one is released
+  uint16_t step = config[CFG_ASSIST_LEVEL];
+  if (genWanted == 0) {
+    genWanted = 1;
+    genCalmSince = now;
+  } else if (step != 0 && genWanted < GEN_COUNT && genLoad >= genWanted * step) {
+    genWanted++;
+    genCalmSince = now;
+  } else if (genWanted > 1 && step != 0 && genLoad + ASSIST_HYSTERESIS >= (genWanted - 1) * step) {
+    genCalmSince = now;
+  } else if (genWanted > 1 && now - genCalmSince >= ASSIST_HOLD) {
+    genWanted--;
+    genCalmSince = now;
+  }
+
+  if (active < genWanted) {
+    int unit = genPick(true);
+    if (unit < 0) {
+      if (active == 0) {
+        unitsFailed = 0;  // every unit has failed: try them all again
+      }
+    } else {
+      if (active > 0 && unitState[unit] == UNIT_STOPPED) {
+        counters.genStarts++;  // the first unit's start is counted by the transfer logic
+        countersDirty = true;
+      }
+      unitStart(unit);
+    }
+  } else if (active > genWanted) {
+    unitRelease(genPick(false));
+  }
+}
+
+/**
+ * The function `genPick` finds the unit to start or release next: the lowest priority number
+ * first, and among equal ones the fewest run hours, so the units take turns. Releasing picks the
+ * opposite, preferring a unit that hasn't come up yet.
+ *
+ * @param start true for a stopped or cooling unit to start, false for a running one to release.
+ * @return The unit, or -1 if there is none. Failed units aren't started.
+ */
+int genPick(boolean start) {
+  int best = -1;
+  for (uint8_t i = 0; i < GEN_COUNT; i++) {
+    boolean running = unitState[i] != UNIT_STOPPED && unitState[i] != UNIT_COOLING;
+    if (running == start || (start && (unitsFailed >> i) & 1)) {
+      continue;
+    }
+    if (best < 0) {
+      best = i;
+      continue;
+    }
+    const GenUnit &u = genUnits[i];
+    const GenUnit &b = genUnits[best];
+    boolean better;
+    if (!start && (unitState[i] == UNIT_ONLINE) != (unitState[best] == UNIT_ONLINE)) {
+      better = unitState[best] == UNIT_ONLINE;
+    } else if (u.priority != b.priority) {
+      better = start ? u.priority < b.priority : u.priority > b.priority;
+    } else {
+      better = start ? unitRunSeconds[i] < unitRunSeconds[best] : unitRunSeconds[i] > unitRunSeconds[best];
+    }
+    if (better) {
+      best = i;
+    }
+  }
+  return best;
+}
+
+/**
+ * The function `unitStart` starts a unit, or takes one that is cooling down back onto the bus.
+ * Its breaker closes once the unit reports ready. A stopped unit with a crank output is cranked.
+ */
+void unitStart(uint8_t unit) {
+  boolean stopped = unitState[unit] == UNIT_STOPPED;
+  writeOutput(genUnits[unit].run, HIGH);
+  unitState[unit] = UNIT_STARTING;
+  unitSince[unit] = millis();
+  if (stopped && genUnits[unit].crank != NO_PIN) {
+    unitCranks[unit] = 0;
+    unitCrank(unit);
+  }
+}
+
+/**
+ * The function `unitCrank` engages a unit's starter for one attempt, and puts the sampler on the
+ * unit's sense input to see it fire if the sampler is free.
+ */
+void unitCrank(uint8_t unit) {
+  writeOutput(genUnits[unit].crank, HIGH);
+  unitState[unit] = UNIT_CRANKING;
+  unitSince[unit] = millis();
+  unitCranks[unit]++;
+  counters.crankAttempts++;
+  countersDirty = true;
+  if (crankWatch < 0 && genUnits[unit].sense != NO_PIN) {
+    waveUnitPin = genUnits[unit].sense;
+    if (waveBorrow(WAVE_USER_CRANK, WAVE_UNIT)) {
+      crankWatch = unit;
+      crankFast = 0;
+    }
+  }
+}
+
+/**
+ * The function `crankCycle` takes the frequency of one cycle on the watched unit's sense input
+ * from `waveService`.
+ *
+ * @param chz The cycle's frequency in centi-Hz, 0 for a dead cycle.
+ */
+void crankCycle(uint16_t chz) {
+  if (crankWatch < 0) {
+    return;
+  }
+  crankFast = chz >= CRANK_FIRED_CHZ ? (crankFast < 0xFF ? crankFast + 1 : crankFast) : 0;
+}
+
+/**
+ * The function `crankEnd` hands the sampler back once the watched unit stops cranking.
+ */
+void crankEnd(uint8_t unit) {
+  if (crankWatch == unit) {
+    crankWatch = -1;
+    waveReturn(WAVE_USER_CRANK);
+  }
+}
+
+/**
+ * The function `genStarting` tells the transfer logic that a unit is still cranking or coming up,
+ * so that a start isn't given up on while the crank attempts last.
+ */
+boolean genStarting() {
+  for (uint8_t i = 0; i < GEN_COUNT; i++) {
+    if (unitState[i] == UNIT_CRANKING || unitState[i] == UNIT_RESTING || unitState[i] == UNIT_STARTING) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * The function `unitRelease` takes a unit that is no longer needed off the bus and lets it cool
+ * down before it stops.
+ */
+void unitRelease(uint8_t unit) {
+  if (unitState[unit] != UNIT_ONLINE) {
+    unitStop(unit);
+    return;
+  }
+  writeOutput(genUnits[unit].breaker, LOW);
+  unitState[unit] = UNIT_COOLING;
+  unitSince[unit] = millis();
+}
+
+/**
+ * The function `unitStop` opens a unit's breaker and stops it.
+ */
+void unitStop(uint8_t unit) {
+  writeOutput(genUnits[unit].crank, LOW);
+  crankEnd(unit);
+  writeOutput(genUnits[unit].breaker, LOW);
+  writeOutput(genUnits[unit].run, LOW);
+  unitState[unit] = UNIT_STOPPED;
+  unitSince[unit] = millis();
+}
+
+/**
+ * The function `unitsCarrying` counts the units on the bus, for the load levels, which are per unit:
+ * with more units on the bus it can carry more.
+ *
+ * @return The online units, at least 1.
+ */
+uint8_t unitsCarrying() {
+  uint8_t units = 0;
+  for (uint8_t i = 0; i < GEN_COUNT; i++) {
+    units += (unitsOnline >> i) & 1;
+  }
+  return units == 0 ? 1 : units;
+}
+
+/**
+ * The function `unitHoursLoad` reads the units' run seconds, which pick the lead unit. They are
+ * only kept with more than one unit; a single unit's hours are `gen_run_s`.
+ */
+void unitHoursLoad() {
+  memset(unitRunSeconds, 0, sizeof(unitRunSeconds));
+  if (GEN_COUNT < 2) {
+    return;
+  }
+  uint32_t stored[GEN_COUNT];
+  uint16_t crc = 0xFFFF;
+  for (uint8_t i = 0; i < sizeof(stored); i++) {
+    ((uint8_t *)stored)[i] = EEPROM.read(unitHoursAddress + i);
+    crc = crc16Update(crc, ((uint8_t *)stored)[i]);
+  }
+  uint16_t storedCrc;
+  EEPROM.get(unitHoursAddress + sizeof(stored), storedCrc);
+  if (crc == storedCrc) {
+    memcpy(unitRunSeconds, stored, sizeof(stored));
+  }
+}
+
+/**
+ * The function `unitHoursSave` writes the units' run seconds along with each counter checkpoint.
+ */
+void unitHoursSave() {
+  if (GEN_COUNT < 2) {
+    return;
+  }
+  uint16_t crc = 0xFFFF;
+  for (uint8_t i = 0; i < sizeof(unitRunSeconds); i++) {
+    crc = crc16Update(crc, ((const uint8_t *)unitRunSeconds)[i]);
+  }
+  EEPROM.put(unitHoursAddress, unitRunSeconds);
+  EEPROM.put(unitHoursAddress + sizeof(unitRunSeconds), crc);
+}
+
+
+// watchdog
+
+#if defined(__AVR__)
+uint8_t resetFlags __attribute__((section(".noinit")));
+
+/**
+ * The function `resetCapture` runs from .init3, before the C runtime clears memory and long before
+ * `setup`. It saves the reset cause and stops the watchdog, which a watchdog reset leaves running
+ * at its shortest timeout.
+ */
+void resetCapture() __attribute__((naked, used, section(".init3")));
+void resetCapture() {
+  resetFlags = MCUSR;
+  if (resetFlags == 0) {
+    __asm__ __volatile__("mov %0, r2" : "=r"(resetFlags));  // Optiboot clears MCUSR and passes it in r2
+  }
+  MCUSR = 0;
+  wdt_disable();
+}
+#endif
+
+/**
+ * The function `watchdogInit` counts a watchdog or brown-out reset and starts the watchdog.
+ */
+void watchdogInit() {
+#if defined(__AVR__)
+  resetCause = resetFlags & (RESET_POWER_ON | RESET_EXTERNAL | RESET_BROWN_OUT | RESET_WATCHDOG);
+  wdt_enable(WDTO_4S);  // a pass answering four `cfg` queries at 9600 baud spends over 2 s on the UART
+#else
+  resetCause = RESET_POWER_ON;
+#endif
+
+  uint16_t crc = 0xFFFF;
+  for (uint8_t i = 0; i < sizeof(resetCounts); i++) {
+    ((uint8_t *)&resetCounts)[i] = EEPROM.read(resetCountAddress + i);
+    crc = crc16Update(crc, ((uint8_t *)&resetCounts)[i]);
+  }
+  uint16_t storedCrc;
+  EEPROM.get(resetCountAddress + sizeof(resetCounts), storedCrc);
+  if (crc != storedCrc) {
+    memset(&resetCounts, 0, sizeof(resetCounts));
+  }
+
+  if (resetCause & (RESET_WATCHDOG | RESET_BROWN_OUT)) {
+    if (resetCause & RESET_WATCHDOG) {
+      resetCounts.watchdog++;
+    } else {
+      resetCounts.brownOut++;
+    }
+    crc = 0xFFFF;
+    for (uint8_t i = 0; i < sizeof(resetCounts); i++) {
+      crc = crc16Update(crc, ((const uint8_t *)&resetCounts)[i]);
+    }
+    EEPROM.put(resetCountAddress, resetCounts);
+    EEPROM.put(resetCountAddress + sizeof(resetCounts), crc);
+  }
+}
+
+/**
+ * The function `watchdogService` feeds the watchdog at the end of a loop pass in which every part
+ * of `PASS_ALL` checked in, so a pass that skipped the mode logic, say for a corrupted mode, isn't
+ * taken as healthy. It also holds the feed once the heap has grown so close to the stack that the
+ * next `String` or JSON document could corrupt it; then the watchdog is left to reset the
+ * controller while the relays are still in a known state. The first such pass is reported on the
+ * link and journaled, so the reset has a recorded cause.
+ */
+void watchdogService() {
+  uint8_t done = passDone;
+  passDone = 0;
+  if (done != PASS_ALL) {
+    return;
+  }
+  int bytes = freeMemory();
+  if (bytes < WATCHDOG_MIN_FREE) {
+    if (!memoryLow) {
+      memoryLow = true;
+      if (bytes < 0) {
+        bytes = 0;
+      }
+      Serial.print(F("{\"low_mem\":"));
+      Serial.print(bytes);
+      Serial.println('}');
+      journalAppend(JE_LOW_MEMORY, bytes);
+      journalFlush();  // the reset would lose the queue
+    }
+    return;
+  }
+#if defined(__AVR__)
+  wdt_reset();
+#endif
+  watchdogFedAt = millis();
+}
+
+/**
+ * The function `freeMemory` returns the bytes between the top of the heap and the stack.
+ */
+int freeMemory() {
+#if defined(__AVR__)
+  extern char __heap_start;
+  extern char *__brkval;
+  char top;
+  return &top - (__brkval != 0 ? __brkval : &__heap_start);
+#else
+  return 1024;
+#endif
+}
+
+
+// idle sleep
+
+/**
+ * The function `idleInit` switches off the peripherals the controller never uses, which also cuts
+ * their share of the idle current.
+ */
+void idleInit() {
+#if defined(__AVR__)
+  power_spi_disable();
+  power_twi_disable();
+  set_sleep_mode(SLEEP_MODE_IDLE);
+#endif
+  idleWindowStart = millis();
+}
+
+/**
+ * The function `idleSleep` ends a loop pass by sleeping until the next interrupt, unless
+ * `idleBusy` finds work left for the next pass. The check runs with interrupts off and `sleep_cpu`
+ * directly follows `sei`, so an interrupt arriving after the check still wakes it.
+ */
+void idleSleep() {
+  unsigned long now = millis();
+  if (now - idleWindowStart >= IDLE_WINDOW) {
+    idlePercent = idleMicros / ((now - idleWindowStart) * 10);
+    idleLongest = idleMaxMicros > 0xFFFF ? 0xFFFF : idleMaxMicros;
+    idleMicros = 0;
+    idleMaxMicros = 0;
+    idleWindowStart = now;
+  }
+  if (config[CFG_IDLE_SLEEP] == 0) {
+    return;
+  }
+
+#if defined(__AVR__)
+  unsigned long start = micros();
+  noInterrupts();
+  if (idleBusy()) {
+    interrupts();
+    return;
+  }
+  sleep_enable();
+  interrupts();
+  sleep_cpu();
+  sleep_disable();
+  unsigned long slept = micros() - start;
+  idleMicros += slept;
+  if (slept > idleMaxMicros) {
+    idleMaxMicros = slept;
+  }
+#endif
+}
+
+/**
+ * The function `idleBusy` tells whether the next pass has work waiting that no interrupt would
+ * announce: a received line, bytes still queued for the UART, a link negotiation step, a wave
+ * block waiting for room or cycles not yet encoded, or a relay close timed from the loop.
+ */
+boolean idleBusy() {
+  return Serial.available() > 0
+    || Serial.availableForWrite() < SERIAL_TX_BUFFER_SIZE - 1
+    || linkState != LINK_IDLE
+    || wavePending || waveTail != waveHead
+    || relayPending != RELAY_NONE;
+}
+
+// zero-crossing closes
+
+/**
+ * The function `zcStart` gets the sampler onto the sense input of the source a relay is about to
+ * connect, so that the close can be timed to its crossings. The grid bands are left unchecked
+ * while the sampler is on the generator.
+ *
+ * @param relay `RELAY_GRID` or `RELAY_GEN`.
+ * @return `false` when the sampler is held on the other source; the close then goes untimed.
+ */
+boolean zcStart(int8_t relay) {
+  uint8_t channel = relay == RELAY_GEN ? WAVE_GEN : WAVE_GRID;
+  if (!waveBorrow(WAVE_USER_ZC, channel)) {
+    zcMissed++;
+    zcEnd();
+    return false;
+  }
+  zcChannel = channel;
+  zcState = ZC_LOCKING;
+  return true;
+}
+
+/**
+ * The function `zcCrossing` reads the sampler's last rising crossing.
+ *
+ * @param cycle Set to the us since the crossing before it, 0 if there was none.
+ * @return The micros() of the crossing, back-dated from the interrupt by the conversion time and
+ * the interpolated offset.
+ */
+unsigned long zcCrossing(unsigned long &cycle) {
+  noInterrupts();
+  unsigned long at = waveCrossAt;
+  uint8_t offset = waveCrossOffset;
+  uint16_t period = waveCrossPeriod;
+  interrupts();
+  cycle = (uint32_t)period * WAVE_SAMPLE_NS / 16000;
+  return at - WAVE_SAMPLE_LAG - (uint32_t)offset * WAVE_SAMPLE_NS / 16000;
+}
+
+/**
+ * The function `zcSchedule` times the pending close to a zero crossing, once it is due within
+ * ZC_LEAD so that the crossing isn't extrapolated over many cycles. The close command goes out the
+ * relay's pickup time before the first crossing the contacts can meet after the close was due.
+ * Without steady crossings by ZC_LOCK_TIMEOUT past due, or when a stream has taken the sampler
+ * to the other source, the close is left to go out at once.
+ *
+ * @return `true` when the close has its final time.
+ */
+boolean zcSchedule() {
+  unsigned long now = micros();
+  unsigned long waited = now - relayPendingAt;
+  if (waited + ZC_LEAD < relayPendingWait) {
+    return false;
+  }
+  if (waveChannel != zcChannel) {
+    zcMissed++;  // the crossings are the other source's
+    zcEnd();
+    return true;
+  }
+  unsigned long cycle;
+  unsigned long crossAt = zcCrossing(cycle);
+  if (cycle < ZC_MIN_CYCLE || cycle > ZC_MAX_CYCLE || now - crossAt >= 2 * cycle) {
+    if (waited < relayPendingWait + ZC_LOCK_TIMEOUT) {
+      return false;
+    }
+    zcMissed++;
+    zcEnd();
+    return true;
+  }
+
+  unsigned long pickup = relayPickup[relayPending] * 1000UL;
+  zcHalf = cycle / 2;
+  zcDue = relayPendingAt + relayPendingWait;
+  if ((long)(now + ZC_MARGIN - zcDue) > 0) {
+    zcDue = now + ZC_MARGIN;
+  }
+  zcTarget = crossAt + (zcDue + pickup - crossAt + zcHalf - 1) / zcHalf * zcHalf;
+  zcDue = zcTarget - pickup;
+  relayPendingWait = zcDue - relayPendingAt;
+  zcState = ZC_TIMED;
+  return true;
+}
+
+/**
+ * The function `zcCheck` waits for the first crossing after a timed close's contacts met and
+ * books how far they were from the nearest crossing, as an angle of the cycle the sampler measured.
+ * The command's own lateness counts in, the pickup estimate doesn't: it is the best guess there is.
+ */
+void zcCheck() {
+  unsigned long cycle;
+  unsigned long crossAt = zcCrossing(cycle);
+  long late = relayClosedAt - zcDue;
+  unsigned long contact = zcTarget + late;
+  if (waveChannel != zcChannel) {
+    zcEnd();  // a stream took the sampler
+    return;
+  }
+  if (cycle < ZC_MIN_CYCLE || cycle > ZC_MAX_CYCLE || (long)(crossAt - contact) < 0) {
+    if ((long)(micros() - contact) > (long)(4 * zcHalf)) {
+      zcEnd();  // the source went with the close
+    }
+    return;
+  }
+
+  unsigned long half = cycle / 2;
+  unsigned long halves = (crossAt - contact + half / 2) / half;
+  long error = (long)(contact - (crossAt - halves * half));
+  zcLastError = error * 3600L / (long)cycle;
+  uint16_t size = zcLastError < 0 ? -zcLastError : zcLastError;
+  zcErrorSum += size;
+  if (size > zcErrorMax) {
+    zcErrorMax = size;
+  }
+  if (late < 0) {
+    late = -late;
+  }
+  if (late > (long)zcJitterMax) {
+    zcJitterMax = late > 0xFFFF ? 0xFFFF : late;
+  }
+  zcCloses++;
+  zcEnd();
+}
+
+/**
+ * The function `zcEnd` finishes with a close and hands the sampler back.
+ */
+void zcEnd() {
+  zcState = ZC_IDLE;
+  waveReturn(WAVE_USER_ZC);
+}
+
+
+// soft start
+
+/**
+ * The function `softService` follows the load bus onto the generator and off it again. A sequence
+ * starts once the main circuit is on and the generator relay is closing or closed, and its first
+ * step is the bus being energized. Without soft_pct, or without the sampler, the circuits follow
+ * by their reconnect delays as before.
+ */
+void softService() {
+  boolean onGen = (outputLatch & 0x06) == 0x06;
+  boolean toGen = (outputLatch & 0x04) && ((outputLatch & 0x02) || relayPending == RELAY_GEN);
+  unsigned long now = millis();
+  switch (softState) {
+    case SOFT_IDLE:
+      if (toGen && config[CFG_SOFT_LEVEL] != 0) {
+        softRef = 0;
+        softState = waveBorrow(WAVE_USER_SOFT, WAVE_GEN) ? SOFT_WAIT : SOFT_DONE;
+      }
+      break;
+
+    case SOFT_WAIT:
+      if (!toGen) {
+        softFinish();
+      } else if (onGen) {
+        softState = SOFT_STEP;
+        softChannel = 0;
+        softStable = 0;
+        softSince = now;
+        softBegan = now;
+        softLastSteps = 1;
+      }
+      break;
+
+    case SOFT_STEP:
+      if (!onGen || waveChannel != WAVE_GEN) {
+        softFinish();  // off the generator, or a stream took the sampler
+      } else if (now - softSince >= SOFT_STEP_TIMEOUT) {
+        softTimeouts++;
+        if (softChannel > 0 && softChannel < LOAD_COUNT) {
+          loadSwitch(softChannel, false);
+        }
+        softFinish();
+      }
+      break;
+
+    case SOFT_DONE:
+      if (!toGen) {
+        softState = SOFT_IDLE;
+      }
+      break;
+  }
+}
+
+/**
+ * The function `softCycle` takes the RMS of one generator cycle from `waveService`. Before the
+ * bus is energized it notes the unloaded level; during a step it counts the cycles that are within
+ * soft_pct of the level before the step and within 1 % of the cycle before, and takes the next
+ * step after SOFT_STABLE_CYCLES of them in a row.
+ *
+ * @param rms The cycle's RMS in 1/16 ADC counts.
+ */
+void softCycle(uint16_t rms) {
+  if (softState == SOFT_WAIT) {
+    softRef = rms;
+    softLast = rms;
+    return;
+  }
+  if (softState != SOFT_STEP) {
+    return;
+  }
+  uint16_t swing = rms > softLast ? rms - softLast : softLast - rms;
+  boolean recovered = rms != 0 && swing <= rms / 100
+    && (uint32_t)rms * 100 >= (uint32_t)softRef * (100 - config[CFG_SOFT_LEVEL]);
+  softLast = rms;
+  softStable = recovered ? softStable + 1 : 0;
+  if (softStable >= SOFT_STABLE_CYCLES) {
+    softRef = rms;
+    softNext();
+  }
+}
+
+/**
+ * The function `softNext` takes the next step: the disconnected circuit `loadPick` would connect
+ * first, while the generator load is below restore_pct. Otherwise the sequence is done.
+ */
+void softNext() {
+  unsigned long now = millis();
+  softLastTime = now - softBegan > 0xFFFF ? 0xFFFF : now - softBegan;
+  int channel = loadPick(false);
+  if (channel <= 0 || genLoad >= config[CFG_RESTORE_LEVEL] * unitsCarrying()) {
+    softFinish();
+    return;
+  }
+  loadSwitch(channel, true);
+  softChannel = channel;
+  softStable = 0;
+  softSince = now;
+  softLastSteps++;
+}
+
+/**
+ * The function `softFinish` ends the sequence and hands the sampler back. Circuits still off follow
+ * by their reconnect delays from now on.
+ */
+void softFinish() {
+  softState = (outputLatch & 0x06) == 0x06 ? SOFT_DONE : SOFT_IDLE;
+  loadCalmSince = millis();
+  waveReturn(WAVE_USER_SOFT);
+}
+
+/**
+ * The function `softSettling` tells the load checks to hold off.
+ *
+ * @return `true` while the bus is going onto the generator or a step hasn't recovered yet.
+ */
+boolean softSettling() {
+  return softState == SOFT_WAIT || softState == SOFT_STEP;
+}
+
+
+
+// sensor plausibility
+
+/**
+ * The function `plausService` runs every rule once per pass, before the mode logic acts on the
+ * inputs. A rule trips once it has been broken for its hold time. A tripped sensor rule stays
+ * tripped, and its input suspect, until the rule finds the input agreeing again; the others end as
+ * soon as they no longer apply.
+ */
+void plausService() {
+  unsigned long now = millis();
+  uint8_t relays = outputLatch & RELAY_MASK;
+  if (relays != plausRelays) {
+    plausRelays = relays;
+    plausRelaysSince = now;
+  }
+  uint8_t suspect = 0;
+  for (uint8_t rule = 0; rule < PL_COUNT; rule++) {
+    uint8_t bit = 1 << rule;
+    uint8_t sensor = pgm_read_byte(&plausInfo[rule].sensor);
+    uint8_t verdict = plausCheck(rule);
+    if (verdict != PLAUS_BROKEN) {
+      plausBroken &= ~bit;
+      if (verdict == PLAUS_OK || sensor == 0) {
+        plausTripped &= ~bit;
+      }
+    } else if (!(plausBroken & bit)) {
+      plausBroken |= bit;
+      plausSince[rule] = now;
+    }
+    if ((plausBroken & bit) && !(plausTripped & bit) &&
+        (uint16_t)(now - plausSince[rule]) >= pgm_read_word(&plausInfo[rule].hold)) {
+      plausTripped |= bit;
+      if (!(sensor & (plausSuspect | suspect))) {
+        plausTrip(rule);  // counted once per input, however many rules blame it
+      }
+    }
+    if (plausTripped & bit) {
+      suspect |= sensor;
+    }
+  }
+  plausSuspect = suspect;
+}
+
+/**
+ * The function `plausCheck` evaluates one rule on the current inputs. A rule that would need the
+ * word of a suspect input doesn't apply.
+ *
+ * @param rule The `PlausRule`.
+ * @return The `PlausVerdict`.
+ */
+uint8_t plausCheck(uint8_t rule) {
+  uint8_t relays = plausRelays;
+  boolean loadLive = digitalRead(load_check) == HIGH;
+  boolean loadTrusted = !(plausSuspect & 0x04);
+  switch (rule) {
+    case PL_LOAD_UNFED:
+      if ((relays & 0x04) && (relays & 0x03)) {
+        return PLAUS_IDLE;
+      }
+      return loadLive ? PLAUS_BROKEN : PLAUS_OK;
+
+    case PL_LOAD_DRAWN:
+      if (relays != 0x06) {
+        return PLAUS_IDLE;
+      }
+      if (loadLive) {
+        return genLoad >= PLAUS_CURRENT_PCT ? PLAUS_OK : PLAUS_IDLE;
+      }
+      return plausDrawn() ? PLAUS_BROKEN : PLAUS_IDLE;
+
+    case PL_GRID_FEEDS:
+      if (relays != 0x05 || !loadLive || !loadTrusted) {
+        return PLAUS_IDLE;
+      }
+      return digitalRead(grid_check) == HIGH ? PLAUS_OK : PLAUS_BROKEN;
+
+    case PL_GEN_FEEDS:
+      if (relays != 0x06 || !loadLive || !loadTrusted) {
+        return PLAUS_IDLE;
+      }
+      return digitalRead(generator_check) == HIGH ? PLAUS_OK : PLAUS_BROKEN;
+
+    case PL_GRID_WAVE:
+      if (config[CFG_GRID_V_SCALE] == 0 || waveChannel != WAVE_GRID) {
+        return PLAUS_IDLE;
+      }
+      if (digitalRead(grid_check) == HIGH) {
+        return (uint32_t)gridVolts * 4 < config[CFG_GRID_V_MIN] ? PLAUS_BROKEN : PLAUS_OK;
+      }
+      return gridInBand ? PLAUS_BROKEN : PLAUS_OK;
+
+    case PL_GEN_IDLE:
+      if (gen_run_pin == NO_PIN || unitsOnline != 0) {
+        return PLAUS_IDLE;  // the Nano's generator may run on after its relay opens
+      }
+      return digitalRead(generator_check) == HIGH ? PLAUS_BROKEN : PLAUS_OK;
+
+    case PL_LOAD_LOST:
+      if ((relays != 0x05 && relays != 0x06) || !loadTrusted || softSettling()
+          || millis() - plausRelaysSince < config[CFG_LOAD_CHECK_DELAY]) {
+        return PLAUS_IDLE;
+      }
+      if (loadLive) {
+        return PLAUS_OK;
+      }
+      if (!(relays == 0x05 ? gridGood() : genSensed())) {
+        return PLAUS_IDLE;  // the source went: a source fault, for the transfer logic
+      }
+      return relays == 0x06 && plausDrawn() ? PLAUS_IDLE : PLAUS_BROKEN;
+
+    case PL_GEN_FOLLOWS:
+      if (!(relays & 0x02) || genStarting() || (gen_run_pin == NO_PIN && (plausSuspect & 0x02))
+          || millis() - plausRelaysSince < config[CFG_POWER_CHECK_DELAY]) {
+        return PLAUS_IDLE;
+      }
+      return genSensed() ? PLAUS_OK : PLAUS_BROKEN;
+  }
+  return PLAUS_IDLE;
+}
+
+/**
+ * The function `plausTrip` counts the fault a rule found. A sensor fault is also journaled and
+ * sounds the alarm. Source and load faults are acted on by the mode logic, the load ones only
+ * through `loadFailAction` once PL_LOAD_LOST holds.
+ */
+void plausTrip(uint8_t rule) {
+  uint8_t fault = pgm_read_byte(&plausInfo[rule].fault);
+  faultCount(fault);
+  if (fault == FC_SENSOR) {
+    journalAppend(JE_SENSOR, rule);
+    turnOnAlarm();
+  }
+}
+
+/**
+ * The function `plausHolds` tells whether a rule has tripped and is still broken.
+ */
+boolean plausHolds(uint8_t rule) {
+  return (plausTripped & plausBroken & (1 << rule)) != 0;
+}
+
+/**
+ * The function `plausFeeds` tells whether a source alone feeds a load that load_check sees live.
+ *
+ * @param relay `RELAY_GRID` or `RELAY_GEN`.
+ */
+boolean plausFeeds(int8_t relay) {
+  return (outputLatch & RELAY_MASK) == ((1 << relay) | 0x04) && !(plausSuspect & 0x04)
+    && digitalRead(load_check) == HIGH;
+}
+
+/**
+ * The function `plausDrawn` reads the generator feed current now, rather than the filtered
+ * `genLoad`, which lags a lost load by seconds.
+ *
+ * @return `true` when it is at PLAUS_CURRENT_PCT or above.
+ */
+boolean plausDrawn() {
+  if (gen_load_sense == NO_PIN || config[CFG_GEN_LOAD_FULL] == 0) {
+    return false;
+  }
+  return (uint32_t)senseRead(gen_load_sense) * 100 / config[CFG_GEN_LOAD_FULL] >= PLAUS_CURRENT_PCT;
+}
+
+/**
+ * The function `faultCount` adds one fault to its class, saturating.
+ *
+ * @param fault The `FaultClass`.
+ */
+void faultCount(uint8_t fault) {
+  if (faultCounts[fault] != 0xFFFF) {
+    faultCounts[fault]++;
+  }
+}
+
+/**
+ * The function `genSensed` tells whether the generator side is up. generator_check decides, but a
+ * live load that the generator alone feeds vouches for it as well, on the Mega only with a unit on
+ * the bus. Once generator_check is suspect on the Mega, the units' ready inputs decide alone.
+ */
+boolean genSensed() {
+  if (gen_run_pin != NO_PIN && (plausSuspect & 0x02)) {
+    return unitsOnline != 0;
+  }
+  return digitalRead(generator_check) == HIGH
+    || ((gen_run_pin == NO_PIN || unitsOnline != 0) && plausFeeds(RELAY_GEN));
+}
@@ -0,0 +1,131 @@
+// Host measurement of bulk transfer throughput before and after a Bluetooth
+// link speed negotiation.
+//
+// The firmware (src/main.cpp) runs against the shims in shim/, whose serial
+// stand-in takes as long as the real UART at the configured baud rate. A
+// simulated HC-05 answers the AT commands the firmware sends while its KEY
+// pin is high, and a simulated client pulls the journal with `xfer` and acks
+// every chunk as it arrives.
+//
+//   linkbench [baud] [loss_percent]
+
+#include "../../src/main.cpp"
+
+#include <stdio.h>
+
+namespace {
+
+const unsigned long PASS_MICROS = 200;  // simulated cost of one loop pass
+
+// HC-05 stand-in
+struct Module {
+  unsigned long activeBaud = 9600;  // rate the UART runs at now
+  unsigned long storedBaud = 9600;  // rate set by AT+UART, active after AT+RESET
+  std::string line;
+
+  void receive(const std::string &bytes) {
+    if (sim::outputLevel(bt_key_pin) != HIGH || sim::serialBaud() != activeBaud) {
+      return;  // data mode, or garbage at the wrong rate
+    }
+    for (char c : bytes) {
+      if (c != '\n') {
+        if (c != '\r') line += c;
+        continue;
+      }
+      if (line == "AT") {
+        sim::feedSerial("OK\r\n");
+      } else if (line.compare(0, 8, "AT+UART=") == 0) {
+        storedBaud = strtoul(line.c_str() + 8, nullptr, 10);
+        sim::feedSerial("OK\r\n");
+      } else if (line == "AT+RESET") {
+        sim::feedSerial("OK\r\n");
+        activeBaud = storedBaud;
+      }
+      line.clear();
+    }
+  }
+};
+
+// Client side of the chunk protocol; drops `lossPercent` of the chunks
+struct Client {
+  std::string buffer;
+  uint16_t received = 0;
+  uint16_t total = 0xFFFF;
+  unsigned lossPercent = 0;
+  unsigned seed = 1;
+
+  void receive(const std::string &bytes) {
+    buffer += bytes;
+    for (;;) {
+      size_t start = buffer.find("\xA5\x5A" "C");
+      if (start == std::string::npos || buffer.size() < start + 9) return;
+      const uint8_t *f = (const uint8_t *)buffer.data() + start;
+      size_t len = f[8];
+      if (buffer.size() < start + 9 + len + 2) return;
+
+      uint16_t crc = 0xFFFF;
+      for (size_t i = 2; i < 9 + len; i++) crc = crc16Update(crc, f[i]);
+      bool good = crc == (uint16_t)(f[9 + len] | f[10 + len] << 8);
+      seed = seed * 1103515245 + 12345;
+      bool lost = (seed >> 16) % 100 < lossPercent;
+      uint16_t offset = f[6] | f[7] << 8;
+      total = f[4] | f[5] << 8;
+
+      if (good && !lost && offset == received) {
+        received += len;
+        sim::feedSerial("ack " + std::to_string(received) + "\n");
+      } else if (!lost && offset > received) {
+        sim::feedSerial("nak " + std::to_string(received) + "\n");
+      }
+      buffer.erase(0, start + 9 + len + 2);
+    }
+  }
+};
+
+Module module;
+
+void pass(Client *client, std::string *text) {
+  loop();
+  std::string out = sim::takeSerialOutput();
+  module.receive(out);
+  if (client) client->receive(out);
+  if (text) *text += out;
+  sim::advanceMicros(PASS_MICROS);
+}
+
+// Pull the whole journal and return the payload rate in bytes per second
+double measure(unsigned lossPercent) {
+  Client client;
+  client.lossPercent = lossPercent;
+  unsigned long start = micros();
+  sim::feedSerial("xfer journal 0\n");
+  while (client.received < client.total && micros() - start < 120000000UL) pass(&client, nullptr);
+  return client.received * 1e6 / (micros() - start);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  unsigned long target = argc > 1 ? strtoul(argv[1], nullptr, 10) : 115200;
+  unsigned loss = argc > 2 ? atoi(argv[2]) : 0;
+
+  sim::reset();
+  EEPROM.write(modeAddress, MANUAL);
+  EEPROM.write(controlModeAddress, STOP);
+  setup();
+  for (uint8_t i = 0; i < JOURNAL_RECORDS; i++) journalAppend(JE_MODE, i);
+
+  double before = measure(loss);
+  printf("%6lu baud: %7.1f bytes/s\n", sim::serialBaud(), before);
+
+  std::string replies;
+  sim::feedSerial("link " + std::to_string(target) + "\n");
+  unsigned long start = millis();
+  while (millis() - start < 10000 && replies.find("\"link\":") == std::string::npos) pass(nullptr, &replies);
+  size_t status = replies.find("{\"link\":");
+  printf("negotiation: %s", status == std::string::npos ? "no reply\n" : replies.substr(status).c_str());
+
+  double after = measure(loss);
+  printf("%6lu baud: %7.1f bytes/s (x%.1f)\n", sim::serialBaud(), after, after / before);
+  return sim::serialBaud() == target ? 0 : 1;
+}
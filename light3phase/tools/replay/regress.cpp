@@ -0,0 +1,1659 @@
+// Host regression scenarios for the firmware.
+//
+// Each scenario boots src/main.cpp on the shims in shim/ from an erased
+// EEPROM, drives a simple model of the sources and the serial link on the
+// simulated clock and checks what the firmware did. Every scenario runs in a
+// child process of its own, so the firmware's globals start fresh each time.
+//
+//   regress [scenario ...]
+//
+// Without arguments all scenarios run; `make check` builds and runs them for
+// both pinouts. Scenarios that need hardware a pinout lacks are skipped there.
+
+#include "../../src/main.cpp"
+
+#include <math.h>
+#include <stdio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <vector>
+
+namespace {
+
+// Sources as the model sees them; the sense inputs follow the relays. A generator with a run output
+// runs while it is on, one without runs while the generator_relay contacts are closed. Paralleled
+// units are ready as soon as they run, and the bus is live while a ready unit's breaker is closed.
+// A unit with a crank output only runs once it has been cranked for crankNeeds ms in one attempt,
+// and reports ready readyLag ms after it fired.
+bool gridLive = true;
+bool genLive = true;
+bool unitDead[GEN_COUNT];
+unsigned long crankNeeds[GEN_COUNT];
+unsigned long readyLag[GEN_COUNT];
+unsigned long crankedSince[GEN_COUNT];  // millis() + 1 the starter engaged, 0 = not engaged
+unsigned long firedAt[GEN_COUNT];       // millis() + 1 the engine fired, 0 = not running
+int loadCheckStuck = -1;                // LOW or HIGH: load_check reads that whatever the load does
+
+// Source relay contacts, which follow their coil a pickup or dropout time later (none by default)
+struct Contact {
+  int pin;
+  unsigned long pickupUs;
+  unsigned long dropoutUs;
+  int coil;
+  unsigned long coilSince;
+  bool closed;
+  bool closedBefore;  // when the coil last changed
+};
+Contact contacts[2] = { { grid_relay, 0, 0, LOW, 0, false, false }, { generator_relay, 0, 0, LOW, 0, false, false } };
+bool contactsOverlapped = false;
+unsigned long darkSince = 0;      // micros() the load last went dark with the load relay closed
+unsigned long lastDarkUs = 0;     // and how long that lasted
+
+void contactsUpdate() {
+  for (Contact &c : contacts) {
+    int coil = sim::outputLevel(c.pin);
+    if (coil != c.coil) {
+      c.coil = coil;
+      c.coilSince = micros();
+      c.closedBefore = c.closed;
+    }
+    unsigned long since = micros() - c.coilSince;
+    c.closed = coil == HIGH ? c.closedBefore || since >= c.pickupUs : c.closedBefore && since < c.dropoutUs;
+  }
+  contactsOverlapped |= contacts[0].closed && contacts[1].closed;
+}
+
+int failures = 0;
+
+void expect(bool ok, const char *what) {
+  if (!ok) {
+    printf("  FAIL: %s\n", what);
+    failures++;
+  }
+}
+
+// Whether any generator unit is told to run; the Nano's single unit runs from generator_relay
+bool genRunning() {
+  if (gen_run_pin == NO_PIN) return sim::outputLevel(generator_relay) == HIGH;
+  bool running = false;
+  for (uint8_t i = 0; i < GEN_COUNT; i++) running |= sim::outputLevel(genUnits[i].run) == HIGH;
+  return running;
+}
+
+void senseInputs() {
+  contactsUpdate();
+  bool gen = false;
+  if (gen_run_pin == NO_PIN) {
+    gen = genLive && contacts[1].closed;
+  } else {
+    for (uint8_t i = 0; i < GEN_COUNT; i++) {
+      const GenUnit &u = genUnits[i];
+      bool runs = genLive && !unitDead[i] && sim::outputLevel(u.run) == HIGH;
+      if (u.crank != NO_PIN) {
+        bool cranking = sim::outputLevel(u.crank) == HIGH;
+        if (!cranking) crankedSince[i] = 0;
+        else if (crankedSince[i] == 0) crankedSince[i] = millis() + 1;
+        if (!runs) firedAt[i] = 0;
+        else if (firedAt[i] == 0 && cranking && millis() + 1 - crankedSince[i] >= crankNeeds[i]) {
+          firedAt[i] = millis() + 1;
+        }
+        runs = firedAt[i] != 0;
+      }
+      bool ready = runs && (u.crank == NO_PIN || millis() + 1 - firedAt[i] >= readyLag[i]);
+      if (u.ready != generator_check) sim::setInput(u.ready, ready ? HIGH : LOW);
+      gen |= ready && (u.breaker == NO_PIN || sim::outputLevel(u.breaker) == HIGH);
+    }
+  }
+  bool fed = (gridLive && contacts[0].closed) || (gen && contacts[1].closed);
+  bool live = fed && sim::outputLevel(load_relay) == HIGH;
+  if (sim::outputLevel(load_relay) == HIGH && !live && darkSince == 0) {
+    darkSince = micros();
+  } else if (live && darkSince != 0) {
+    lastDarkUs = micros() - darkSince;
+    darkSince = 0;
+  }
+  sim::setInput(grid_check, gridLive ? HIGH : LOW);
+  sim::setInput(generator_check, gen ? HIGH : LOW);
+  sim::setInput(load_check, loadCheckStuck >= 0 ? loadCheckStuck : live ? HIGH : LOW);
+}
+
+// Runs the loop for `ms` of simulated time, 1 ms between passes plus whatever a pass spends itself
+void run(unsigned long ms) {
+  unsigned long end = millis() + ms;
+  while ((long)(millis() - end) < 0) {
+    senseInputs();
+    loop();
+    sim::advanceMicros(1000);
+  }
+}
+
+void boot(Mode mode, ControlMode control) {
+  sim::reset();
+  EEPROM.write(modeAddress, mode);
+  EEPROM.write(controlModeAddress, control);
+  senseInputs();
+  setup();
+  run(100);
+  sim::takeSerialOutput();
+}
+
+// Sends one line and returns what came back in the `ms` after it
+std::string command(const std::string &line, unsigned long ms = 50) {
+  sim::takeSerialOutput();
+  sim::feedSerial(line + "\n");
+  run(ms);
+  return sim::takeSerialOutput();
+}
+
+// Runs the replay tool on a capture and returns its exit status
+int replay(const std::string &capture, const std::string &options) {
+  char path[] = "/tmp/regress_trace_XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0 || write(fd, capture.data(), capture.size()) != (ssize_t)capture.size()) return -1;
+  close(fd);
+  std::string line = "./replay " + options + " " + path + " > /dev/null";
+  int status = system(line.c_str());
+  unlink(path);
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// A capture replays against the same firmware to the same relay timeline and a timeline that is a few
+// ms off is caught. Once the ring wraps, the base snapshot in the frame header still describes the state
+// the oldest record starts from.
+void traceReplay() {
+  boot(MANUAL, GRID);
+  command("trace_on");
+  run(3000);
+  gridLive = false;
+  run(3000);
+  gridLive = true;
+  run(3000);
+  std::string capture = command("trace_dump");
+  size_t at = capture.find("\xA5\x5A" "T");
+  expect(at != std::string::npos && traceCount < TRACE_RING_SIZE, "the dump holds the whole capture");
+  expect(at != std::string::npos && (uint8_t)capture[at + 5] == (MANUAL << 4 | GRID),
+         "it starts from the modes");
+  expect(replay(capture, "") == 0, "the capture replays to the recorded timeline");
+
+  char timeline[] = "/tmp/regress_timeline_XXXXXX";
+  close(mkstemp(timeline));
+  expect(replay(capture, std::string("-o ") + timeline) == 0, "the replayed timeline is saved");
+  std::vector<std::pair<unsigned long, unsigned>> edges;
+  FILE *f = fopen(timeline, "r");
+  unsigned long t;
+  unsigned mask;
+  while (f && fscanf(f, "%lu %u", &t, &mask) == 2) edges.push_back({ t, mask });
+  if (f) fclose(f);
+  expect(edges.size() > 2, "with its edges");
+  f = fopen(timeline, "w");
+  for (size_t i = 0; f && i < edges.size(); i++) {
+    fprintf(f, "%lu %u\n", edges[i].first + (i == 2 ? 5 : 0), edges[i].second);
+  }
+  if (f) fclose(f);
+  expect(replay(capture, std::string("-c ") + timeline) == 1, "an edge 5 ms late is a difference");
+  expect(replay(capture, std::string("-t 5 -c ") + timeline) == 0, "unless it is within the tolerance");
+  unlink(timeline);
+
+  // overfill the ring with records 10 ms apart: the two overwritten ones move the base on
+  traceStart();
+  unsigned long start = millis();
+  for (uint8_t i = 0; i < TRACE_RING_SIZE + 2; i++) {
+    sim::advanceMicros(10000);
+    traceRecord(TRACE_INPUTS, 0x40 | i);
+  }
+  sim::takeSerialOutput();
+  traceDump();
+  capture = sim::takeSerialOutput();
+  const uint8_t *frame = (const uint8_t *)capture.data();
+  expect(capture.size() > 16 && frame[4] == TRACE_RING_SIZE, "the wrapped ring is full");
+  expect(capture.size() > 16 && frame[6] == 0x41, "the base holds the last overwritten inputs");
+  unsigned long uptime = 0;
+  for (int i = 3; capture.size() > 16 && i >= 0; i--) uptime = uptime << 8 | frame[8 + i];
+  expect(uptime == start + 20, "and the time they were recorded at");
+  expect(capture.size() > 16 && frame[12] == 10 && frame[14] == TRACE_INPUTS && frame[15] == 0x42,
+         "the oldest record left follows the base");
+}
+
+// Pulls the records out of a journal_dump frame; false if there is no frame or it doesn't check out
+bool journalFrame(const std::string &out, std::vector<JournalRecord> &records) {
+  size_t at = out.find("\xA5\x5A" "J");
+  if (at == std::string::npos || out.size() < at + 5) return false;
+  const uint8_t *p = (const uint8_t *)out.data() + at + 2;
+  uint8_t count = p[2];
+  size_t length = 3 + count * JOURNAL_RECORD_SIZE;
+  if (p[1] != JOURNAL_VERSION || out.size() < at + 2 + length + 2) return false;
+
+  uint16_t crc = 0xFFFF;
+  for (size_t i = 0; i < length; i++) crc = crc16Update(crc, p[i]);
+  if ((p[length] | p[length + 1] << 8) != crc) return false;
+
+  records.clear();
+  for (uint8_t n = 0; n < count; n++) {
+    const uint8_t *r = p + 3 + n * JOURNAL_RECORD_SIZE;
+    records.push_back({ r[0], r[1], (uint16_t)(r[2] | r[3] << 8), (uint16_t)(r[4] | r[5] << 8) });
+  }
+  return true;
+}
+
+// Events reach the EEPROM ring, survive a reboot with the sequence carried on, and come back oldest
+// first in a dump frame whose CRC checks out; a ring that has wrapped is found again at boot
+void journal() {
+  boot(MANUAL, GRID);
+  run(3000);
+  gridLive = false;
+  run(3000);
+  gridLive = true;
+  run(5000);
+
+  std::vector<JournalRecord> records;
+  expect(journalFrame(command("journal_dump"), records), "the dump is one well formed frame");
+  expect(records.size() == journalCount && journalPendingCount == 0, "the dump flushes the queue first");
+  bool ordered = !records.empty();
+  for (size_t i = 1; i < records.size(); i++) ordered &= records[i].seq == records[i - 1].seq + 1;
+  expect(ordered, "records come oldest first with consecutive sequence numbers");
+  int boots = 0, lost = -1, back = -1;
+  for (size_t i = 0; i < records.size(); i++) {
+    if (records[i].code == JE_BOOT) boots++;
+    if (records[i].code == JE_GRID_LOST && lost < 0) lost = i;
+    if (records[i].code == JE_GRID_BACK && back < 0) back = i;
+  }
+  expect(boots == 1 && records.size() > 0 && records[0].code == JE_BOOT, "the boot is recorded first");
+  expect(lost >= 0 && back > lost, "the outage is recorded as lost, then back");
+  expect(back >= 0 && records[back].payload >= 2 && records[back].payload <= 4, "with its duration in seconds");
+
+  uint8_t count = journalCount;
+  uint8_t seq = journalSeq;
+  boot(MANUAL, GRID);
+  expect(journalCount == count, "the reboot finds the stored records");
+  expect(journalSeq == (seq + 1) % JOURNAL_SEQ_MODULO, "and carries the sequence on past its own boot record");
+  expect(journalFrame(command("journal_dump"), records), "the dump after the reboot is well formed");
+  expect(records.size() == count + 1u && records.back().code == JE_BOOT && records.back().seq == seq,
+         "the new boot record follows the old ones");
+
+  for (uint8_t i = 0; i < JOURNAL_RECORDS + 5; i++) journalAppend(JE_MODE, i);
+  journalFlush();
+  uint8_t head = journalHead;
+  seq = journalSeq;
+  journalInit();
+  expect(journalCount == JOURNAL_RECORDS, "a wrapped ring is full");
+  expect(journalHead == head && journalSeq == seq, "and its head is found again");
+  expect(journalFrame(command("journal_dump"), records), "the wrapped dump is well formed");
+  expect(records.size() == JOURNAL_RECORDS && records.back().code == JE_MODE &&
+         records.back().payload == JOURNAL_RECORDS + 4, "and ends with the newest record");
+}
+
+// A generator that never comes up is one start and one failure, however long it is
+// left switched in
+void genStartCounters() {
+  genLive = false;
+  boot(MANUAL, GRID);
+  command("gen");
+  run(60000);
+  expect(counters.genStarts == 1, "dead generator counts one start");
+  expect(counters.genStartFailures == 1, "dead generator counts one failure");
+
+  command("grid");
+  run(2000);
+  command("gen");
+  run(5000);
+  expect(counters.genStarts == 2, "switching it in again is a new start");
+  expect(counters.genStartFailures == 2, "and a new failure");
+
+  genLive = true;
+  command("grid");
+  run(2000);
+  command("gen");
+  run(5000);
+  expect(counters.genStarts == 3, "a good start is counted");
+  expect(counters.genStartFailures == 2, "and doesn't fail");
+}
+
+struct Chunk {
+  uint8_t source;
+  uint16_t total;
+  uint16_t offset;
+  std::string data;
+  bool crcOk;
+};
+
+// Pulls the xfer chunk frames out of the serial output
+std::vector<Chunk> chunks(const std::string &out) {
+  std::vector<Chunk> found;
+  for (size_t at = out.find("\xA5\x5A" "C"); at != std::string::npos;
+       at = out.find("\xA5\x5A" "C", at + 1)) {
+    const uint8_t *p = (const uint8_t *)out.data() + at + 2;
+    if (out.size() < at + 9 || out.size() < at + 9 + p[6] + 2) break;
+    uint16_t crc = 0xFFFF;
+    for (int i = 0; i < 7 + p[6]; i++) crc = crc16Update(crc, p[i]);
+    found.push_back({ p[1], (uint16_t)(p[2] | p[3] << 8), (uint16_t)(p[4] | p[5] << 8),
+                      std::string((const char *)p + 7, p[6]), (p[7 + p[6]] | p[8 + p[6]] << 8) == crc });
+  }
+  return found;
+}
+
+// Long enough for a window of chunks to leave the UART at 9600 baud
+const unsigned long XFER_WAIT = 300;
+
+// The journal comes over in CRC-checked chunks, at most four ahead of the last ack. A nak resends from
+// its offset at once, silence resends from the last ack, and after a dropped connection the transfer
+// resumes from the offset the client already has
+void xferResume() {
+  boot(MANUAL, GRID);
+  for (uint8_t i = 0; i < JOURNAL_RECORDS + 5; i++) journalAppend(JE_MODE, i);
+  std::string payload = command("journal_dump");
+  size_t at = payload.find("\xA5\x5A" "J");
+  expect(at != std::string::npos, "the journal dumps");
+  payload = at == std::string::npos ? "" : payload.substr(at + 5, JOURNAL_RECORDS * JOURNAL_RECORD_SIZE);
+  std::string received(payload.size(), '\0');
+
+  std::vector<Chunk> sent = chunks(command("xfer journal", XFER_WAIT));
+  expect(sent.size() == XFER_WINDOW, "a window of chunks goes out");
+  bool whole = true;
+  for (size_t i = 0; i < sent.size(); i++) {
+    whole &= sent[i].crcOk && sent[i].source == XFER_JOURNAL && sent[i].total == payload.size() &&
+             sent[i].offset == i * XFER_CHUNK_SIZE && sent[i].data.size() == XFER_CHUNK_SIZE;
+    if (sent[i].offset + sent[i].data.size() <= received.size()) {
+      received.replace(sent[i].offset, sent[i].data.size(), sent[i].data);
+    }
+  }
+  expect(whole, "in order, each with a good CRC");
+  expect(chunks(command("", XFER_WAIT)).empty(), "nothing more goes out without an ack");
+
+  sent = chunks(command("nak 48", XFER_WAIT));
+  expect(sent.size() == XFER_WINDOW && sent[0].offset == 48, "a nak resends a window from its offset");
+  run(2000);
+  sent = chunks(sim::takeSerialOutput());
+  expect(!sent.empty() && sent[0].offset == 48, "silence resends from the last ack");
+
+  // the connection drops after the first two chunks arrived
+  run(XFER_ABANDON_TIMEOUT);
+  expect(xferSource == XFER_NONE, "the transfer is given up without acks");
+  sent = chunks(command("xfer journal 96", XFER_WAIT));
+  expect(!sent.empty() && sent[0].offset == 96, "it resumes from the client's offset");
+  for (const Chunk &c : sent) {
+    if (c.crcOk && c.offset + c.data.size() <= received.size()) {
+      received.replace(c.offset, c.data.size(), c.data);
+    }
+  }
+  sim::takeSerialOutput();
+  command("ack " + std::to_string(payload.size()));
+  expect(xferSource == XFER_NONE, "the last ack ends the transfer");
+  expect(!payload.empty() && received == payload, "and the client holds the whole journal");
+}
+
+bool contains(const std::string &text, const char *part) { return text.find(part) != std::string::npos; }
+
+// `cfg` takes plain numbers within each key's range and leaves both the live and the saved
+// configuration alone when it turns a value away
+void configValidation() {
+  boot(MANUAL, GRID);
+  for (uint8_t i = 0; i < CFG_COUNT; i++) {
+    expect(configInRange(i, config[i]), "every default is within its range");
+  }
+
+  const char *const rejected[] = {
+    "cfg serial_update_interval 0", "cfg power_check_delay 0", "cfg load_check_delay 99",
+    "cfg alarm_duration abc", "cfg alarm_duration 5000x", "cfg alarm_duration -5", "cfg alarm_duration",
+    "cfg led_update_interval 99999999999", "cfg no_such_key 5",
+  };
+  configSave();
+  std::string saved;
+  for (int i = 0; i < 4 + CFG_COUNT * 2; i++) saved += (char)EEPROM.read(configAddress + i);
+  for (const char *line : rejected) {
+    if (!contains(command(std::string("@1 ") + line), "{\"ack\":1,\"st\":\"err\"}")) {
+      printf("  FAIL: accepted %s\n", line);
+      failures++;
+    }
+  }
+  expect(config[CFG_SERIAL_UPDATE_INTERVAL] == SERIAL_UPDATE_INTERVAL, "serial interval unchanged");
+  expect(config[CFG_ALARM_DURATION] == ALARM_DURATION, "alarm duration unchanged");
+  std::string now;
+  for (int i = 0; i < 4 + CFG_COUNT * 2; i++) now += (char)EEPROM.read(configAddress + i);
+  expect(now == saved, "nothing is saved");
+
+  expect(contains(command("cfg alarm_duration 7000"), "\"alarm_duration\":7000"), "a valid value is taken");
+
+  // a stored value from before the limits falls back to its default at the next boot
+  config[CFG_SERIAL_UPDATE_INTERVAL] = 0;
+  configSave();
+  configLoad();
+  expect(config[CFG_SERIAL_UPDATE_INTERVAL] == SERIAL_UPDATE_INTERVAL, "stored 0 falls back to default");
+  expect(config[CFG_ALARM_DURATION] == 7000, "the other values are kept");
+}
+
+// Powers the board up again on what is left in EEPROM and stops before the first loop pass
+void reboot() {
+  sim::reset();
+  setup();
+}
+
+// A configuration that stayed verified for SAFE_STATE_HOLD is back on the relays the moment setup()
+// is through, the mode logic waits a power check delay before it takes over and a saved mask that
+// does not match its complement is never driven
+void fastResume() {
+  boot(MANUAL, GRID);
+  run(config[CFG_POWER_CHECK_DELAY]);
+  uint8_t relays = outputLatch & RELAY_MASK;
+  expect(relays == 0x01, "manual grid closes the grid relay");
+  expect(readSafeRelays() == 0, "nothing is saved before the hold time");
+  run(SAFE_STATE_HOLD);
+  expect(readSafeRelays() == relays, "the verified configuration is saved");
+
+  reboot();
+  expect(sim::outputLevel(grid_relay) == HIGH, "setup closes the grid relay again");
+  expect(sim::outputLevel(generator_relay) == LOW, "and leaves the generator open");
+  expect(bootRevalidating, "the mode logic is held off");
+  run(config[CFG_POWER_CHECK_DELAY] + 100);
+  expect(!bootRevalidating && bootRevalidated, "the restored configuration checks out");
+  expect(contains(command("stats"), "\"boot_ok\":true"), "stats reports it");
+
+  // the grid went while the board was off: the relays still come back, but fail revalidation
+  gridLive = false;
+  reboot();
+  expect(sim::outputLevel(grid_relay) == HIGH, "the saved grid configuration is restored");
+  run(config[CFG_POWER_CHECK_DELAY] + 100);
+  expect(!bootRevalidating && !bootRevalidated, "and found dead at revalidation");
+  expect(contains(command("stats"), "\"boot_ok\":false"), "stats reports that too");
+  gridLive = true;
+
+  EEPROM.write(safeRelaysAddress + 1, 0);
+  reboot();
+  expect(sim::outputLevel(grid_relay) == LOW, "a corrupt saved mask leaves the relays open");
+  expect(!bootRevalidating, "and the mode logic starts at once");
+}
+
+// Framed requests are answered with their own sequence number and a typed status, data before the
+// acknowledgement, and several pipelined lines are handled in a single loop pass
+void framedCommands() {
+  boot(FULLY_AUTO, GRID);
+  expect(command("@7 gen") == "{\"ack\":7,\"st\":\"rej\"}\r\n", "gen is refused in automatic mode");
+  expect(contains(command("@8 bogus"), "{\"ack\":8,\"st\":\"err\"}"), "an unknown command is an error");
+  expect(contains(command("@x gen"), "{\"ack\":-1,\"st\":\"err\"}"), "so is a bad sequence number");
+  expect(contains(command("@65536 man"), "{\"ack\":-1,"), "and one out of range");
+  expect(currentMode == FULLY_AUTO, "none of them changed the mode");
+
+  std::string stats = command("@9 stats");
+  size_t data = stats.find("\"gen_starts\"");
+  size_t ack = stats.find("{\"ack\":9,\"st\":\"ok\"}");
+  expect(data != std::string::npos && ack != std::string::npos && data < ack, "stats comes before its ack");
+
+  std::string longLine = "@10 cfg alarm_duration 1000" + std::string(40, '0');
+  expect(contains(command(longLine), "{\"ack\":10,\"st\":\"err\"}"), "an overlong line is an error");
+  expect(config[CFG_ALARM_DURATION] == ALARM_DURATION, "and is not taken in part");
+
+  sim::takeSerialOutput();
+  sim::feedSerial("@11 man\n@12 gen\n@13 stop\n@14 grid\n");
+  senseInputs();
+  loop();
+  std::string out = sim::takeSerialOutput();
+  const char *const acks[] = { "{\"ack\":11,\"st\":\"ok\"}", "{\"ack\":12,\"st\":\"ok\"}",
+                               "{\"ack\":13,\"st\":\"ok\"}", "{\"ack\":14,\"st\":\"ok\"}" };
+  size_t at = 0;
+  for (const char *a : acks) {
+    at = out.find(a, at);
+    if (at == std::string::npos) break;
+  }
+  expect(at != std::string::npos, "four pipelined requests are acked in order in one pass");
+  expect(currentMode == MANUAL && currentControlMode == GRID, "and applied in order");
+}
+
+// Bluetooth module stand-in. An HC-05 answers AT commands with CRLF while its KEY pin is high and
+// takes a new rate at AT+RESET; an HC-06 answers bare commands at once. A module that is `stuck`
+// acknowledges a rate change but keeps its old rate.
+struct Module {
+  bool hc06 = false;
+  bool stuck = false;
+  unsigned long activeBaud = 9600;
+  unsigned long storedBaud = 9600;
+  std::string line;
+
+  void receive(const std::string &bytes) {
+    if ((!hc06 && sim::outputLevel(bt_key_pin) != HIGH) || sim::serialBaud() != activeBaud) {
+      return;  // data mode, or garbage at the wrong rate
+    }
+    if (hc06) {
+      line += bytes;  // commands end with a pause, here with the pass
+      if (line == "AT") {
+        sim::feedSerial("OK");
+      } else if (line.compare(0, 7, "AT+BAUD") == 0) {
+        const unsigned long rates[] = { 1200, 2400, 4800, 9600, 19200, 38400, 57600, 115200 };
+        unsigned long rate = rates[(line[7] - '1') & 7];
+        sim::feedSerial("OK" + std::to_string(rate));
+        if (!stuck) activeBaud = rate;
+      }
+      line.clear();
+      return;
+    }
+    for (char c : bytes) {
+      if (c != '\n') {
+        if (c != '\r') line += c;
+        continue;
+      }
+      if (line == "AT") {
+        sim::feedSerial("OK\r\n");
+      } else if (line.compare(0, 8, "AT+UART=") == 0) {
+        storedBaud = strtoul(line.c_str() + 8, nullptr, 10);
+        sim::feedSerial("OK\r\n");
+      } else if (line == "AT+RESET") {
+        sim::feedSerial("OK\r\n");
+        if (!stuck) activeBaud = storedBaud;
+      }
+      line.clear();
+    }
+  }
+};
+
+// Asks for `baud` over a framed request and runs until the outcome is reported. Returns the output
+// and the longest loop pass made while the negotiation ran.
+std::string negotiate(Module &module, unsigned long baud, unsigned long &longestPass) {
+  std::string out;
+  longestPass = 0;
+  sim::feedSerial("@5 link " + std::to_string(baud) + "\n");
+  unsigned long start = millis();
+  while (millis() - start < 10000 && out.find("{\"link\":") == std::string::npos) {
+    senseInputs();
+    bool negotiating = linkState != LINK_IDLE;
+    unsigned long before = micros();
+    loop();
+    if (negotiating && micros() - before > longestPass) longestPass = micros() - before;
+    std::string sent = sim::takeSerialOutput();
+    module.receive(sent);
+    out += sent;
+    sim::advanceMicros(1000);
+  }
+  return out;
+}
+
+// `link <baud>` moves an HC-05 or an HC-06 to a faster rate without a pass of the control loop
+// waiting on the UART, never changes the rate under bytes still being sent, puts a module that does
+// not follow back on its old rate, and renegotiates a stored rate at boot
+void linkNegotiation() {
+  boot(MANUAL, GRID);
+  Module module;
+  module.stuck = true;
+  unsigned long longest;
+  std::string out = negotiate(module, 115200, longest);
+  expect(contains(out, "{\"ack\":5,\"st\":\"ok\"}"), "the request is acked");
+  expect(contains(out, "{\"link\":9600,\"ok\":false}"), "a module stuck on its rate is a failure");
+  expect(sim::serialBaud() == 9600 && linkRate == 0, "and the link stays at 9600");
+  expect(EEPROM.read(linkRateAddress) == 0xFF, "nothing is stored");
+
+  module.stuck = false;
+  out = negotiate(module, 115200, longest);
+  expect(contains(out, "{\"link\":115200,\"ok\":true}"), "an HC-05 moves to 115200");
+  expect(sim::serialBaud() == 115200 && module.activeBaud == 115200, "with the UART");
+  expect(sim::serialGarbled() == 0, "no byte was cut off by a rate change");
+  expect(longest < 1000, "and no loop pass waited on the UART");
+  expect(sim::outputLevel(bt_key_pin) == LOW, "the module is back in data mode");
+
+  // after a reset the stored rate is checked before anything else is sent
+  sim::reset();
+  setup();
+  expect(sim::serialBaud() == 115200 && linkState != LINK_IDLE, "the stored rate is renegotiated at boot");
+  std::string renegotiated;
+  for (int i = 0; i < 1000 && linkState != LINK_IDLE; i++) {
+    loop();
+    std::string sent = sim::takeSerialOutput();
+    module.receive(sent);
+    renegotiated += sent;
+    sim::advanceMicros(1000);
+  }
+  expect(contains(renegotiated, "{\"link\":115200,\"ok\":true}"), "and confirmed");
+
+  // an HC-06 on a controller that has only seen an HC-05
+  EEPROM.write(linkRateAddress, 0xFF);
+  EEPROM.write(linkRateAddress + 1, 0xFF);
+  boot(MANUAL, GRID);
+  Module hc06;
+  hc06.hc06 = true;
+  out = negotiate(hc06, 57600, longest);
+  expect(contains(out, "{\"link\":57600,\"ok\":true}"), "an HC-06 is found and moved to 57600");
+  expect(sim::serialBaud() == 57600 && hc06.activeBaud == 57600, "with the UART");
+  expect(linkModule == LINK_HC06 && (EEPROM.read(linkRateAddress) & LINK_HC06_FLAG),
+         "and its type is stored with the rate");
+  expect(sim::serialGarbled() == 0 && longest < 1000, "without blocking or cut off bytes");
+}
+
+// Runs exactly one loop pass with `line` waiting and returns what it sent
+std::string onePass(const std::string &line) {
+  sim::takeSerialOutput();
+  sim::feedSerial(line + "\n");
+  senseInputs();
+  loop();
+  return sim::takeSerialOutput();
+}
+
+size_t occurrences(const std::string &text, const char *part) {
+  size_t n = 0;
+  for (size_t at = text.find(part); at != std::string::npos; at = text.find(part, at + 1)) n++;
+  return n;
+}
+
+// `batch` checks every word before it changes anything, then applies mode and source in the pass that
+// receives it: the relays follow both at once, with one journal record and one status frame
+void batchAtomicity() {
+  boot(FULLY_AUTO, GRID);
+  run(config[CFG_POWER_CHECK_DELAY]);
+  command("trace_on");
+  uint8_t seq = journalSeq;
+  const char *const refused[] = { "@1 batch man bogus", "@1 batch man semi", "@1 batch gen grid", "@1 batch " };
+  for (const char *line : refused) {
+    if (!contains(command(line), "{\"ack\":1,\"st\":\"err\"}")) {
+      printf("  FAIL: accepted %s\n", line);
+      failures++;
+    }
+  }
+  expect(contains(command("@2 batch auto gen"), "{\"ack\":2,\"st\":\"rej\"}"), "auto with a source is refused");
+  expect(currentMode == FULLY_AUTO && currentControlMode == GRID && journalSeq == seq, "nothing changed");
+
+  while (millis() - lastSerialUpdateTime < 100) run(1);  // away from the periodic status frame
+  // bare, as the trace replays it: an ack would be part of the pass's serial time
+  std::string out = onePass("batch man gen");
+  expect(currentMode == MANUAL && currentControlMode == GEN, "both changes are in place");
+  expect(EEPROM.read(modeAddress) == MANUAL && EEPROM.read(controlModeAddress) == GEN, "and saved");
+  expect(sim::outputLevel(generator_relay) == HIGH || relayPending == RELAY_GEN, "the mode logic ran on the new source");
+  expect(journalSeq == (seq + 1) % JOURNAL_SEQ_MODULO, "one journal record");
+  expect(occurrences(out, "\"manual\"") == 1, "one status frame");
+
+  run(3000);
+  expect(replay(command("trace_dump"), "") == 0, "the batch replays from the trace");
+}
+
+// Once a client subscribes, each field goes out at its own period instead of the LED frame, fields that
+// fall due together share a frame, and a `sub` with a bad word changes nothing
+void subScheduling() {
+  boot(MANUAL, GRID);
+  sim::takeSerialOutput();
+  run(2000);
+  expect(occurrences(sim::takeSerialOutput(), "\"load_fail\"") == 4, "the LED frame until a client subscribes");
+
+  expect(contains(command("@1 sub grid_on=500 relays=1000 uptime_s=150"), "\"st\":\"ok\""), "sub is taken");
+  std::string table = command("sub");
+  expect(contains(table, "{\"sub\":true,\"grid_on\":500,\"relays\":1000,\"uptime_s\":200}"),
+         "periods are rounded up to whole ticks");
+  const char *const refused[] = { "@2 sub bogus=100", "@2 sub grid_on=25600", "@2 sub grid_on",
+                                  "@2 sub relays=0 bogus=5", "@2 sub a=1 b=1 c=1 d=1 e=1 f=1 g=1 h=1 i=1" };
+  for (const char *line : refused) {
+    if (!contains(command(line), "{\"ack\":2,\"st\":\"err\"}")) {
+      printf("  FAIL: accepted %s\n", line);
+      failures++;
+    }
+  }
+  expect(command("sub") == table, "and leave the table as it was");
+
+  command("sub uptime_s=0");
+  sim::takeSerialOutput();
+  run(3000);
+  std::string out = sim::takeSerialOutput();
+  expect(occurrences(out, "\"load_fail\"") == 0 && occurrences(out, "uptime_s") == 0, "only what is subscribed");
+  expect(occurrences(out, "\"grid_on\"") == 6, "grid_on every 500 ms");
+  expect(occurrences(out, "\"relays\"") == 3, "relays every 1000 ms");
+  expect(occurrences(out, "{\"grid_on\":true,\"relays\":1}") == 3, "in the same frame when both are due");
+
+  command("sub off");
+  sim::takeSerialOutput();
+  run(2000);
+  expect(sim::takeSerialOutput().empty(), "sub off stops telemetry");
+  command("sub default");
+  sim::takeSerialOutput();
+  run(2000);
+  expect(occurrences(sim::takeSerialOutput(), "\"load_fail\"") == 4, "sub default brings the LED frame back");
+}
+
+// Sense input model for the waveform stream: the ADC free-runs at F_CPU / 128 / 13 and the samples
+// between passes reach the interrupt handler at their own micros(). Passes are `stepUs` apart.
+const double WAVE_SAMPLE_RATE = F_CPU / 128.0 / 13.0;
+double wavePhase = 0;
+double waveHz = 50;
+double waveAmplitude = 300;
+unsigned long long waveSampled = 0;  // samples taken so far
+
+void waveRun(unsigned long ms, unsigned long stepUs = 1000) {
+  unsigned long end = millis() + ms;
+  while ((long)(millis() - end) < 0) {
+    senseInputs();
+    loop();
+    unsigned long long passEnd = (unsigned long long)micros() + stepUs;
+    unsigned long long due = (unsigned long long)(passEnd * WAVE_SAMPLE_RATE / 1e6);
+    for (; waveSampled < due; waveSampled++) {
+      unsigned long long at = (unsigned long long)((waveSampled + 1) / WAVE_SAMPLE_RATE * 1e6);
+      if (at > micros()) sim::advanceMicros(at - micros());
+      wavePhase += 2 * M_PI * waveHz / WAVE_SAMPLE_RATE;
+      waveSample(512 + (int16_t)lround(waveAmplitude * sin(wavePhase)));
+    }
+    if (passEnd > micros()) sim::advanceMicros(passEnd - micros());
+  }
+}
+
+struct WaveBlock {
+  size_t size;
+  uint8_t decimation;
+  std::vector<uint16_t> rms, chz;
+};
+
+// Decodes the waveform frames in the serial output; a frame with a bad CRC ends the list
+std::vector<WaveBlock> waveBlocks(const std::string &out) {
+  std::vector<WaveBlock> found;
+  for (size_t at = out.find("\xA5\x5A" "W"); at != std::string::npos; at = out.find("\xA5\x5A" "W", at + 1)) {
+    const uint8_t *p = (const uint8_t *)out.data() + at + 2;
+    if (out.size() < at + 12 || out.size() < at + 14 + p[9]) break;
+    uint16_t crc = 0xFFFF;
+    for (int i = 0; i < 10 + p[9]; i++) crc = crc16Update(crc, p[i]);
+    if ((p[10 + p[9]] | p[11 + p[9]] << 8) != crc) break;
+    WaveBlock b;
+    b.size = 14 + p[9];
+    b.decimation = p[3];
+    b.rms.push_back(p[5] | p[6] << 8);
+    b.chz.push_back(p[7] | p[8] << 8);
+    const uint8_t *d = p + 10;
+    for (int i = 1; i < p[4]; i++) {
+      int32_t delta[2];
+      for (int32_t &v : delta) {
+        uint32_t zigzag = 0;
+        for (int shift = 0;; shift += 7) {
+          zigzag |= (uint32_t)(*d & 0x7F) << shift;
+          if (!(*d++ & 0x80)) break;
+        }
+        v = (int32_t)(zigzag >> 1) ^ -(int32_t)(zigzag & 1);
+      }
+      b.rms.push_back(b.rms.back() + delta[0]);
+      b.chz.push_back(b.chz.back() + delta[1]);
+    }
+    found.push_back(b);
+  }
+  return found;
+}
+
+// A generator hunting around 50 Hz streams one RMS and frequency value per cycle that decode to what it
+// did, a stall shows as 0 Hz cycles, and a loop that falls behind makes the stream decimate instead of
+// holding the loop up, coming back to every cycle once it keeps up again
+void streamDecimation() {
+  boot(MANUAL, GEN);
+  command("stream gen");
+  sim::takeSerialOutput();
+  bool tracked = true;
+  for (int i = 0; i < 20; i++) {
+    waveHz = 49 + (i % 4) * 0.5;  // 200 ms at each of 49, 49.5, 50 and 50.5 Hz
+    waveRun(200);
+  }
+  std::string out = sim::takeSerialOutput();
+  std::vector<WaveBlock> blocks = waveBlocks(out);
+  expect(blocks.size() >= 8, "cycles come in blocks");
+  size_t cycles = 0, bytes = 0;
+  uint16_t lowest = 0xFFFF, highest = 0;
+  for (const WaveBlock &b : blocks) {
+    bytes += b.size;
+    for (size_t i = 0; i < b.chz.size(); i++) {
+      cycles++;
+      lowest = b.chz[i] < lowest ? b.chz[i] : lowest;
+      highest = b.chz[i] > highest ? b.chz[i] : highest;
+      uint16_t rms = lround(waveAmplitude / sqrt(2) * 16);
+      tracked &= b.rms[i] > rms - 16 && b.rms[i] < rms + 16;
+    }
+  }
+  expect(tracked, "the RMS stays within a count");
+  expect(lowest >= 4890 && lowest <= 4910 && highest >= 5040 && highest <= 5060, "the frequency follows the hunt");
+  expect(cycles >= 8 * (blocks.size() - 1) && blocks[0].decimation == 1, "every cycle is sent");
+  expect(bytes < 4 * cycles, "at under 4 bytes per cycle");
+
+  waveAmplitude = 0;  // the generator stalls
+  waveRun(300);
+  blocks = waveBlocks(sim::takeSerialOutput());
+  expect(!blocks.empty() && blocks.back().chz.back() == 0, "a stall shows as 0 Hz cycles");
+  waveAmplitude = 300;
+  waveRun(500);
+
+  // a pass that takes 300 ms leaves more cycles than the ring holds
+  sim::takeSerialOutput();
+  sim::advanceMicros(300000);
+  waveRun(400);
+  blocks = waveBlocks(sim::takeSerialOutput());
+  expect(!blocks.empty() && blocks.back().decimation == 2, "a full ring doubles the decimation");
+  waveRun(8000);
+  blocks = waveBlocks(sim::takeSerialOutput());
+  expect(!blocks.empty() && blocks.back().decimation == 1, "and it comes back down");
+  command("stream off");
+  expect(waveChannel == WAVE_OFF, "stream off stops it");
+}
+
+// `time` sets the wall clock on top of the uptime, the journal anchors it with a JE_CLOCK record when
+// it is set or corrected by more than a couple of seconds, and a gap too long for a record's dt is
+// preceded by a fresh anchor, so every record after the first one has an absolute time
+void timeSync() {
+  boot(MANUAL, GRID);
+  expect(contains(command("time"), "{\"time\":0,"), "the clock is unset after boot");
+  expect(contains(command("@1 time 12345"), "\"st\":\"err\""), "a time before 2001 is refused");
+  expect(contains(command("@1 time 1700000000x"), "\"st\":\"err\""), "and so is garbage");
+
+  const uint32_t T = 1700000000;
+  uint8_t seq = journalSeq;
+  command("time 1700000000");
+  expect(journalSeq == (seq + 1) % JOURNAL_SEQ_MODULO, "setting the clock is anchored in the journal");
+  run(5000);
+  expect(clockNow() == T + 5, "the clock counts on with the uptime");
+  expect(contains(command("stats"), "\"time\":1700000005"), "stats reports it");
+  command("time 1700000007");
+  expect(journalSeq == (seq + 1) % JOURNAL_SEQ_MODULO && clockNow() == T + 7, "a small correction isn't");
+  command("time 1700000100");
+  expect(journalSeq == (seq + 2) % JOURNAL_SEQ_MODULO, "a larger one is");
+
+  // nothing happens for 20 hours, longer than a record's dt can hold
+  sim::advanceMicros(20UL * 3600 * 1000000);
+  run(10);
+  uint32_t before = clockNow();
+  journalAppend(JE_MODE, 1);
+  std::vector<JournalRecord> records;
+  expect(journalFrame(command("journal_dump"), records) && records.size() >= 2, "the journal dumps");
+  size_t n = records.size();
+  expect(n >= 2 && records[n - 2].code == JE_CLOCK && records[n - 1].code == JE_MODE, "the gap is anchored");
+  uint32_t anchor = n >= 2 ? (uint32_t)records[n - 2].dt << 16 | records[n - 2].payload : 0;
+  expect(anchor == before && records[n - 1].dt == 0, "and the record after it has its absolute time");
+}
+
+// Runs until the transfer state machine reaches `state`, at most `ms`; returns how long it took
+unsigned long runUntil(TransferState state, unsigned long ms) {
+  unsigned long start = millis();
+  while (transferState != state && millis() - start < ms) run(1);
+  return millis() - start;
+}
+
+// In automatic mode a grid outage starts the generator, which carries the load only after its warm-up,
+// while commands keep being answered. A generator that drops out sounds the alarm and is retried after
+// GEN_RETRY_DELAY; when the grid comes back the load returns to it. With a run output the generator then
+// cools down for cool_down_s, without one it stops at once.
+void warmUpCoolDown() {
+  boot(FULLY_AUTO, GRID);
+  command("cfg warm_up_s 5");
+  runUntil(TS_GRID, 5000);
+  expect(transferState == TS_GRID && (outputLatch & RELAY_MASK) == 0x05, "the load starts on the grid");
+
+  gridLive = false;
+  runUntil(TS_WARM_UP, 5000);
+  expect(transferState == TS_WARM_UP && genRunning(), "the generator starts");
+  expect(sim::outputLevel(load_relay) == LOW && sim::outputLevel(grid_relay) == LOW, "unloaded");
+  expect(contains(command("@1 stats"), "{\"ack\":1,\"st\":\"ok\"}"), "commands are answered meanwhile");
+  unsigned long warm = runUntil(TS_GEN, 10000);
+  expect(transferState == TS_GEN && sim::outputLevel(load_relay) == HIGH, "the load goes on after the warm-up");
+  expect(warm > 4500 && warm < 5100, "which takes warm_up_s");
+
+  genLive = false;  // the set dies under load
+  run(100);
+  expect(transferState == TS_GEN_FAILED && alarmActive && sim::outputLevel(load_relay) == LOW,
+         "a generator that drops out sounds the alarm and sheds the load");
+  genLive = true;
+  unsigned long retry = runUntil(TS_WARM_UP, GEN_RETRY_DELAY + 2000);
+  expect(transferState == TS_WARM_UP && retry > GEN_RETRY_DELAY - 200, "and is retried after the delay");
+  runUntil(TS_GEN, 10000);
+
+  gridLive = true;
+  runUntil(TS_GRID, config[CFG_RETRANSFER_TIME] * 1000UL + 10000);
+  run(200);  // the grid relay closes a dead time after the generator relay opens
+  expect(transferState == TS_GRID && (outputLatch & RELAY_MASK) == 0x05, "the load goes back to the grid");
+  if (gen_run_pin != NO_PIN) {
+    run(config[CFG_COOL_DOWN_TIME] * 1000UL - 5000);  // counted from the relay transfer
+    expect(genCooling && genRunning(), "the generator cools down unloaded");
+    run(5000);
+  }
+  expect(!genCooling && !genRunning(), "and then stops");
+}
+
+// Once the generator carries the load, the grid has to stay good for retransfer_s before the load goes
+// back; a grid that drops again inside the window is counted as an aborted retransfer. A grid band that
+// would close once its margins are taken off is refused, live and from EEPROM.
+void retransferHysteresis() {
+  boot(FULLY_AUTO, GRID);
+  command("cfg warm_up_s 0");
+  command("cfg retransfer_s 10");
+  runUntil(TS_GRID, 5000);
+  gridLive = false;
+  runUntil(TS_GEN, 10000);
+  expect(transferState == TS_GEN, "the generator takes the load");
+
+  gridLive = true;
+  run(3000);
+  gridLive = false;
+  run(1000);
+  expect(transferState == TS_GEN, "a grid back for less than retransfer_s leaves the load alone");
+  expect(counters.retransferAborts == 1, "and counts one aborted retransfer");
+
+  gridLive = true;
+  unsigned long back = runUntil(TS_GRID, 20000);
+  run(200);
+  expect(transferState == TS_GRID && (outputLatch & RELAY_MASK) == 0x05, "a stable grid takes the load back");
+  expect(back >= 10000 && back < 12000, "after retransfer_s");
+  expect(counters.retransferAborts == 1, "without another abort");
+
+  const char *const closing[] = { "cfg grid_v_hyst 40", "cfg grid_v_max 200", "cfg grid_f_min 520" };
+  for (const char *line : closing) {
+    if (!contains(command(std::string("@1 ") + line), "{\"ack\":1,\"st\":\"err\"}")) {
+      printf("  FAIL: accepted %s\n", line);
+      failures++;
+    }
+  }
+  expect(config[CFG_GRID_V_HYST] == GRID_V_HYST && config[CFG_GRID_V_MAX] == GRID_V_MAX &&
+         config[CFG_GRID_F_MIN] == GRID_F_MIN, "a closed band is not taken");
+  expect(contains(command("cfg grid_v_hyst 20"), "\"grid_v_hyst\":20"), "an open one is");
+
+  config[CFG_GRID_F_HYST] = 30;  // in range, but 475 + 60 is past 525
+  configSave();
+  configLoad();
+  expect(config[CFG_GRID_F_HYST] == GRID_F_HYST && config[CFG_GRID_V_HYST] == GRID_V_HYST &&
+         config[CFG_RETRANSFER_TIME] == RETRANSFER_TIME, "a stored closed band falls back to the defaults");
+}
+
+// On the generator the extra circuits come on one at a time after their reconnect delays. Above
+// shed_pct the highest priority number is shed first, one circuit per LOAD_SHED_SETTLE; between the
+// thresholds nothing moves, and below restore_pct the circuits return in priority order. On the grid
+// the generator load isn't measured and nothing is shed. Thresholds that cross are refused.
+void loadShedding() {
+  boot(FULLY_AUTO, GRID);
+  command("cfg assist_pct 0");  // one unit carries it all
+  command("cfg soft_pct 0");    // by the reconnect delays; soft_start steps on the voltage
+  command("cfg warm_up_s 0");
+  command("cfg retransfer_s 5");
+  runUntil(TS_GRID, 5000);
+  gridLive = false;
+  runUntil(TS_GEN, 10000);
+  expect(transferState == TS_GEN && sim::outputLevel(load_relay) == HIGH, "the generator carries the load");
+  expect(loadsOn == 0, "the extra circuits start open");
+  run(5100);
+  expect(loadsOn == 0x02, "the first follows after its delay");
+  run(20000);
+  expect(loadsOn == 0x0E, "and the others one at a time");
+
+  sim::setAnalog(gen_load_sense, 1000);  // 97 %, the filtered load crosses shed_pct in about 2 s
+  run(2500);
+  expect(loadsOn == 0x06 && sim::outputLevel(loadChannels[3].pin) == LOW, "overload sheds the last priority");
+  run(LOAD_SHED_SETTLE);
+  expect(loadsOn == 0x02, "then the next, one per settle time");
+  run(LOAD_SHED_SETTLE * 2);
+  expect(loadsOn == 0 && sim::outputLevel(load_relay) == HIGH, "down to the main circuit, which is never shed");
+
+  sim::setAnalog(gen_load_sense, 800);  // 78 %, between the thresholds
+  run(20000);
+  expect(loadsOn == 0, "between the thresholds nothing moves");
+
+  sim::setAnalog(gen_load_sense, 400);
+  run(7000);
+  expect(loadsOn == 0x02, "below restore_pct the first priority returns first");
+  run(5000);
+  expect(loadsOn == 0x06, "then the next");
+  run(10000);
+  expect(loadsOn == 0x0E, "and the last after its longer delay");
+
+  gridLive = true;
+  runUntil(TS_GRID, 10000);
+  sim::setAnalog(gen_load_sense, 1023);
+  run(30000);
+  expect(!(outputLatch & 0x02) && genLoad == 0, "on the grid the generator load isn't measured");
+  expect(loadsOn == 0x0E, "and nothing is shed");
+
+  const char *const crossing[] = { "cfg restore_pct 90", "cfg shed_pct 60" };
+  for (const char *line : crossing) {
+    if (!contains(command(std::string("@1 ") + line), "{\"ack\":1,\"st\":\"err\"}")) {
+      printf("  FAIL: accepted %s\n", line);
+      failures++;
+    }
+  }
+  expect(config[CFG_SHED_LEVEL] == SHED_LEVEL && config[CFG_RESTORE_LEVEL] == RESTORE_LEVEL,
+         "crossed thresholds are not taken");
+}
+
+// Drops the grid for `ms`, too short for the transfer to act on, and brings it back
+void flicker(unsigned long ms) {
+  gridLive = false;
+  run(ms);
+  gridLive = true;
+  run(1000);
+}
+
+// Each sag raises the outage risk; at prestart_pct the generator starts unloaded while the grid keeps
+// the load, and as the risk decays it cools down and stops again. A grid loss with a warmed-up
+// generator standing by moves the load within a fraction of a second, and the outage lands in the
+// hour's histogram bucket.
+void preStart() {
+  boot(FULLY_AUTO, GRID);
+  command("cfg warm_up_s 10");
+  command("cfg cool_down_s 20");
+  command("cfg serial_update_interval 60000");  // a status line would stretch a 50 ms flicker
+  command("time 1700000000");
+  runUntil(TS_GRID, 5000);
+
+  for (int i = 0; i < 3; i++) flicker(50);
+  expect(riskLevel() == 60 && !genPrestart, "three sags stay below prestart_pct");
+  flicker(50);
+  expect(riskLevel() >= config[CFG_PRESTART_LEVEL] && genPrestart, "the fourth pre-starts the generator");
+  expect(sim::outputLevel(gen_run_pin) == HIGH && transferState == TS_GRID &&
+         (outputLatch & RELAY_MASK) == 0x05, "which runs unloaded while the grid keeps the load");
+  expect(counters.genStarts == 1, "as one start");
+
+  unsigned long start = millis();
+  while (genPrestart && millis() - start < 5 * RISK_DECAY_INTERVAL) run(1);
+  expect(riskLevel() + PRESTART_HYSTERESIS < config[CFG_PRESTART_LEVEL], "the risk decays over minutes");
+  expect(!genPrestart && genCooling && sim::outputLevel(gen_run_pin) == HIGH, "then the generator cools down");
+  run(config[CFG_COOL_DOWN_TIME] * 1000UL + 500);
+  expect(!genCooling && sim::outputLevel(gen_run_pin) == LOW, "and stops");
+
+  for (int i = 0; i < 3; i++) flicker(50);
+  expect(genPrestart && counters.genStarts == 2, "new sags pre-start it again");
+  run(config[CFG_WARM_UP_TIME] * 1000UL);
+  gridLive = false;
+  unsigned long moved = runUntil(TS_GEN, 10000);
+  expect(transferState == TS_GEN && sim::outputLevel(load_relay) == HIGH, "a grid loss moves the load to it");
+  expect(moved < config[CFG_POWER_CHECK_DELAY], "without waiting for the power check or the warm-up");
+  expect(counters.genStarts == 2, "and without another start");
+  run(config[CFG_POWER_CHECK_DELAY]);
+  expect(riskHours[clockNow() / 3600 % 24] == RISK_OUTAGE_STEP, "the outage is counted in its hour");
+}
+
+// A generator-to-grid retransfer keeps the load connected. The grid relay's close goes out the
+// generator relay's dropout plus dead_time_ms less the grid relay's pickup after the generator relay
+// opens, the contacts never overlap, and the dark gap on load_check measures both relay times. A
+// measured dropout shorter than the estimate moves it a quarter, a shorter pickup is taken at once,
+// and a transfer with no gap lengthens the dropout. Seeded times survive a reboot.
+void relayTiming() {
+  contacts[RELAY_GRID].pickupUs = 8000;
+  contacts[RELAY_GRID].dropoutUs = 12000;
+  contacts[RELAY_GEN].pickupUs = 15000;
+  contacts[RELAY_GEN].dropoutUs = 30000;
+  boot(FULLY_AUTO, GRID);
+  command("cfg warm_up_s 0");
+  command("cfg retransfer_s 5");
+  // the host fires delayed closes and polls load_check from the loop: keep the status frames, which
+  // hold a pass up on the UART, out of the transfers
+  command("cfg serial_update_interval 60000");
+  command("cfg zc_sync 0");  // the dead time alone; closes on a crossing are in zc_sync
+  expect(contains(command("timing"), "\"grid_pickup_ms\":20,\"grid_dropout_ms\":50"), "timing starts conservative");
+  expect(contains(command("timing"), "\"measure\":true"), "and transfers are measured");
+  runUntil(TS_GRID, 5000);
+
+  for (int transfer = 0; transfer < 2; transfer++) {
+    gridLive = false;
+    runUntil(TS_GEN, 10000);
+    run(1000);
+    unsigned long wait = (relayDropout[RELAY_GEN] + config[CFG_DEAD_TIME] - relayPickup[RELAY_GRID]) * 1000UL;
+    uint8_t dropout = relayDropout[RELAY_GEN];
+    gridLive = true;
+    runUntil(TS_GRID, 10000);
+    run(200);
+    long scheduled = (long)(contacts[RELAY_GRID].coilSince - contacts[RELAY_GEN].coilSince) - (long)wait;
+    expect(scheduled >= 0 && scheduled <= 2000, "the close goes out after dropout + dead time - pickup");
+    expect(sim::outputLevel(load_relay) == HIGH, "the load stays connected across the transfer");
+    run(1500);
+    expect(lastDarkUs >= config[CFG_DEAD_TIME] * 1000UL, "the contacts part at least the dead time");
+    expect(abs((long)relayLastGap * 1000 - (long)lastDarkUs) <= 2000, "and the gap is measured");
+    // the loop polls load_check here, so the readings run up to two passes long
+    expect(relayPickup[RELAY_GRID] >= 8 && relayPickup[RELAY_GRID] <= 10, "a shorter pickup is taken at once");
+    expect(relayDropout[RELAY_GEN] >= (dropout * 3 + 30) / 4 && relayDropout[RELAY_GEN] <= (dropout * 3 + 32) / 4,
+           "a shorter dropout moves a quarter");
+  }
+  expect(!contactsOverlapped, "the source contacts never close together");
+
+  contacts[RELAY_GEN].dropoutUs = 80000;  // slower than the estimate: the contacts overlap
+  gridLive = false;
+  runUntil(TS_GEN, 10000);
+  run(1000);
+  uint8_t dropout = relayDropout[RELAY_GEN];
+  gridLive = true;
+  runUntil(TS_GRID, 10000);
+  run(1500);
+  expect(contactsOverlapped && relayLastGap == 0, "a transfer with no gap is seen as one");
+  expect(relayDropout[RELAY_GEN] == dropout + RELAY_DROPOUT_STEP, "and lengthens the dropout");
+
+  expect(contains(command("@1 timing gen 12 90"), "{\"ack\":1,\"st\":\"ok\"}"), "timing can be seeded");
+  expect(contains(command("@1 timing gen 12 300"), "{\"ack\":1,\"st\":\"err\"}"), "within 255 ms");
+  reboot();
+  expect(relayPickup[RELAY_GEN] == 12 && relayDropout[RELAY_GEN] == 90, "seeded times survive a reboot");
+}
+
+// Semi-auto runs the automatic sequence but proposes each move of the load and waits for an answer:
+// `confirm`, a short select press, or confirm_apply once confirm_s has passed. A denied proposal is
+// held off until its reason clears, one whose reason goes away is withdrawn. The transfer logic picks
+// the source, so source commands, source batches and the select button's source cycling are turned
+// away, and a traced `batch semi` replays without a source.
+void semiAuto() {
+  boot(SEMI_AUTO, GRID);
+  run(3000);
+  expect((outputLatch & RELAY_MASK) == 0x05, "semi-auto puts the load on the grid");
+  expect(contains(command("@1 stop"), "{\"ack\":1,\"st\":\"rej\"}"), "stop is rejected");
+  expect(contains(command("@2 gen"), "{\"ack\":2,\"st\":\"rej\"}"), "gen is rejected");
+  expect(contains(command("@3 grid"), "{\"ack\":3,\"st\":\"rej\"}"), "grid is rejected");
+  expect(contains(command("@4 batch semi stop"), "{\"ack\":4,\"st\":\"rej\"}"), "a source batch is rejected");
+  expect(contains(command("@5 confirm"), "{\"ack\":5,\"st\":\"rej\"}"), "there is nothing to confirm");
+  sim::setInput(select_button, HIGH);
+  run(200);
+  sim::setInput(select_button, LOW);
+  run(5000);
+  expect(currentControlMode == GRID && (outputLatch & RELAY_MASK) == 0x05, "the select button doesn't cycle the source");
+
+  command("cfg warm_up_s 0");
+  command("cfg retransfer_s 5");
+  command("cfg confirm_s 20");
+  gridLive = false;
+  sim::takeSerialOutput();
+  run(1500);
+  expect(contains(sim::takeSerialOutput(), "{\"proposal\":\"gen\",\"timeout_s\":20,\"on_timeout\":\"apply\"}"),
+         "a grid loss is proposed");
+  expect(transferState == TS_GRID, "and the load waits for an answer");
+  uint8_t seq = journalSeq;
+  expect(contains(command("@6 confirm"), "{\"proposal\":\"gen\",\"result\":\"confirmed\"}"), "confirm answers it");
+  expect(journalSeq == (seq + 1) % JOURNAL_SEQ_MODULO, "and is journaled");
+  runUntil(TS_GEN, 5000);
+  expect(transferState == TS_GEN, "then the generator takes the load");
+
+  gridLive = true;
+  run(6000);
+  expect(proposal == PROPOSE_GRID, "a stable grid proposes the return");
+  sim::setInput(select_button, HIGH);
+  run(CONFIRM_HOLD + 200);
+  sim::setInput(select_button, LOW);
+  run(200);
+  expect(proposal == PROPOSE_NONE && proposalDenied == PROPOSE_GRID, "holding the select button denies it");
+  run(30000);
+  expect(transferState == TS_GEN && proposal == PROPOSE_NONE, "a denied move isn't raised again");
+  flicker(50);  // the reason clears and comes back
+  run(6000);
+  expect(proposal == PROPOSE_GRID, "until its reason has gone away and come back");
+  std::string out;
+  for (int i = 0; i < 25 && transferState != TS_GRID; i++) {
+    run(1000);
+    out += sim::takeSerialOutput();
+  }
+  expect(contains(out, "\"result\":\"applied\"") && transferState == TS_GRID, "unanswered, it is applied after confirm_s");
+
+  run(3000);
+  gridLive = false;
+  run(1500);
+  expect(proposal == PROPOSE_GEN, "the next loss is proposed");
+  gridLive = true;
+  sim::takeSerialOutput();
+  run(200);
+  expect(contains(sim::takeSerialOutput(), "\"result\":\"withdrawn\"") && proposal == PROPOSE_NONE,
+         "and withdrawn when the grid returns");
+
+  command("cfg confirm_apply 0");
+  gridLive = false;
+  run(1500);
+  sim::takeSerialOutput();
+  run(config[CFG_CONFIRM_TIME] * 1000UL);
+  expect(contains(sim::takeSerialOutput(), "\"result\":\"aborted\"") && transferState == TS_GRID,
+         "with confirm_apply 0 an unanswered proposal is dropped");
+  gridLive = true;
+  run(3000);
+
+  command("trace_on");
+  while (millis() - lastSerialUpdateTime < 100) run(1);
+  onePass("batch auto");
+  run(1000);
+  onePass("batch semi");
+  run(1000);
+  gridLive = false;  // semi-auto holds the load for an answer where automatic mode would move it
+  run(3000);
+  gridLive = true;
+  run(1000);
+  expect(replay(command("trace_dump"), "") == 0, "a traced semi batch replays without a source");
+
+  expect(contains(command("@7 man"), "{\"ack\":7,\"st\":\"ok\"}"), "manual mode is accepted");
+  expect(contains(command("@8 stop"), "{\"ack\":8,\"st\":\"ok\"}"), "and takes stop");
+  run(1000);
+  expect((outputLatch & RELAY_MASK) == 0, "stop opens the relays in manual mode");
+}
+
+// The unit with fewer run hours leads. At assist_pct another one is started and closed onto the bus,
+// and once the load has been low for a minute the unit with more hours is taken off and cools down.
+// A lead that drops out fails the bus and is skipped on the retry, and each unit's run time is
+// reported and kept across a reboot.
+void unitRotation() {
+  const uint8_t second = GEN_COUNT - 1;
+  boot(FULLY_AUTO, GRID);
+  command("cfg warm_up_s 0");
+  command("cfg cool_down_s 10");
+  command("cfg assist_pct 40");
+  sim::setAnalog(gen_load_sense, 205);  // 20 % of one unit
+  unitRunSeconds[0] = 1000;
+  unitRunSeconds[second] = 10;
+  runUntil(TS_GRID, 5000);
+  gridLive = false;
+  runUntil(TS_GEN, 10000);
+  run(200);
+  expect(transferState == TS_GEN && unitsOnline == 0x02, "the unit with fewer hours leads");
+  expect(sim::outputLevel(genUnits[second].breaker) == HIGH && sim::outputLevel(genUnits[0].run) == LOW,
+         "on its own breaker, with the other one stopped");
+
+  unsigned long starts = counters.genStarts;
+  sim::setAnalog(gen_load_sense, 512);  // 50 %: more than 40 % of one unit
+  run(5000);
+  expect(unitsOnline == 0x03 && counters.genStarts == starts + 1, "at assist_pct the other one assists");
+  sim::setAnalog(gen_load_sense, 307);  // 30 %: one unit could carry it, but not 20 points under
+  run(ASSIST_HOLD + 5000);
+  expect(unitsOnline == 0x03, "a load just under one unit's share keeps both");
+  sim::setAnalog(gen_load_sense, 102);  // 10 %
+  run(ASSIST_HOLD - 5000);
+  expect(unitsOnline == 0x03, "a low load keeps both for a while");
+  run(10000);
+  expect(unitsOnline == 0x02 && sim::outputLevel(genUnits[0].breaker) == LOW
+           && sim::outputLevel(genUnits[0].run) == HIGH, "then the one with more hours comes off and cools down");
+  run(config[CFG_COOL_DOWN_TIME] * 1000UL);
+  expect(sim::outputLevel(genUnits[0].run) == LOW, "and stops");
+
+  unitDead[second] = true;  // the lead drops out on its own
+  run(100);
+  expect(transferState == TS_GEN_FAILED && (unitsFailed & 0x02), "a unit that drops out fails the bus");
+  runUntil(TS_GEN, GEN_RETRY_DELAY + 10000);
+  run(200);
+  expect(transferState == TS_GEN && unitsOnline == 0x01 && sim::outputLevel(genUnits[second].run) == LOW,
+         "and the retry skips it for the other one");
+
+  std::string stats = command("stats");
+  expect(contains(stats, "\"unit0_run_s\":") && contains(stats, "\"unit1_run_s\":"), "stats reports each unit");
+  uint32_t hours0 = unitRunSeconds[0], hours1 = unitRunSeconds[second];
+  expect(hours0 > 1000 && hours1 > 10 + 60, "and counts their run time");
+  run(COUNTER_CHECKPOINT_INTERVAL);
+  reboot();
+  expect(unitRunSeconds[0] >= hours0 && unitRunSeconds[second] == hours1, "which survives a reboot");
+}
+
+// The watchdog is fed at the end of every healthy pass, and not while a pass skips the mode logic,
+// here for a corrupted mode; the reset counts and cause come with `stats` and can be subscribed
+void watchdog() {
+  boot(MANUAL, GRID);
+  run(1000);
+  expect(millis() - watchdogFedAt < 5, "a healthy pass feeds the watchdog");
+  std::string stats = command("stats");
+  expect(contains(stats, "\"wdt_resets\":0,\"bor_resets\":0,\"reset_cause\":1"), "stats reports the resets");
+
+  currentMode = (Mode)7;
+  run(500);
+  expect(millis() - watchdogFedAt >= 495, "a pass without mode logic doesn't");
+  currentMode = MANUAL;
+  run(10);
+  expect(millis() - watchdogFedAt < 5, "and feeding resumes with it");
+
+  command("sub resets=1000 reset_cause=1000");
+  sim::takeSerialOutput();
+  run(1100);
+  expect(contains(sim::takeSerialOutput(), "\"resets\":0,\"reset_cause\":1"), "both can be subscribed");
+}
+
+// A pass only ends in sleep when nothing is left that no interrupt would announce: a waiting line,
+// bytes queued for the UART, a link negotiation, wave cycles not yet encoded or a timed relay close.
+// With the default LED frames the UART keeps it awake for about a third of the time.
+void idleSleepScenario() {
+  boot(MANUAL, GRID);
+  run(2000);
+  unsigned long busy = 0;
+  for (int i = 0; i < 10000; i++) {
+    unsigned long before = millis();
+    run(1);
+    if (idleBusy()) busy += millis() - before;
+  }
+  expect(busy > 2000 && busy < 4000, "LED frames at 9600 baud keep it awake a third of the time");
+  while (idleBusy()) run(1);
+  expect(!idleBusy(), "a quiet pass may sleep");
+
+  sim::feedSerial("stats\n");
+  expect(idleBusy(), "a waiting line keeps it awake");
+  run(1);
+  expect(idleBusy(), "and so does the answer while it goes out");
+  while (idleBusy()) run(1);
+
+  command("link 19200", 1);
+  expect(linkState != LINK_IDLE && idleBusy(), "and a link negotiation");
+  while (linkState != LINK_IDLE) run(1);
+  while (idleBusy()) run(1);
+
+  command("stream gen");
+  while (idleBusy()) run(1);
+  for (int i = 0; i < WAVE_SAMPLE_RATE / 10; i++) {  // five cycles of 50 Hz, no pass in between
+    waveSample(512 + (int16_t)lround(300 * sin(2 * M_PI * 50 * i / WAVE_SAMPLE_RATE)));
+  }
+  expect(waveTail != waveHead && idleBusy(), "and cycles the loop hasn't encoded");
+  command("stream off");
+  while (idleBusy()) run(1);
+
+  expect(contains(command("@1 cfg idle_sleep 2"), "\"st\":\"err\""), "idle_sleep is 0 or 1");
+  expect(contains(command("@2 cfg idle_sleep 0"), "\"st\":\"ok\"") && config[CFG_IDLE_SLEEP] == 0,
+         "0 turns sleeping off");
+  expect(contains(command("stats"), "\"idle_pct\":0,\"sleep_max_us\":0"), "stats reports the sleep");
+}
+
+// With zc_sync a source relay's close goes out its pickup time ahead of a zero crossing of the
+// incoming source, so the contacts meet the crossing to within a few degrees and `timing` books it.
+// Without crossings the close waits ZC_LOCK_TIMEOUT past due and goes out untimed; a stream that
+// takes the sampler to the other source sends it out at once, since those crossings aren't its own.
+void zcSync() {
+  contacts[RELAY_GEN].pickupUs = 15000;
+  boot(MANUAL, GRID);  // with no crossings yet the grid relay's close is missed
+  command("cfg serial_update_interval 60000");
+  command("timing gen 15 30");
+  waveRun(3000);
+
+  sim::feedSerial("gen\n");
+  unsigned long start = millis();
+  while (sim::outputLevel(generator_relay) != HIGH && millis() - start < 1000) waveRun(1, 100);
+  contactsUpdate();  // the coil follows within a pass, 100 us
+  expect(zcState == ZC_CHECKING, "the close is timed to a crossing");
+  unsigned long met = contacts[RELAY_GEN].coilSince + contacts[RELAY_GEN].pickupUs;
+  double degrees = fmod(360 * waveHz * met / 1e6, 180);
+  expect(degrees < 5 || degrees > 175, "the contacts meet a crossing");
+  waveRun(100);
+  expect(zcCloses == 1 && zcState == ZC_IDLE, "which is checked");
+  expect(abs(zcLastError) <= 50 && zcErrorMax <= 50, "within 5 degrees");
+  expect(contains(command("timing"), "\"zc_closes\":1,\"zc_missed\":1"), "timing reports it");
+
+  command("grid");  // no crossings from here on
+  run(1000);
+  uint16_t missed = zcMissed;
+  sim::feedSerial("gen\n");
+  run(1);
+  start = millis();
+  while (sim::outputLevel(generator_relay) != HIGH && millis() - start < 1000) run(1);
+  unsigned long due = relayDropout[RELAY_GRID] + config[CFG_DEAD_TIME] - relayPickup[RELAY_GEN];
+  expect(millis() - start >= due + ZC_LOCK_TIMEOUT / 1000, "without crossings the close waits out the lock");
+  expect(millis() - start <= due + ZC_LOCK_TIMEOUT / 1000 + 5, "and then goes out");
+  expect(zcMissed == missed + 1 && zcState == ZC_IDLE, "as a missed crossing");
+
+  command("grid");
+  run(1000);
+  missed = zcMissed;
+  sim::feedSerial("gen\nstream grid\n");
+  start = millis();
+  while (sim::outputLevel(generator_relay) != HIGH && millis() - start < 1000) run(1);
+  expect(waveChannel == WAVE_GRID, "a stream takes the sampler");
+  expect(millis() - start < 60, "and the close doesn't wait out the lock");
+  expect(zcMissed == missed + 1 && zcState == ZC_IDLE, "but counts as missed");
+  command("stream off");
+
+  expect(contains(command("@1 cfg zc_sync 2"), "\"st\":\"err\""), "zc_sync is 0 or 1");
+}
+
+// Runs with the generator voltage model for soft_start: each circuit that goes onto the generator dips
+// the waveform by `dip` counts, which the regulator takes back at a count per ms unless it is stuck
+void softRun(unsigned long ms, int dip, bool recovers) {
+  static int lastOn = 0;
+  for (unsigned long i = 0; i < ms; i++) {
+    bool onGen = (outputLatch & 0x06) == 0x06;
+    int on = onGen ? __builtin_popcount(loadsOn) + 1 : 0;
+    if (on > lastOn) waveAmplitude -= dip * (on - lastOn);
+    lastOn = on;
+    if ((recovers || !onGen) && waveAmplitude < 300) waveAmplitude++;
+    waveRun(1);
+  }
+}
+
+// With soft_pct the circuits go onto the generator one at a time, each as soon as the voltage dip of
+// the step before has recovered, well ahead of the reconnect delays, and stats books the sequence.
+// A step that never recovers is undone after SOFT_STEP_TIMEOUT and the rest follow by their delays.
+void softStart() {
+  boot(FULLY_AUTO, GRID);
+  command("cfg assist_pct 0");
+  command("cfg warm_up_s 0");
+  command("cfg retransfer_s 5");
+  command("cfg serial_update_interval 60000");
+  softRun(3000, 40, true);
+  gridLive = false;
+  unsigned long start = millis();
+  while (transferState != TS_GEN && millis() - start < 10000) softRun(1, 40, true);
+  expect(softSettling() && waveUsers != 0, "the bus going on starts the sequence");
+  start = millis();
+  while (loadsOn != 0x0E && millis() - start < 5000) softRun(1, 40, true);
+  expect(loadsOn == 0x0E && millis() - start < 1000, "each step follows the recovery of the one before");
+  softRun(500, 40, true);
+  expect(softState == SOFT_DONE && waveUsers == 0, "and hands the sampler back when done");
+  expect(transferState == TS_GEN, "the dips aren't taken for a failed load");
+  std::string stats = command("stats");
+  expect(contains(stats, "\"soft_steps\":4,\"soft_timeouts\":0"), "stats counts the steps");
+  expect(!contains(stats, "\"soft_ms\":0,"), "and the time they took");
+
+  gridLive = true;
+  runUntil(TS_GRID, 20000);
+  softRun(1000, 40, true);
+  gridLive = false;
+  start = millis();
+  while (transferState != TS_GEN && millis() - start < 10000) softRun(1, 40, true);
+  while (loadsOn == 0 && millis() - start < 20000) softRun(1, 40, true);
+  unsigned long stepped = millis();
+  while (softState == SOFT_STEP && millis() - stepped < 10000) softRun(1, 40, false);  // the regulator gives up
+  expect(millis() - stepped >= SOFT_STEP_TIMEOUT - 10 && softTimeouts == 1, "a stuck step times out");
+  expect(loadsOn == 0, "and is undone");
+  softRun(30000, 0, true);
+  expect(loadsOn == 0x0E, "the rest follow by their reconnect delays");
+}
+
+// Runs with each unit's sense input live once its engine fires; the model has one waveform
+void crankRun(unsigned long ms) {
+  for (unsigned long i = 0; i < ms; i++) {
+    bool fired = false;
+    for (uint8_t u = 0; u < GEN_COUNT; u++) fired |= firedAt[u] != 0;
+    waveAmplitude = fired ? 300 : 0;
+    waveRun(1);
+  }
+}
+
+// The unit whose starter is engaged, -1 for none
+int cranking() {
+  for (uint8_t u = 0; u < GEN_COUNT; u++) {
+    if (genUnits[u].crank != NO_PIN && sim::outputLevel(genUnits[u].crank) == HIGH) return u;
+  }
+  return -1;
+}
+
+// A unit with a crank output is cranked for crank_s at a time with crank_rest_s between attempts. One
+// that hasn't fired after crank_tries attempts counts as failed and the next unit is cranked, and stats
+// counts the attempts. The sense input sees an engine fire before its ready input does, which takes
+// the starter off at once.
+void crankRetries() {
+  boot(FULLY_AUTO, GRID);
+  command("cfg assist_pct 0");
+  command("cfg warm_up_s 0");
+  command("cfg cool_down_s 0");
+  command("cfg crank_s 2");
+  command("cfg crank_rest_s 5");
+  command("cfg crank_tries 3");
+  command("cfg serial_update_interval 60000");
+  for (uint8_t u = 0; u < GEN_COUNT; u++) crankNeeds[u] = 60000;  // nothing fires yet
+  runUntil(TS_GRID, 5000);
+
+  gridLive = false;
+  unsigned long start = millis();
+  while (cranking() < 0 && millis() - start < 5000) crankRun(1);
+  const int lead = cranking();
+  expect(lead >= 0, "a grid loss cranks the lead unit");
+  if (lead < 0) return;
+  const int next = (lead + 1) % GEN_COUNT;
+  crankNeeds[next] = 500;
+
+  std::vector<unsigned long> on, off;
+  bool was = true;
+  on.push_back(millis());
+  while (cranking() != next && millis() - start < 30000) {
+    crankRun(1);
+    bool now = cranking() == lead;
+    if (now != was) (now ? on : off).push_back(millis());
+    was = now;
+  }
+  expect(on.size() == 3 && off.size() == 3, "the lead is cranked crank_tries times");
+  bool timed = true;
+  for (size_t i = 0; i < on.size() && i < off.size(); i++) {
+    timed &= off[i] - on[i] >= 2000 && off[i] - on[i] <= 2005;
+    if (i + 1 < on.size()) timed &= on[i + 1] - off[i] >= 5000 && on[i + 1] - off[i] <= 5005;
+  }
+  expect(timed, "for crank_s with crank_rest_s between");
+  expect(cranking() == next && (unitsFailed & (1 << lead)), "then it counts as failed and the next is cranked");
+  expect(transferState == TS_GEN_START, "while the transfer keeps waiting");
+  while (transferState != TS_GEN && millis() - start < 40000) crankRun(1);
+  expect(transferState == TS_GEN && cranking() < 0, "the next fires and takes the load");
+  expect(contains(command("stats"), "\"crank_attempts\":4"), "stats counts the attempts");
+
+  gridLive = true;
+  runUntil(TS_GRID, 60000);
+  for (uint8_t u = 0; u < GEN_COUNT; u++) {
+    crankNeeds[u] = 1000;
+    readyLag[u] = 800;
+  }
+  gridLive = false;
+  start = millis();
+  while (cranking() < 0 && millis() - start < 5000) crankRun(1);
+  const int unit = cranking();
+  while (firedAt[unit] == 0 && millis() - start < 10000) crankRun(1);
+  unsigned long fired = millis();
+  while (cranking() == unit && millis() - start < 10000) crankRun(1);
+  expect(millis() - fired <= 100 && digitalRead(genUnits[unit].ready) == LOW,
+         "the sense input takes the starter off before the unit is ready");
+  while (transferState != TS_GEN && millis() - start < 20000) crankRun(1);
+  expect(transferState == TS_GEN && !(waveUsers & WAVE_USER_CRANK), "it comes up and the sampler is handed back");
+}
+
+// The code of the last journal record, -1 for none
+int lastJournalCode() {
+  std::vector<JournalRecord> records;
+  if (!journalFrame(command("journal_dump"), records) || records.empty()) return -1;
+  return records.back().code;
+}
+
+// A load_check stuck live with the load off is a sensor fault: journaled, alarmed, counted once and
+// the input suspect until it agrees again. A dead load_check with the grid up is a load fault, which
+// takes everything off, while a dead one with the grid gone is the transfer logic's: the generator it
+// gives up on is counted once as a source fault.
+void plausibility() {
+  boot(MANUAL, STOP);
+  command("cfg serial_update_interval 60000");
+  run(3000);
+  loadCheckStuck = HIGH;
+  run(1900);
+  expect(faultCounts[FC_SENSOR] == 0, "a live load_check with the load off holds for 2 s");
+  run(200);
+  expect(faultCounts[FC_SENSOR] == 1 && (plausSuspect & 0x04), "then load_check is suspect");
+  expect(lastJournalCode() == JE_SENSOR && sim::outputLevel(alarm_pin) == HIGH, "journaled with the alarm");
+  run(5000);
+  expect(faultCounts[FC_SENSOR] == 1, "and counted once");
+  loadCheckStuck = -1;
+  run(100);
+  expect(plausSuspect == 0, "it is trusted again once it agrees");
+  expect(contains(command("stats"), "\"fault_sensor\":1,\"fault_source\":0,\"fault_load\":0,\"suspect\":0"),
+         "stats reports the faults");
+
+  // the grid goes: load_check follows it down, the transfer logic has it
+  boot(FULLY_AUTO, GRID);
+  command("cfg serial_update_interval 60000");
+  command("cfg crank_s 1");  // units with a starter give up within a second
+  command("cfg crank_tries 1");
+  runUntil(TS_GRID, 5000);
+  run(config[CFG_LOAD_CHECK_DELAY]);
+  genLive = false;
+  gridLive = false;
+  runUntil(TS_GEN_FAILED, 10000);
+  expect(faultCounts[FC_LOAD] == 0 && transferState == TS_GEN_FAILED, "a lost source is no load fault");
+  expect(faultCounts[FC_SOURCE] == 1, "the generator the transfer gives up on is a source fault");
+  run(3000);
+  expect(faultCounts[FC_SOURCE] == 1, "counted once while the power check has it");
+
+  gridLive = true;
+  genLive = true;
+  runUntil(TS_GRID, 60000);
+  run(config[CFG_LOAD_CHECK_DELAY] + 500);
+  loadCheckStuck = LOW;  // the load went with the grid up
+  run(config[CFG_LOAD_CHECK_DELAY] + 400);
+  expect(transferState == TS_LOAD_FAILED && faultCounts[FC_LOAD] == 1,
+         "a dead load with its source up is a load fault");
+  expect((outputLatch & RELAY_MASK) == 0 && sim::outputLevel(alarm_pin) == HIGH, "which takes it all off");
+  expect(lastJournalCode() == JE_LOAD_FAIL, "and is journaled");
+  loadCheckStuck = -1;
+}
+
+// Manual mode leaves the generator relay closed on a generator that doesn't come up. After the power
+// check delay and the rule's hold, that counts a source fault, with no load on it. The Mega's units
+// keep cranking in manual mode, which the rule waits out.
+void genFollows() {
+  boot(MANUAL, GRID);
+  run(3000);
+  genLive = false;
+  uint16_t source = faultCounts[FC_SOURCE];
+  uint16_t sensor = faultCounts[FC_SENSOR];
+  unsigned long start = millis();
+  command("gen");
+  while (faultCounts[FC_SOURCE] == source && millis() - start < 10000) run(1);
+  expect(millis() - start >= config[CFG_POWER_CHECK_DELAY] + 2000UL,
+         "the generator relay gets its power check and hold");
+  expect(faultCounts[FC_SOURCE] == source + 1 && (outputLatch & 0x06) == 0x02,
+         "then the generator is a source fault, with no load on it");
+  expect(faultCounts[FC_SENSOR] == sensor && plausSuspect == 0, "and generator_check isn't blamed");
+  genLive = true;
+  run(3000);
+  expect(!(plausTripped & (1 << PL_GEN_FOLLOWS)), "the rule ends once the generator is up");
+}
+
+struct Scenario {
+  const char *name;
+  void (*body)();
+  bool board = true;  // false where the pinout lacks what the scenario needs
+};
+
+const Scenario scenarios[] = {
+  { "trace_replay", traceReplay },
+  { "journal", journal },
+  { "gen_start_counters", genStartCounters },
+  { "xfer_resume", xferResume },
+  { "config_validation", configValidation },
+  { "fast_resume", fastResume },
+  { "framed_commands", framedCommands },
+  { "link_negotiation", linkNegotiation },
+  { "batch_atomicity", batchAtomicity },
+  { "sub_scheduling", subScheduling },
+  { "stream_decimation", streamDecimation },
+  { "time_sync", timeSync },
+  { "warm_up_cool_down", warmUpCoolDown },
+  { "retransfer_hysteresis", retransferHysteresis },
+  { "load_shedding", loadShedding, LOAD_COUNT > 1 },
+  { "pre_start", preStart, gen_run_pin != NO_PIN },
+  { "relay_timing", relayTiming },
+  { "semi_auto", semiAuto },
+  { "unit_rotation", unitRotation, GEN_COUNT > 1 },
+  { "watchdog", watchdog },
+  { "idle_sleep", idleSleepScenario },
+  { "zc_sync", zcSync },
+  { "soft_start", softStart, LOAD_COUNT > 1 },
+  { "crank_retries", crankRetries, GEN_COUNT > 1 },
+  { "plausibility", plausibility },
+  { "gen_follows", genFollows, gen_run_pin == NO_PIN },
+};
+
+bool runScenario(const Scenario &s) {
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    s.body();
+    fflush(stdout);
+    _exit(failures == 0 ? 0 : 1);
+  }
+  int status = 0;
+  waitpid(pid, &status, 0);
+  bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  printf("%-24s %s\n", s.name, ok ? "ok" : "FAILED");
+  return ok;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  int failed = 0;
+  int ran = 0;
+  for (const Scenario &s : scenarios) {
+    bool wanted = argc < 2;
+    for (int i = 1; i < argc; i++) wanted |= !strcmp(argv[i], s.name);
+    if (!wanted) continue;
+    ran++;
+    if (!s.board) {
+      printf("%-24s skipped on this pinout\n", s.name);
+      continue;
+    }
+    if (!runScenario(s)) failed++;
+  }
+  if (ran == 0) {
+    fprintf(stderr, "no such scenario\n");
+    return 2;
+  }
+  printf("%d of %d scenarios failed\n", failed, ran);
+  return failed == 0 ? 0 : 1;
+}
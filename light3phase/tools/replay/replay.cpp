@@ -0,0 +1,247 @@
+// Host replay of a field trace captured with `trace_on` / `trace_dump`.
+//
+// The firmware (src/main.cpp) is compiled into this tool against the shims in
+// shim/, the recorded input edges and commands are fed back on a simulated
+// clock, and the relay/alarm timeline the firmware produces is compared with
+// the one recorded in the field: every edge has to reach the same outputs in
+// the same order, within the timing tolerance of the recorded edge.
+//
+//   replay [-s step_us] [-t tolerance_ms] [-o timeline.txt] [-c timeline.txt] [-v] capture.bin
+//
+// capture.bin is the raw serial capture; the trace frame is located by its
+// A5 5A 'T' header, so surrounding JSON telemetry is ignored. -o saves the
+// replayed timeline; -c compares against a timeline saved that way by another
+// firmware revision instead of the field recording, which shows exactly how
+// two revisions differ on the same real-world input.
+
+#include "../../src/main.cpp"
+
+#include <stdio.h>
+
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+namespace {
+
+struct Event {
+  unsigned long t;  // ms from the base snapshot
+  uint8_t kind;
+  uint8_t value;
+};
+
+// State the oldest record starts from: the capture start, or the last record overwritten since
+struct Base {
+  uint8_t modes;
+  uint8_t inputs;
+  uint8_t outputs;
+  unsigned long uptime;  // ms since the firmware booted
+};
+
+const char *const commandNames[] = { "man", "semi", "auto", "gen", "grid", "stop", "confirm", "deny" };
+
+bool decodeTrace(const std::vector<uint8_t> &raw, Base &base, std::vector<Event> &events) {
+  for (size_t i = 0; i + 12 <= raw.size(); i++) {
+    if (raw[i] != FRAME_SYNC1 || raw[i + 1] != FRAME_SYNC2 || raw[i + 2] != 'T') continue;
+    if (raw[i + 3] != TRACE_VERSION) {
+      fprintf(stderr, "unsupported trace version %u\n", raw[i + 3]);
+      return false;
+    }
+    size_t count = raw[i + 4];
+    size_t end = i + 12 + count * 4;
+    if (end + 2 > raw.size()) break;
+
+    uint16_t crc = 0xFFFF;
+    for (size_t j = i + 2; j < end; j++) crc = crc16Update(crc, raw[j]);
+    if (crc != (uint16_t)(raw[end] | raw[end + 1] << 8)) {
+      fprintf(stderr, "trace frame at offset %zu fails CRC, skipping\n", i);
+      continue;
+    }
+
+    unsigned long uptime = raw[i + 8] | raw[i + 9] << 8 | (unsigned long)raw[i + 10] << 16 |
+                           (unsigned long)raw[i + 11] << 24;
+    base = { raw[i + 5], raw[i + 6], raw[i + 7], uptime };
+    unsigned long t = 0;
+    for (size_t n = 0; n < count; n++) {
+      const uint8_t *r = &raw[i + 12 + n * 4];
+      t += r[0] | r[1] << 8;
+      if (r[2] != TRACE_GAP) events.push_back({ t, r[2], r[3] });
+    }
+    return true;
+  }
+  fprintf(stderr, "no trace frame found\n");
+  return false;
+}
+
+uint8_t outputMask() {
+  uint8_t mask = 0;
+  if (sim::outputLevel(grid_relay) == HIGH) mask |= 0x01;
+  if (sim::outputLevel(generator_relay) == HIGH) mask |= 0x02;
+  if (sim::outputLevel(load_relay) == HIGH) mask |= 0x04;
+  if (sim::outputLevel(alarm_pin) == HIGH) mask |= 0x08;
+  return mask;
+}
+
+void applyInputs(uint8_t mask) {
+  sim::setInput(grid_check, mask & 0x01 ? HIGH : LOW);
+  sim::setInput(generator_check, mask & 0x02 ? HIGH : LOW);
+  sim::setInput(load_check, mask & 0x04 ? HIGH : LOW);
+  sim::setInput(menu_button, mask & 0x08 ? HIGH : LOW);
+  sim::setInput(select_button, mask & 0x10 ? HIGH : LOW);
+}
+
+void printMask(const char *label, unsigned long t, uint8_t mask) {
+  printf("%8lu ms  %-8s grid=%d gen=%d load=%d alarm=%d\n", t, label, mask & 0x01 ? 1 : 0,
+         mask & 0x02 ? 1 : 0, mask & 0x04 ? 1 : 0, mask & 0x08 ? 1 : 0);
+}
+
+// Timelines are saved as one "t_ms mask" line per edge
+bool readTimeline(const char *path, std::vector<Event> &timeline) {
+  FILE *f = fopen(path, "r");
+  if (!f) return false;
+  unsigned long t;
+  unsigned mask;
+  while (fscanf(f, "%lu %u", &t, &mask) == 2) timeline.push_back({ t, TRACE_OUTPUTS, (uint8_t)mask });
+  fclose(f);
+  return true;
+}
+
+bool writeTimeline(const char *path, const std::vector<Event> &timeline) {
+  FILE *f = fopen(path, "w");
+  if (!f) return false;
+  for (const Event &e : timeline) fprintf(f, "%lu %u\n", e.t, e.value);
+  fclose(f);
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  unsigned long stepMicros = 1000;
+  unsigned long tolerance = 2;
+  bool verbose = false;
+  const char *path = nullptr;
+  const char *savePath = nullptr;
+  const char *comparePath = nullptr;
+
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+      stepMicros = strtoul(argv[++i], nullptr, 10);
+    } else if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+      tolerance = strtoul(argv[++i], nullptr, 10);
+    } else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+      savePath = argv[++i];
+    } else if (!strcmp(argv[i], "-c") && i + 1 < argc) {
+      comparePath = argv[++i];
+    } else if (!strcmp(argv[i], "-v")) {
+      verbose = true;
+    } else {
+      path = argv[i];
+    }
+  }
+  if (!path || stepMicros == 0) {
+    fprintf(stderr, "usage: %s [-s step_us] [-t tolerance_ms] [-o timeline.txt] [-c timeline.txt] [-v] "
+                    "capture.bin\n", argv[0]);
+    return 2;
+  }
+
+  std::ifstream in(path, std::ios::binary);
+  std::vector<uint8_t> raw((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+  Base start;
+  std::vector<Event> events;
+  if (!decodeTrace(raw, start, events)) return 2;
+
+  std::vector<Event> recorded, replayed;
+  if (comparePath) {
+    if (!readTimeline(comparePath, recorded)) {
+      fprintf(stderr, "can't read %s\n", comparePath);
+      return 2;
+    }
+  } else {
+    recorded.push_back({ 0, TRACE_OUTPUTS, start.outputs });
+    for (const Event &e : events) {
+      if (e.kind == TRACE_OUTPUTS) recorded.push_back(e);
+    }
+  }
+
+  // boot into the modes the oldest record starts from and hold its inputs up to the uptime it was
+  // taken at, so the firmware's own timers run in the same phase as in the field
+  sim::reset();
+  EEPROM.write(modeAddress, start.modes >> 4);
+  EEPROM.write(controlModeAddress, start.modes & 0x0F);
+  applyInputs(start.inputs);
+
+  setup();
+  while (millis() < start.uptime) {
+    loop();
+    sim::advanceMicros(stepMicros);
+  }
+  sim::takeSerialOutput();
+  unsigned long base = start.uptime;
+  unsigned long end = events.empty() ? 0 : events.back().t + 5000;
+
+  // the outputs the replay starts from count from the base uptime, not from the end of a first pass
+  // that may be held up by a JSON frame
+  size_t next = 0;
+  int lastMask = outputMask();
+  replayed.push_back({ 0, TRACE_OUTPUTS, (uint8_t)lastMask });
+  for (unsigned long now = 0; now <= end; now = millis() - base) {
+    for (; next < events.size() && events[next].t <= now; next++) {
+      const Event &e = events[next];
+      if (e.kind == TRACE_INPUTS) {
+        applyInputs(e.value);
+        if (verbose) printf("%8lu ms  inputs   %02x (recorded at %lu ms)\n", now, e.value, e.t);
+      } else if (e.kind == TRACE_COMMAND && e.value < sizeof(commandNames) / sizeof(commandNames[0])) {
+        sim::feedSerial(std::string(commandNames[e.value]) + "\n");
+        if (verbose) printf("%8lu ms  command  %s\n", now, commandNames[e.value]);
+      } else if (e.kind == TRACE_BATCH && (e.value >> 4) <= FULLY_AUTO && (e.value & 0x0F) <= STOP) {
+        // mode names are command ids 0-2, control names follow at 3-5; only manual mode takes a source
+        std::string batch = std::string("batch ") + commandNames[e.value >> 4];
+        if ((e.value >> 4) == MANUAL) batch += std::string(" ") + commandNames[3 + (e.value & 0x0F)];
+        sim::feedSerial(batch + "\n");
+        if (verbose) printf("%8lu ms  command  %s\n", now, batch.c_str());
+      }
+    }
+
+    loop();
+
+    // the firmware stamps an output change at the end of the pass that made it
+    uint8_t mask = outputMask();
+    if (mask != lastMask) {
+      replayed.push_back({ millis() - base, TRACE_OUTPUTS, mask });
+      lastMask = mask;
+    }
+    std::string serialOut = sim::takeSerialOutput();
+    if (verbose && !serialOut.empty()) printf("%8lu ms  serial   %s\n", now, serialOut.c_str());
+    sim::advanceMicros(stepMicros);
+  }
+
+  if (savePath && !writeTimeline(savePath, replayed)) {
+    fprintf(stderr, "can't write %s\n", savePath);
+    return 2;
+  }
+
+  const char *label = comparePath ? "other" : "field";
+  printf("recorded outputs:\n");
+  for (const Event &e : recorded) printMask(label, e.t, e.value);
+  printf("replayed outputs:\n");
+  for (const Event &e : replayed) printMask("replay", e.t, e.value);
+
+  bool same = recorded.size() == replayed.size();
+  bool inTime = true;
+  for (size_t i = 0; same && i < recorded.size(); i++) {
+    same = recorded[i].value == replayed[i].value;
+    long skew = (long)replayed[i].t - (long)recorded[i].t;
+    if (same && (unsigned long)labs(skew) > tolerance) {
+      printf("edge %zu is %+ld ms off\n", i, skew);
+      inTime = false;
+    }
+  }
+  if (!same) {
+    printf("output sequence differs\n");
+  } else {
+    printf(inTime ? "output timeline matches within %lu ms\n"
+                  : "output timeline is off by more than %lu ms\n", tolerance);
+  }
+  return same && inTime ? 0 : 1;
+}
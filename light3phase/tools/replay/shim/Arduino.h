@@ -0,0 +1,145 @@
+// Host stand-in for the parts of the Arduino core the firmware uses. Time,
+// pins and the serial link are simulated so src/main.cpp can run unmodified
+// and deterministically on a PC. Serial output takes as long as it would on
+// the wire at the configured baud rate.
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+#define F_CPU 16000000UL
+#define PROGMEM
+#define PSTR(s) (s)
+#define F(s) (reinterpret_cast<const __FlashStringHelper *>(s))
+#define pgm_read_byte(p) (*(const uint8_t *)(p))
+#define pgm_read_word(p) (*(p))
+#define pgm_read_dword(p) (*(p))
+#define strcmp_P strcmp
+#define strncmp_P strncmp
+#define strlen_P strlen
+#define strcpy_P strcpy
+typedef const char *PGM_P;
+class __FlashStringHelper;
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define HIGH 0x1
+#define LOW 0x0
+#define INPUT 0x0
+#define OUTPUT 0x1
+#define INPUT_PULLUP 0x2
+
+// Nano pin numbering, or the Mega's when built with -D__AVR_ATmega2560__
+#if defined(__AVR_ATmega2560__)
+#define A0 54
+#define A1 55
+#define A2 56
+#define A3 57
+#define A4 58
+#define A5 59
+#define A6 60
+#define A7 61
+#define A8 62
+#define A9 63
+#define A10 64
+#define A11 65
+#define SIM_PIN_COUNT 70
+#define E2END 0xFFF    // last EEPROM address, as in the avr-libc device headers
+#else
+#define A0 14
+#define A1 15
+#define A2 16
+#define A3 17
+#define A4 18
+#define A5 19
+#define A6 20
+#define A7 21
+#define SIM_PIN_COUNT 22
+#define E2END 0x3FF    // ATmega328P
+#endif
+
+void pinMode(int pin, int mode);
+void digitalWrite(int pin, int level);
+int digitalRead(int pin);
+int analogRead(int pin);
+inline void noInterrupts() {}
+inline void interrupts() {}
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+class String {
+ public:
+  String() {}
+  String(const char *s) : s_(s) {}
+  String(const std::string &s) : s_(s) {}
+  String &operator+=(char c) { s_ += c; return *this; }
+  String &operator+=(const char *s) { s_ += s; return *this; }
+  bool operator==(const char *s) const { return s_ == s; }
+  bool operator!=(const char *s) const { return s_ != s; }
+  unsigned int length() const { return s_.size(); }
+  const char *c_str() const { return s_.c_str(); }
+  bool startsWith(const char *prefix) const { return s_.compare(0, strlen(prefix), prefix) == 0; }
+  int indexOf(char c) const { return indexOf(c, 0); }
+  int indexOf(char c, int from) const { size_t i = s_.find(c, from); return i == std::string::npos ? -1 : (int)i; }
+  String substring(unsigned int from) const { return from < s_.size() ? String(s_.substr(from)) : String(); }
+  String substring(unsigned int from, unsigned int to) const {
+    return from < to && from < s_.size() ? String(s_.substr(from, to - from)) : String();
+  }
+  void trim() {
+    size_t b = s_.find_first_not_of(" \t\r\n");
+    size_t e = s_.find_last_not_of(" \t\r\n");
+    s_ = b == std::string::npos ? std::string() : s_.substr(b, e - b + 1);
+  }
+  long toInt() const { return atol(s_.c_str()); }
+
+ private:
+  std::string s_;
+};
+
+// Same as the AVR core; one slot of the ring stays free
+#define SERIAL_TX_BUFFER_SIZE 64
+
+class HardwareSerial {
+ public:
+  void begin(unsigned long baud);
+  void end() {}
+  int available();
+  int read();
+  int peek();
+  int availableForWrite();
+  void flush();
+  size_t write(uint8_t b);
+  size_t write(const uint8_t *buf, size_t len);
+  size_t print(const char *s);
+  size_t print(const __FlashStringHelper *s) { return print(reinterpret_cast<const char *>(s)); }
+  size_t print(const String &s) { return print(s.c_str()); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(long n);
+  size_t print(unsigned long n);
+  size_t print(int n) { return print((long)n); }
+  size_t print(unsigned int n) { return print((unsigned long)n); }
+  size_t println() { return print("\r\n"); }
+  template <typename T>
+  size_t println(const T &v) { size_t n = print(v); return n + println(); }
+  explicit operator bool() const { return true; }
+};
+
+extern HardwareSerial Serial;
+
+// Simulation controls used by the host tools
+namespace sim {
+void reset();
+void advanceMicros(unsigned long us);
+void setInput(int pin, int level);
+void setAnalog(int pin, int value);  // analogRead() result, 512 (mid-rail) by default
+int outputLevel(int pin);
+void feedSerial(const std::string &bytes);
+unsigned long serialBaud();
+size_t serialGarbled();
+std::string takeSerialOutput();
+}
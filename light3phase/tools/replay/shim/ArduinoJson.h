@@ -0,0 +1,55 @@
+// Host stand-in for the slice of ArduinoJson the firmware uses: a flat
+// document of scalar members serialized in insertion order.
+#pragma once
+
+#include <stdio.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "Arduino.h"
+
+class JsonDocument {
+ public:
+  class Member {
+   public:
+    Member(std::string &slot) : slot_(slot) {}
+    Member &operator=(bool v) { slot_ = v ? "true" : "false"; return *this; }
+    Member &operator=(int v) { return number(v); }
+    Member &operator=(long v) { return number(v); }
+    Member &operator=(unsigned int v) { return number(v); }
+    Member &operator=(unsigned long v) { return number(v); }
+    Member &operator=(const char *v) { slot_ = std::string("\"") + v + "\""; return *this; }
+
+   private:
+    template <typename T>
+    Member &number(T v) { slot_ = std::to_string(v); return *this; }
+    std::string &slot_;
+  };
+
+  Member operator[](const char *key) {
+    for (auto &m : members_) {
+      if (m.first == key) return Member(m.second);
+    }
+    members_.emplace_back(key, "null");
+    return Member(members_.back().second);
+  }
+
+  Member operator[](const __FlashStringHelper *key) { return (*this)[reinterpret_cast<const char *>(key)]; }
+
+  std::string serialize() const {
+    std::string out = "{";
+    for (size_t i = 0; i < members_.size(); i++) {
+      if (i) out += ",";
+      out += "\"" + members_[i].first + "\":" + members_[i].second;
+    }
+    return out + "}";
+  }
+
+ private:
+  std::vector<std::pair<std::string, std::string>> members_;
+};
+
+inline size_t serializeJson(const JsonDocument &doc, HardwareSerial &out) {
+  return out.print(doc.serialize().c_str());
+}
@@ -0,0 +1,33 @@
+// Host stand-in for the AVR EEPROM library: E2END + 1 bytes, erased to 0xFF.
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include "Arduino.h"
+
+class EEPROMClass {
+ public:
+  EEPROMClass() { memset(data_, 0xFF, sizeof(data_)); }
+  uint8_t read(int address) const { return data_[address]; }
+  void write(int address, uint8_t value) { data_[address] = value; writes_++; }
+  void update(int address, uint8_t value) {
+    if (data_[address] != value) write(address, value);
+  }
+  uint16_t length() const { return sizeof(data_); }
+  template <typename T>
+  T &get(int address, T &t) const { memcpy(&t, data_ + address, sizeof(T)); return t; }
+  template <typename T>
+  const T &put(int address, const T &t) {
+    const uint8_t *p = (const uint8_t *)&t;
+    for (size_t i = 0; i < sizeof(T); i++) update(address + i, p[i]);
+    return t;
+  }
+  unsigned long writeCount() const { return writes_; }
+
+ private:
+  uint8_t data_[E2END + 1];
+  unsigned long writes_ = 0;
+};
+
+extern EEPROMClass EEPROM;
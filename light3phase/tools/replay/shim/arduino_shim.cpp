@@ -0,0 +1,139 @@
+// Simulated clock, pins, serial link and EEPROM behind the Arduino stand-in.
+#include "Arduino.h"
+#include "EEPROM.h"
+
+#include <deque>
+
+HardwareSerial Serial;
+EEPROMClass EEPROM;
+
+namespace {
+unsigned long long nowMicros = 0;
+int pinLevels[SIM_PIN_COUNT];
+int analogLevels[SIM_PIN_COUNT];
+std::deque<uint8_t> rxQueue;
+std::string txBytes;
+unsigned long baudRate = 9600;
+size_t txQueued = 0;                 // bytes waiting in the simulated UART buffer
+unsigned long long txBusyUntil = 0;  // when the last queued byte has left the wire
+size_t garbledBytes = 0;             // bytes cut off by a rate change
+
+unsigned long long byteMicros() { return 10000000ULL / baudRate; }  // start + 8 data + stop bits
+
+// Let the UART drain whatever it could have sent by now
+void drainTx() {
+  while (txQueued > 0) {
+    unsigned long long lastStart = txBusyUntil - txQueued * byteMicros();
+    if (lastStart + byteMicros() > nowMicros) break;
+    txQueued--;
+  }
+}
+}  // namespace
+
+namespace sim {
+void reset() {
+  nowMicros = 0;
+  memset(pinLevels, 0, sizeof(pinLevels));
+  for (int i = 0; i < SIM_PIN_COUNT; i++) analogLevels[i] = 512;
+  rxQueue.clear();
+  txBytes.clear();
+  baudRate = 9600;
+  txQueued = 0;
+  txBusyUntil = 0;
+  garbledBytes = 0;
+}
+
+void advanceMicros(unsigned long us) { nowMicros += us; }
+
+void setInput(int pin, int level) {
+  if (pin >= 0 && pin < SIM_PIN_COUNT) pinLevels[pin] = level;
+}
+
+void setAnalog(int pin, int value) {
+  if (pin >= 0 && pin < SIM_PIN_COUNT) analogLevels[pin] = value;
+}
+
+int outputLevel(int pin) { return pin >= 0 && pin < SIM_PIN_COUNT ? pinLevels[pin] : LOW; }
+
+void feedSerial(const std::string &bytes) { rxQueue.insert(rxQueue.end(), bytes.begin(), bytes.end()); }
+
+unsigned long serialBaud() { return baudRate; }
+
+size_t serialGarbled() { return garbledBytes; }
+
+std::string takeSerialOutput() {
+  std::string out;
+  out.swap(txBytes);
+  return out;
+}
+}  // namespace sim
+
+void pinMode(int, int) {}
+
+void digitalWrite(int pin, int level) { sim::setInput(pin, level ? HIGH : LOW); }
+
+int digitalRead(int pin) { return sim::outputLevel(pin); }
+
+int analogRead(int pin) { return pin >= 0 && pin < SIM_PIN_COUNT ? analogLevels[pin] : 512; }
+
+unsigned long millis() { return (unsigned long)(nowMicros / 1000); }
+
+unsigned long micros() { return (unsigned long)nowMicros; }
+
+void delay(unsigned long ms) { nowMicros += (unsigned long long)ms * 1000; }
+
+void delayMicroseconds(unsigned int us) { nowMicros += us; }
+
+// Like the AVR core, a rate change doesn't wait: what has not left yet goes out garbled
+void HardwareSerial::begin(unsigned long baud) {
+  drainTx();
+  garbledBytes += txQueued;
+  txQueued = 0;
+  txBusyUntil = nowMicros;
+  baudRate = baud;
+}
+
+void HardwareSerial::flush() {
+  if (txBusyUntil > nowMicros) nowMicros = txBusyUntil;
+  txQueued = 0;
+}
+
+int HardwareSerial::available() { return (int)rxQueue.size(); }
+
+int HardwareSerial::read() {
+  if (rxQueue.empty()) return -1;
+  uint8_t b = rxQueue.front();
+  rxQueue.pop_front();
+  return b;
+}
+
+int HardwareSerial::peek() { return rxQueue.empty() ? -1 : rxQueue.front(); }
+
+int HardwareSerial::availableForWrite() {
+  drainTx();
+  return (int)(SERIAL_TX_BUFFER_SIZE - 1 - txQueued);
+}
+
+// Like the AVR core, writing to a full buffer waits until the UART frees a slot
+size_t HardwareSerial::write(uint8_t b) {
+  drainTx();
+  if (txQueued >= SERIAL_TX_BUFFER_SIZE - 1) {
+    nowMicros = txBusyUntil - (txQueued - 1) * byteMicros();
+    drainTx();
+  }
+  txBusyUntil = (txBusyUntil > nowMicros ? txBusyUntil : nowMicros) + byteMicros();
+  txQueued++;
+  txBytes += (char)b;
+  return 1;
+}
+
+size_t HardwareSerial::write(const uint8_t *buf, size_t len) {
+  for (size_t i = 0; i < len; i++) write(buf[i]);
+  return len;
+}
+
+size_t HardwareSerial::print(const char *s) { return write((const uint8_t *)s, strlen(s)); }
+
+size_t HardwareSerial::print(long n) { return print(std::to_string(n).c_str()); }
+
+size_t HardwareSerial::print(unsigned long n) { return print(std::to_string(n).c_str()); }